@@ -0,0 +1,4 @@
+from .tdf_writer_cpp import TdfWriter, WorkerPool, MemoryBudget, numa_node_cpus
+from .aio import AsyncTdfWriter
+
+__all__ = ["TdfWriter", "AsyncTdfWriter", "WorkerPool", "MemoryBudget", "numa_node_cpus"]
@@ -0,0 +1,78 @@
+"""asyncio front end of TdfWriter.
+
+AsyncTdfWriter queues frames from coroutines: while the writer has no room
+for a frame, add_frame suspends until the writer's threads report some,
+instead of blocking the event loop, so one loop can feed several writers
+without a thread per writer.
+"""
+
+import asyncio
+
+import numpy as np
+
+from .tdf_writer_cpp import TdfWriter
+
+
+def _resolve(future):
+    if not future.done():
+        future.set_result(None)
+
+
+def _waker(loop, future):
+    # Called on a writer thread; the loop may be closed by then.
+    def wake():
+        try:
+            loop.call_soon_threadsafe(_resolve, future)
+        except RuntimeError:
+            pass
+    return wake
+
+
+class AsyncTdfWriter:
+    """TdfWriter for asyncio producers; takes the same arguments.
+
+    add_frame and close are coroutines. Frames are queued in the order the
+    add_frame calls complete; await each call before the next one to keep
+    them in order. The arrays must not be modified until close() returns,
+    as with TdfWriter.
+    """
+
+    def __init__(self, *args, **kwargs):
+        self.writer = TdfWriter(*args, **kwargs)
+
+    async def add_frame(self, scan_offsets, tof_indices, intensities,
+                        time=0.0, polarity="+", scan_mode=0, msms_type=0):
+        # Converted once here rather than on every try.
+        frame = (np.ascontiguousarray(scan_offsets, dtype=np.uint32),
+                 np.ascontiguousarray(tof_indices, dtype=np.uint32),
+                 np.ascontiguousarray(intensities, dtype=np.uint32),
+                 time, polarity, scan_mode, msms_type)
+        loop = asyncio.get_running_loop()
+        while not self.writer.try_add_frame(*frame):
+            space = loop.create_future()
+            self.writer.on_space(_waker(loop, space))
+            if self.writer.try_add_frame(*frame):
+                break
+            await space
+
+    async def close(self):
+        """Wait for all frames to be written and finalize both files;
+        raises the error if writing a frame failed."""
+        loop = asyncio.get_running_loop()
+        done = loop.create_future()
+        self.writer.close_async(_waker(loop, done))
+        await done
+        self.writer.close()
+
+    def cancel(self):
+        self.writer.cancel()
+
+    def stats(self):
+        return self.writer.stats()
+
+    def block_index(self):
+        return self.writer.block_index()
+
+    @property
+    def resumed_frames(self):
+        return self.writer.resumed_frames
@@ -0,0 +1,162 @@
+#ifndef TDF_WRITER_ADAPTIVE_LEVEL_HPP
+#define TDF_WRITER_ADAPTIVE_LEVEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+
+// Compression level that follows the pipeline's backpressure, shared by
+// all compressors of one pipeline (see TdfFrameCompressor).
+//
+// The queue occupancies tell where the bottleneck is:
+//   - reorder queue filling up: the reducer / disk cannot keep up and the
+//     mappers sit in their pushes, so there is CPU to spare: level up;
+//   - input buffer filling up (reorder queue not): compression is the
+//     bottleneck and add_input blocks: level down;
+//   - both nearly empty: frames arrive slower than they can be
+//     compressed: level up.
+// A sampler thread reads both occupancies every sample_period; every
+// interval samples their means are compared against the watermarks and
+// the level moves by one step within [min_level, max_level], so it
+// settles at the highest level the hardware sustains at the current input
+// rate. Sampling on a clock rather than per frame matters: the mappers
+// only get to run right after the queues have moved in their favour, so
+// what they would see is biased towards "no backpressure".
+//
+// The controller starts at min_level. It can only be attached once the
+// pipeline (whose mapper factory captures it) exists, and must be
+// detached before the pipeline is destroyed:
+//
+//     auto level = std::make_shared<AdaptiveCompressionLevel>(AdaptiveLevelOptions{1, 9});
+//     Dispatcher<TdfFrameMapper, TdfCollector> dispatcher(
+//         [level]() { return std::make_unique<TdfFrameMapper>(1, level); }, ...);
+//     level->attach(dispatcher);
+//     ...
+//     dispatcher.close();
+//     level->detach();
+struct AdaptiveLevelOptions
+{
+    int min_level = 1;
+    int max_level = 9;
+    // Samples averaged per adjustment, and the time between samples.
+    size_t interval = 50;
+    std::chrono::microseconds sample_period{1000};
+    // Occupancies as fractions of the container capacity.
+    double high_watermark = 0.75;
+    double low_watermark = 0.25;
+};
+
+class AdaptiveCompressionLevel
+{
+    AdaptiveLevelOptions settings;
+    std::atomic<int> current;
+    std::atomic<uint64_t> level_changes = 0;
+
+    std::mutex mtx;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+    std::thread sampler;
+
+    void step(double input, double reorder)
+    {
+        int direction = 0;
+        if(reorder >= settings.high_watermark) {
+            direction = 1;
+        } else if(input >= settings.high_watermark) {
+            direction = -1;
+        } else if(input <= settings.low_watermark) {
+            direction = 1;
+        }
+        const int level = current.load(std::memory_order_relaxed);
+        const int next = std::clamp(level + direction, settings.min_level, settings.max_level);
+        if(next != level) {
+            current.store(next, std::memory_order_relaxed);
+            level_changes.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void run_sampler(std::function<double()> input_fill, std::function<double()> reorder_fill)
+    {
+        double input_sum = 0;
+        double reorder_sum = 0;
+        size_t samples = 0;
+        std::unique_lock<std::mutex> lock(mtx);
+        while(!stop_cv.wait_for(lock, settings.sample_period, [this]() { return stopping; })) {
+            input_sum += std::clamp(input_fill(), 0.0, 1.0);
+            reorder_sum += std::clamp(reorder_fill(), 0.0, 1.0);
+            if(++samples == settings.interval) {
+                step(input_sum / static_cast<double>(samples), reorder_sum / static_cast<double>(samples));
+                input_sum = 0;
+                reorder_sum = 0;
+                samples = 0;
+            }
+        }
+    }
+
+public:
+    explicit AdaptiveCompressionLevel(const AdaptiveLevelOptions& options)
+        : settings(options), current(options.min_level)
+    {
+        if(settings.min_level > settings.max_level) {
+            throw std::invalid_argument("Minimum compression level exceeds the maximum");
+        }
+        if(settings.interval == 0 || settings.sample_period.count() <= 0) {
+            throw std::invalid_argument("Sampling interval and period must be greater than zero");
+        }
+        if(!(settings.low_watermark <= settings.high_watermark)) {
+            throw std::invalid_argument("Low watermark exceeds the high watermark");
+        }
+    }
+
+    AdaptiveCompressionLevel(const AdaptiveCompressionLevel&) = delete;
+    AdaptiveCompressionLevel& operator=(const AdaptiveCompressionLevel&) = delete;
+
+    // Starts following pipeline, a Dispatcher or PooledStream (anything
+    // with input_fill() and reorder_fill()). May be called once.
+    template <typename Pipeline>
+    void attach(const Pipeline& pipeline)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(sampler.joinable() || stopping) {
+            throw std::logic_error("Compression level controller is already attached");
+        }
+        sampler = std::thread(&AdaptiveCompressionLevel::run_sampler, this,
+                              [&pipeline]() { return pipeline.input_fill(); },
+                              [&pipeline]() { return pipeline.reorder_fill(); });
+    }
+
+    // Stops sampling and freezes the level; thread-safe and idempotent.
+    void detach()
+    {
+        std::thread stopped;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+            stopped = std::move(sampler);
+        }
+        stop_cv.notify_all();
+        if(stopped.joinable()) {
+            stopped.join();
+        }
+    }
+
+    // Level for the next frame. Thread-safe and cheap enough to call for
+    // every frame.
+    inline int level() const { return current.load(std::memory_order_relaxed); }
+    inline uint64_t changes() const { return level_changes.load(std::memory_order_relaxed); }
+    inline const AdaptiveLevelOptions& options() const { return settings; }
+
+    ~AdaptiveCompressionLevel()
+    {
+        detach();
+    }
+};
+
+#endif // TDF_WRITER_ADAPTIVE_LEVEL_HPP
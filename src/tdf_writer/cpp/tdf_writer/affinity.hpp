@@ -0,0 +1,163 @@
+#ifndef TDF_WRITER_AFFINITY_HPP
+#define TDF_WRITER_AFFINITY_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+
+// Thread placement helpers for Dispatcher (Linux). NUMA topology is read
+// from /sys/devices/system/node; on machines without it every CPU counts
+// as node 0.
+
+enum class AffinityPolicy
+{
+    none,       // Leave placement to the scheduler
+    compact,    // Fill the CPUs of one NUMA node before moving to the next
+    scatter,    // Spread consecutive threads over the NUMA nodes
+};
+
+inline AffinityPolicy parse_affinity_policy(const std::string& name)
+{
+    if(name == "none") return AffinityPolicy::none;
+    if(name == "compact") return AffinityPolicy::compact;
+    if(name == "scatter") return AffinityPolicy::scatter;
+    throw std::invalid_argument("Affinity policy must be 'none', 'compact' or 'scatter'");
+}
+
+// Parses the kernel's cpulist format, e.g. "0-3,8,10-11".
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while(pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if(end == std::string::npos) end = list.size();
+        const std::string range = list.substr(pos, end - pos);
+        pos = end + 1;
+        if(range.find_first_not_of(" \n") == std::string::npos) continue;
+        try {
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for(int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch(const std::logic_error&) {
+            throw std::invalid_argument("Invalid CPU list: " + list);
+        }
+    }
+    return cpus;
+}
+
+// CPUs this process may run on.
+inline std::vector<int> allowed_cpus()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if(sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return cpus;
+    }
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// CPUs of a NUMA node, e.g. the node an NVMe drive or NIC is attached to
+// (/sys/class/nvme/nvme0/device/numa_node).
+inline std::vector<int> numa_node_cpus(int node)
+{
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if(node < 0 || !std::getline(file, list)) {
+        throw std::invalid_argument("Unknown NUMA node " + std::to_string(node));
+    }
+    return parse_cpu_list(list);
+}
+
+// Allowed CPUs in the order Dispatcher assigns them to threads under policy.
+inline std::vector<int> ordered_cpus(AffinityPolicy policy)
+{
+    if(policy == AffinityPolicy::none) {
+        return {};
+    }
+    const std::vector<int> allowed = allowed_cpus();
+    std::map<int, std::vector<int>> by_node;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string nodes;
+    std::getline(online, nodes);
+    for(int node : parse_cpu_list(nodes)) {
+        for(int cpu : numa_node_cpus(node)) {
+            if(std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                by_node[node].push_back(cpu);
+            }
+        }
+    }
+    if(by_node.empty()) {
+        by_node[0] = allowed;
+    }
+    std::vector<int> cpus;
+    if(policy == AffinityPolicy::compact) {
+        for(const auto& [node, node_cpus] : by_node) {
+            cpus.insert(cpus.end(), node_cpus.begin(), node_cpus.end());
+        }
+    } else {
+        for(size_t i = 0; cpus.size() < allowed.size(); ++i) {
+            size_t added = 0;
+            for(const auto& [node, node_cpus] : by_node) {
+                if(i < node_cpus.size()) {
+                    cpus.push_back(node_cpus[i]);
+                    ++added;
+                }
+            }
+            if(added == 0) break;
+        }
+    }
+    return cpus;
+}
+
+// Throws std::invalid_argument unless every CPU may be used by this process.
+inline void check_cpus(const std::vector<int>& cpus)
+{
+    const std::vector<int> allowed = allowed_cpus();
+    for(int cpu : cpus) {
+        if(std::find(allowed.begin(), allowed.end(), cpu) == allowed.end()) {
+            throw std::invalid_argument("CPU " + std::to_string(cpu) + " is not available to this process");
+        }
+    }
+}
+
+// Restricts thread to cpus; an empty list leaves it as is. Throws
+// std::runtime_error if the kernel refuses, e.g. because a CPU went
+// offline or the cpuset changed since check_cpus().
+inline void pin_thread(pthread_t thread, const std::vector<int>& cpus)
+{
+    if(cpus.empty()) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu : cpus) {
+        if(cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    const int rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if(rc != 0) {
+        throw std::runtime_error("Failed to pin thread to its CPUs: " + std::string(std::strerror(rc)));
+    }
+}
+
+inline void pin_current_thread(const std::vector<int>& cpus)
+{
+    pin_thread(pthread_self(), cpus);
+}
+
+#endif // TDF_WRITER_AFFINITY_HPP
@@ -0,0 +1,435 @@
+// Throughput benchmarks for the Dispatcher pipeline and its containers.
+//
+// Usage: tdf_writer_bench [containers|pipeline|kernels|all] [options]
+//   --items N         items per container run (default 1000000)
+//   --frames N        frames per pipeline run (default 2000)
+//   --threads a,b,..  mapper / consumer thread counts to sweep
+//                     (default 1, 2, 4, ... up to the hardware threads)
+//   --rounds N        passes over the data per kernel run (default 50)
+//   --output PATH     file written by the pipeline runs (default
+//                     tdf_writer_bench.bin in the working directory)
+//
+// Results are printed one run per line as comma-separated values, so runs
+// on different builds or nodes can be diffed or plotted.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "dispatcher.hpp"
+#include "file_collector.hpp"
+#include "frame.hpp"
+#include "mpmc_ring.hpp"
+#include "offset_writer.hpp"
+#include "ordered_queue.hpp"
+#include "simd_kernels.hpp"
+#include "stats.hpp"
+#include "sync_buffer.hpp"
+#include "tdf_compressor.hpp"
+#include "work_stealing_buffer.hpp"
+
+
+namespace {
+
+struct BenchConfig
+{
+    size_t items = 1000000;
+    size_t frames = 2000;
+    size_t rounds = 50;
+    std::vector<size_t> threads;
+    std::string output = "tdf_writer_bench.bin";
+};
+
+double seconds(const Stopwatch& watch)
+{
+    return static_cast<double>(watch.elapsed_ns()) * 1e-9;
+}
+
+
+// FIFO containers: producers push disjoint shares of the items, consumers
+// pop until the container is closed and drained.
+template <typename Container>
+void bench_fifo(const char* name, size_t producers, size_t consumers, size_t capacity, size_t items)
+{
+    std::unique_ptr<Container> container;
+    if constexpr (std::is_constructible_v<Container, size_t, size_t, size_t>) {
+        container = std::make_unique<Container>(capacity, consumers, 1);
+    } else {
+        container = std::make_unique<Container>(capacity);
+    }
+    std::atomic<size_t> popped = 0;
+    std::vector<std::thread> threads;
+    Stopwatch watch;
+    for(size_t c = 0; c < consumers; ++c) {
+        threads.emplace_back([&, c]() {
+            size_t count = 0;
+            while(true) {
+                std::optional<size_t> item;
+                if constexpr (requires { container->pop(c); }) {
+                    item = container->pop(c);
+                } else {
+                    item = container->pop();
+                }
+                if(!item.has_value()) break;
+                ++count;
+            }
+            popped += count;
+        });
+    }
+    std::vector<std::thread> producer_threads;
+    for(size_t p = 0; p < producers; ++p) {
+        producer_threads.emplace_back([&, p]() {
+            for(size_t i = p; i < items; i += producers) {
+                container->push(size_t(i));
+            }
+        });
+    }
+    for(auto& t : producer_threads) t.join();
+    container->close();
+    for(auto& t : threads) t.join();
+    const double elapsed = seconds(watch);
+    if(popped != items) {
+        throw std::runtime_error(std::string(name) + ": lost items");
+    }
+    std::printf("container,%s,producers=%zu,consumers=%zu,capacity=%zu,%.0f items/s\n",
+                name, producers, consumers, capacity, static_cast<double>(items) / elapsed);
+}
+
+// Ordered containers: producers push (index, value) pairs with indices
+// handed out by a shared counter, one consumer pops them in order, as the
+// reducer thread does.
+template <typename Container>
+void bench_ordered(const char* name, size_t producers, size_t capacity, size_t items)
+{
+    Container container(capacity);
+    std::atomic<size_t> next = 0;
+    size_t popped = 0;
+    bool in_order = true;
+    Stopwatch watch;
+    std::thread consumer([&]() {
+        while(true) {
+            auto batch = container.pop_batch(256);
+            if(batch.empty()) break;
+            for(auto& item : batch) {
+                in_order = in_order && item.first == popped;
+                ++popped;
+            }
+        }
+    });
+    std::vector<std::thread> producer_threads;
+    for(size_t p = 0; p < producers; ++p) {
+        producer_threads.emplace_back([&]() {
+            while(true) {
+                const size_t index = next.fetch_add(1);
+                if(index >= items) break;
+                container.push(std::pair<size_t, size_t>(index, index));
+            }
+        });
+    }
+    for(auto& t : producer_threads) t.join();
+    container.close();
+    consumer.join();
+    const double elapsed = seconds(watch);
+    if(!in_order || popped != items) {
+        throw std::runtime_error(std::string(name) + ": items lost or out of order");
+    }
+    std::printf("container,%s,producers=%zu,consumers=1,capacity=%zu,%.0f items/s\n",
+                name, producers, capacity, static_cast<double>(items) / elapsed);
+}
+
+void bench_containers(const BenchConfig& config)
+{
+    for(size_t producers : config.threads) {
+        for(size_t consumers : config.threads) {
+            for(size_t capacity : {size_t(16), size_t(1024)}) {
+                bench_fifo<SynchronizedBuffer<size_t>>("SynchronizedBuffer", producers, consumers, capacity, config.items);
+                bench_fifo<MPMCRingBuffer<size_t>>("MPMCRingBuffer", producers, consumers, capacity, config.items);
+                bench_fifo<WorkStealingBuffer<size_t>>("WorkStealingBuffer", producers, consumers, capacity, config.items);
+            }
+        }
+        for(size_t capacity : {size_t(16), size_t(1024)}) {
+            bench_ordered<SyncBoundedPriorityQueue<size_t>>("SyncBoundedPriorityQueue", producers, capacity, config.items);
+            bench_ordered<SyncReorderWindow<size_t>>("SyncReorderWindow", producers, capacity, config.items);
+        }
+    }
+}
+
+
+// Synthetic timsTOF frames: mostly sparse PASEF MS/MS frames with an MS1
+// frame every 10th, which carries about 100 times as many peaks. TOF
+// indices are sorted within each scan, intensities small and skewed, as
+// in real data.
+std::vector<Frame> make_frames(size_t count)
+{
+    std::mt19937 rng(42);
+    std::geometric_distribution<uint32_t> intensity(0.05);
+    std::vector<Frame> frames(count);
+    for(size_t f = 0; f < count; ++f) {
+        Frame& frame = frames[f];
+        const size_t num_scans = 918;
+        const bool ms1 = f % 10 == 0;
+        std::poisson_distribution<uint32_t> peaks_per_scan(ms1 ? 300.0 : 3.0);
+        std::uniform_int_distribution<uint32_t> tof(0, 400000);
+        frame.scan_offsets.push_back(0);
+        for(size_t s = 0; s < num_scans; ++s) {
+            const size_t begin = frame.tof_indices.size();
+            const uint32_t n = peaks_per_scan(rng);
+            for(uint32_t p = 0; p < n; ++p) {
+                frame.tof_indices.push_back(tof(rng));
+                frame.intensities.push_back(intensity(rng) + 1);
+            }
+            std::sort(frame.tof_indices.begin() + begin, frame.tof_indices.end());
+            frame.scan_offsets.push_back(static_cast<uint32_t>(frame.tof_indices.size()));
+        }
+        frame.metadata.msms_type = ms1 ? 0 : 8;
+    }
+    return frames;
+}
+
+// Compresses frames from a shared pool without copying them, so the
+// producer is not what is measured.
+class FrameRefCompressor : public Mapper<const Frame*, SimpleBuffer<char>>
+{
+    TdfFrameCompressor compressor;
+
+public:
+    using Mapper<const Frame*, SimpleBuffer<char>>::map;
+
+    SimpleBuffer<char> map(const Frame* const& frame) override
+    {
+        return compressor.compress(frame->scan_offsets, frame->tof_indices, frame->intensities);
+    }
+};
+
+// collect_timings = false shows what the per-job timing of stats() costs.
+template <template <typename> class InputBuffer_t>
+void bench_pipeline_with(const char* name, const BenchConfig& config, const std::vector<Frame>& frames,
+                         size_t threads, size_t input_buffer_size, size_t raw_bytes_per_cycle,
+                         bool collect_timings)
+{
+    DispatcherOptions options;
+    options.num_mapper_threads = threads;
+    options.input_buffer_size = input_buffer_size;
+    options.collect_timings = collect_timings;
+    Stopwatch watch;
+    uint64_t bytes_out = 0;
+    {
+        Dispatcher<FrameRefCompressor, FileCollector, InputBuffer_t, SyncReorderWindow> dispatcher(
+            []() { return std::make_unique<FrameRefCompressor>(); },
+            std::make_unique<FileCollector>(config.output),
+            options);
+        for(size_t i = 0; i < config.frames; ++i) {
+            dispatcher.add_input(&frames[i % frames.size()]);
+        }
+        dispatcher.close();
+        bytes_out = dispatcher.get_reducer().bytes_written();
+    }
+    const double elapsed = seconds(watch);
+    const double raw_bytes = static_cast<double>(raw_bytes_per_cycle) * static_cast<double>(config.frames) / static_cast<double>(frames.size());
+    std::printf("pipeline,%s,threads=%zu,input_buffer=%zu,timings=%s,%.0f frames/s,%.1f MB/s in,%.1f MB/s out\n",
+                name, threads, input_buffer_size, collect_timings ? "on" : "off",
+                static_cast<double>(config.frames) / elapsed,
+                raw_bytes / elapsed * 1e-6,
+                static_cast<double>(bytes_out) / elapsed * 1e-6);
+}
+
+// Same pipeline in offset-ordered mode: the mapper threads write the
+// blocks themselves and only their locations are reordered.
+void bench_offset_pipeline(const BenchConfig& config, const std::vector<Frame>& frames,
+                           size_t threads, size_t input_buffer_size, size_t raw_bytes_per_cycle)
+{
+    DispatcherOptions options;
+    options.num_mapper_threads = threads;
+    options.input_buffer_size = input_buffer_size;
+    Stopwatch watch;
+    uint64_t bytes_out = 0;
+    {
+        auto file = std::make_shared<ParallelFileWriter>(config.output);
+        Dispatcher<OffsetWritingMapper<FrameRefCompressor>, OffsetFileCollector, SynchronizedBuffer, SyncReorderWindow> dispatcher(
+            [&file]() { return std::make_unique<OffsetWritingMapper<FrameRefCompressor>>(std::make_unique<FrameRefCompressor>(), file); },
+            std::make_unique<OffsetFileCollector>(file),
+            options);
+        for(size_t i = 0; i < config.frames; ++i) {
+            dispatcher.add_input(&frames[i % frames.size()]);
+        }
+        dispatcher.close();
+        bytes_out = dispatcher.get_reducer().bytes_written();
+    }
+    const double elapsed = seconds(watch);
+    const double raw_bytes = static_cast<double>(raw_bytes_per_cycle) * static_cast<double>(config.frames) / static_cast<double>(frames.size());
+    std::printf("pipeline,OffsetOrdered,threads=%zu,input_buffer=%zu,%.0f frames/s,%.1f MB/s in,%.1f MB/s out\n",
+                threads, input_buffer_size,
+                static_cast<double>(config.frames) / elapsed,
+                raw_bytes / elapsed * 1e-6,
+                static_cast<double>(bytes_out) / elapsed * 1e-6);
+}
+
+void bench_pipeline(const BenchConfig& config)
+{
+    const std::vector<Frame> frames = make_frames(100);
+    size_t raw_bytes = 0;
+    for(const Frame& frame : frames) {
+        raw_bytes += sizeof(uint32_t) * (frame.scan_offsets.size() + 2 * frame.tof_indices.size());
+    }
+    for(size_t threads : config.threads) {
+        for(size_t input_buffer_size : {threads + 1, 4 * threads}) {
+            for(bool collect_timings : {true, false}) {
+                bench_pipeline_with<SynchronizedBuffer>("SynchronizedBuffer", config, frames, threads, input_buffer_size,
+                                                        raw_bytes, collect_timings);
+                bench_pipeline_with<MPMCRingBuffer>("MPMCRingBuffer", config, frames, threads, input_buffer_size,
+                                                    raw_bytes, collect_timings);
+                bench_pipeline_with<WorkStealingBuffer>("WorkStealingBuffer", config, frames, threads, input_buffer_size,
+                                                        raw_bytes, collect_timings);
+            }
+            bench_offset_pipeline(config, frames, threads, input_buffer_size, raw_bytes);
+        }
+    }
+    std::remove(config.output.c_str());
+}
+
+// Payload preprocessing kernels at every SIMD level this CPU supports, on
+// the peaks of the synthetic frames laid end to end. Each level's output
+// is checked against the scalar kernels, and the unshuffle and prefix sum
+// against the inputs they invert.
+void bench_kernels(const BenchConfig& config)
+{
+    std::vector<uint32_t> tof;
+    std::vector<uint32_t> intensities;
+    for(const Frame& frame : make_frames(100)) {
+        tof.insert(tof.end(), frame.tof_indices.begin(), frame.tof_indices.end());
+        intensities.insert(intensities.end(), frame.intensities.begin(), frame.intensities.end());
+    }
+    const size_t count = tof.size();
+
+    const SimdKernels reference = simd_kernels(SimdLevel::scalar);
+    std::vector<uint32_t> expected_deltas(2 * count);
+    reference.delta_interleave(tof.data(), intensities.data(), count, expected_deltas.data());
+    std::vector<char> expected_shuffled(expected_deltas.size() * sizeof(uint32_t));
+    reference.byte_shuffle4(expected_deltas.data(), expected_deltas.size(), expected_shuffled.data());
+
+    std::vector<uint32_t> deltas(expected_deltas.size());
+    std::vector<char> shuffled(expected_shuffled.size());
+    std::vector<uint32_t> unshuffled(deltas.size());
+    std::vector<uint32_t> sums(count);
+    std::vector<uint32_t> tof_deltas(count);
+    for(size_t i = 0; i < count; ++i) {
+        tof_deltas[i] = tof[i] - (i == 0 ? static_cast<uint32_t>(-1) : tof[i-1]);
+    }
+
+    auto report = [&](const char* kernel, SimdLevel level, size_t bytes, const Stopwatch& watch) {
+        std::printf("kernel,%s,%s,values=%zu,%.2f GB/s\n", kernel, simd_level_name(level), count,
+                    static_cast<double>(bytes) * static_cast<double>(config.rounds) / seconds(watch) * 1e-9);
+    };
+    auto check = [](bool ok, const char* kernel, SimdLevel level) {
+        if(!ok) {
+            throw std::runtime_error(std::string(kernel) + " (" + simd_level_name(level) + ") does not match the scalar kernel");
+        }
+    };
+
+    for(SimdLevel level : {SimdLevel::scalar, SimdLevel::avx2, SimdLevel::avx512, SimdLevel::neon}) {
+        if(!simd_level_supported(level)) {
+            continue;
+        }
+        const SimdKernels kernels = simd_kernels(level);
+
+        Stopwatch delta_watch;
+        for(size_t r = 0; r < config.rounds; ++r) {
+            kernels.delta_interleave(tof.data(), intensities.data(), count, deltas.data());
+        }
+        report("delta_interleave", level, 2 * count * sizeof(uint32_t), delta_watch);
+        check(deltas == expected_deltas, "delta_interleave", level);
+
+        Stopwatch shuffle_watch;
+        for(size_t r = 0; r < config.rounds; ++r) {
+            kernels.byte_shuffle4(deltas.data(), deltas.size(), shuffled.data());
+        }
+        report("byte_shuffle4", level, shuffled.size(), shuffle_watch);
+        check(shuffled == expected_shuffled, "byte_shuffle4", level);
+
+        Stopwatch unshuffle_watch;
+        for(size_t r = 0; r < config.rounds; ++r) {
+            kernels.byte_unshuffle4(shuffled.data(), unshuffled.size(), unshuffled.data());
+        }
+        report("byte_unshuffle4", level, shuffled.size(), unshuffle_watch);
+        check(unshuffled == expected_deltas, "byte_unshuffle4", level);
+
+        Stopwatch sum_watch;
+        for(size_t r = 0; r < config.rounds; ++r) {
+            kernels.prefix_sum(tof_deltas.data(), count, static_cast<uint32_t>(-1), sums.data());
+        }
+        report("prefix_sum", level, count * sizeof(uint32_t), sum_watch);
+        check(sums == tof, "prefix_sum", level);
+    }
+}
+
+std::vector<size_t> parse_list(const std::string& list)
+{
+    std::vector<size_t> values;
+    size_t pos = 0;
+    while(pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if(end == std::string::npos) end = list.size();
+        values.push_back(std::stoul(list.substr(pos, end - pos)));
+        pos = end + 1;
+    }
+    return values;
+}
+
+} // namespace
+
+
+int main(int argc, char** argv)
+{
+    BenchConfig config;
+    std::string mode = "all";
+    try {
+        for(int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if(arg == "--items" && i + 1 < argc) {
+                config.items = std::stoul(argv[++i]);
+            } else if(arg == "--frames" && i + 1 < argc) {
+                config.frames = std::stoul(argv[++i]);
+            } else if(arg == "--threads" && i + 1 < argc) {
+                config.threads = parse_list(argv[++i]);
+            } else if(arg == "--rounds" && i + 1 < argc) {
+                config.rounds = std::stoul(argv[++i]);
+            } else if(arg == "--output" && i + 1 < argc) {
+                config.output = argv[++i];
+            } else if(arg == "containers" || arg == "pipeline" || arg == "kernels" || arg == "all") {
+                mode = arg;
+            } else {
+                std::fprintf(stderr, "Unknown argument: %s\n", arg.c_str());
+                return 2;
+            }
+        }
+        if(config.threads.empty()) {
+            const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+            for(size_t t = 1; t < hardware; t *= 2) {
+                config.threads.push_back(t);
+            }
+            config.threads.push_back(hardware);
+        }
+        if(mode == "containers" || mode == "all") {
+            bench_containers(config);
+        }
+        if(mode == "pipeline" || mode == "all") {
+            bench_pipeline(config);
+        }
+        if(mode == "kernels" || mode == "all") {
+            bench_kernels(config);
+        }
+    } catch(const std::exception& e) {
+        std::fprintf(stderr, "Benchmark failed: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+#ifndef TDF_WRITER_BUFFER_POOL_HPP
+#define TDF_WRITER_BUFFER_POOL_HPP
+
+#include <cstdlib>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <stdexcept>
+
+
+// BufferPool: thread-safe recycler of raw allocations in power-of-two size
+// classes, backing SimpleBuffer.
+//
+// In the Dispatcher pipeline buffers are allocated by mapper threads and
+// destroyed by the reducer thread once written. Routing both through a
+// pool replaces a malloc/free pair that crosses threads on every frame
+// with two short critical sections on a per-class free list, and keeps the
+// resident set flat: each class caches at most max_cached_per_class unused
+// buffers, anything beyond that is freed.
+//
+// Requests larger than max_class_size bypass the pool.
+template <typename T>
+class BufferPool
+{
+    struct SizeClass
+    {
+        std::mutex mtx;
+        std::vector<T*> free_list;
+    };
+
+    size_t min_class_size;
+    size_t max_class_size;
+    size_t max_cached_per_class;
+    std::vector<SizeClass> classes;
+
+    size_t class_index(size_t capacity) const
+    {
+        size_t index = 0;
+        for(size_t class_size = min_class_size; class_size < capacity; class_size *= 2) {
+            ++index;
+        }
+        return index;
+    }
+
+    static T* allocate(size_t capacity)
+    {
+        T* data = static_cast<T*>(std::malloc(capacity * sizeof(T)));
+        if(!data) {
+            throw std::bad_alloc();
+        }
+        return data;
+    }
+
+public:
+    // Sizes are in elements of T.
+    explicit BufferPool(size_t min_class_size_ = 4096,
+                        size_t max_class_size_ = size_t(64) << 20,
+                        size_t max_cached_per_class_ = 64)
+        : min_class_size(min_class_size_),
+          max_class_size(max_class_size_),
+          max_cached_per_class(max_cached_per_class_)
+    {
+        if(min_class_size == 0 || max_class_size < min_class_size) {
+            throw std::invalid_argument("Invalid buffer pool size classes");
+        }
+        classes = std::vector<SizeClass>(class_index(max_class_size) + 1);
+        for(auto& size_class : classes) {
+            size_class.free_list.reserve(max_cached_per_class);
+        }
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool()
+    {
+        for(auto& size_class : classes) {
+            for(T* data : size_class.free_list) {
+                std::free(data);
+            }
+        }
+    }
+
+    // Capacity actually handed out for a request of size elements.
+    size_t rounded_capacity(size_t size) const
+    {
+        if(size > max_class_size) {
+            return size;
+        }
+        return min_class_size << class_index(size);
+    }
+
+    // Returns storage for rounded_capacity(size) elements.
+    T* acquire(size_t size)
+    {
+        if(size > max_class_size) {
+            return allocate(size);
+        }
+        SizeClass& size_class = classes[class_index(size)];
+        {
+            std::lock_guard<std::mutex> lock(size_class.mtx);
+            if(!size_class.free_list.empty()) {
+                T* data = size_class.free_list.back();
+                size_class.free_list.pop_back();
+                return data;
+            }
+        }
+        return allocate(rounded_capacity(size));
+    }
+
+    // capacity must be the value rounded_capacity() gave for the buffer.
+    void release(T* data, size_t capacity) noexcept
+    {
+        if(capacity <= max_class_size) {
+            SizeClass& size_class = classes[class_index(capacity)];
+            std::lock_guard<std::mutex> lock(size_class.mtx);
+            if(size_class.free_list.size() < max_cached_per_class) {
+                size_class.free_list.push_back(data); // Never reallocates, see constructor
+                return;
+            }
+        }
+        std::free(data);
+    }
+};
+
+#endif // TDF_WRITER_BUFFER_POOL_HPP
@@ -0,0 +1,212 @@
+#ifndef TDF_WRITER_CHECKPOINT_HPP
+#define TDF_WRITER_CHECKPOINT_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "staged_file_writer.hpp"
+
+
+// Location of one written block inside the output file.
+struct BlockLocation
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+
+// Durable record of how much of an output file is known to be on disk,
+// kept next to it so that an interrupted write can be resumed.
+//
+// Two sidecar files make up a checkpoint: path holds the number of
+// blocks and bytes covered, path + ".index" the locations of those
+// blocks. The index is only ever appended to, so a checkpoint costs just
+// the entries added since the last one; the header is replaced atomically
+// (written to a temporary, synced, renamed over the old one) once the
+// data and index entries it refers to have been synced, so a crash leaves
+// either the old or the new checkpoint, never a torn one.
+struct FileCheckpoint
+{
+    static constexpr char magic[8] = {'T', 'D', 'F', 'W', 'C', 'K', 'P', '1'};
+
+    std::vector<BlockLocation> index;
+
+    inline size_t blocks() const { return index.size(); }
+    inline uint64_t bytes() const { return index.empty() ? 0 : index.back().offset + index.back().size; }
+
+    // Forgets every block after the first n.
+    void keep_first(size_t n)
+    {
+        if(n < index.size()) {
+            index.resize(n);
+        }
+    }
+
+    // std::nullopt if there is no checkpoint at path; throws if there is
+    // one but it is unreadable or inconsistent.
+    static std::optional<FileCheckpoint> load(const std::string& path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            if(errno == ENOENT) return std::nullopt;
+            throw_errno("Failed to open checkpoint " + path);
+        }
+        char header_magic[sizeof(magic)];
+        uint64_t header[2];
+        const bool complete = read_at(fd, header_magic, sizeof(header_magic), 0)
+                              && read_at(fd, header, sizeof(header), sizeof(header_magic));
+        ::close(fd);
+        if(!complete || std::memcmp(header_magic, magic, sizeof(magic)) != 0) {
+            throw std::runtime_error("Not a valid checkpoint: " + path);
+        }
+        const int index_fd = ::open((path + ".index").c_str(), O_RDONLY | O_CLOEXEC);
+        if(index_fd < 0) {
+            throw_errno("Failed to open checkpoint index " + path + ".index");
+        }
+        // The index may hold more entries than the header covers (after a
+        // crash between syncing new entries and replacing the header), not
+        // fewer; checked before sizing anything after the header.
+        struct stat st;
+        if(::fstat(index_fd, &st) != 0) {
+            const int error = errno;
+            ::close(index_fd);
+            errno = error;
+            throw_errno("Failed to stat checkpoint index " + path + ".index");
+        }
+        if(header[0] > static_cast<uint64_t>(st.st_size) / sizeof(BlockLocation)) {
+            ::close(index_fd);
+            throw std::runtime_error("Checkpoint index does not match checkpoint: " + path);
+        }
+        FileCheckpoint checkpoint;
+        checkpoint.index.resize(header[0]);
+        const bool indexed = read_at(index_fd, checkpoint.index.data(), checkpoint.index.size() * sizeof(BlockLocation), 0);
+        ::close(index_fd);
+        if(!indexed || checkpoint.bytes() != header[1]) {
+            throw std::runtime_error("Checkpoint index does not match checkpoint: " + path);
+        }
+        return checkpoint;
+    }
+
+private:
+    static bool read_at(int fd, void* data, size_t size, uint64_t offset)
+    {
+        char* out = static_cast<char*>(data);
+        while(size > 0) {
+            const ssize_t n = ::pread(fd, out, size, static_cast<off_t>(offset));
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) return false;
+            out += n;
+            size -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+        return true;
+    }
+};
+
+
+// Writing side of FileCheckpoint, owned by FileCollector.
+class CheckpointLog
+{
+    std::string path;
+    int index_fd = -1;
+    size_t logged = 0;
+
+public:
+    // Continues a checkpoint of stored_blocks blocks of which only the
+    // first kept.size() are kept; with none kept any previous checkpoint
+    // is discarded. If fewer are kept, the header is cut down to them
+    // first, and only then the index, so that the checkpoint stays
+    // loadable whenever the process stops (the caller truncates the data
+    // file after that, too).
+    CheckpointLog(std::string path_, std::span<const BlockLocation> kept, size_t stored_blocks)
+        : path(std::move(path_)), logged(kept.size())
+    {
+        if(kept.empty()) {
+            if(::unlink(path.c_str()) != 0 && errno != ENOENT) {
+                throw_errno("Failed to remove old checkpoint " + path);
+            }
+        } else if(kept.size() < stored_blocks) {
+            write_header(kept);
+        }
+        index_fd = ::open((path + ".index").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if(index_fd < 0) {
+            throw_errno("Failed to open checkpoint index " + path + ".index");
+        }
+        if(::ftruncate(index_fd, static_cast<off_t>(logged * sizeof(BlockLocation))) != 0) {
+            ::close(index_fd);
+            throw_errno("Failed to truncate checkpoint index " + path + ".index");
+        }
+    }
+
+    CheckpointLog(const CheckpointLog&) = delete;
+    CheckpointLog& operator=(const CheckpointLog&) = delete;
+
+    // Records index (every block written so far, all of them already
+    // synced to disk) as the new checkpoint.
+    void commit(std::span<const BlockLocation> index)
+    {
+        if(index.size() > logged) {
+            pwrite_all(index_fd, reinterpret_cast<const char*>(index.data() + logged),
+                       (index.size() - logged) * sizeof(BlockLocation), logged * sizeof(BlockLocation));
+        }
+        if(::fdatasync(index_fd) != 0) {
+            throw_errno("Failed to sync checkpoint index " + path + ".index");
+        }
+        logged = index.size();
+        write_header(index);
+    }
+
+    // Deletes both sidecar files, e.g. once the output is complete.
+    void remove()
+    {
+        ::unlink(path.c_str());
+        ::unlink((path + ".index").c_str());
+    }
+
+    ~CheckpointLog()
+    {
+        if(index_fd >= 0) {
+            ::close(index_fd);
+        }
+    }
+
+private:
+    // Atomically replaces the header with one covering index, whose
+    // entries are already synced.
+    void write_header(std::span<const BlockLocation> index)
+    {
+        const uint64_t header[2] = {index.size(), index.empty() ? 0 : index.back().offset + index.back().size};
+        const std::string tmp = path + ".tmp";
+        const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) {
+            throw_errno("Failed to open checkpoint " + tmp);
+        }
+        try {
+            pwrite_all(fd, FileCheckpoint::magic, sizeof(FileCheckpoint::magic), 0);
+            pwrite_all(fd, reinterpret_cast<const char*>(header), sizeof(header), sizeof(FileCheckpoint::magic));
+            if(::fdatasync(fd) != 0) {
+                throw_errno("Failed to sync checkpoint " + tmp);
+            }
+        } catch(...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        if(::rename(tmp.c_str(), path.c_str()) != 0) {
+            throw_errno("Failed to replace checkpoint " + path);
+        }
+        sync_parent_directory(path);
+    }
+};
+
+#endif // TDF_WRITER_CHECKPOINT_HPP
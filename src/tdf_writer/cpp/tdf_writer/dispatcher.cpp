@@ -0,0 +1,573 @@
+#include <algorithm>
+#include <array>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+#include <stdexcept>
+
+#include <nanobind/nanobind.h>
+#include <nanobind/ndarray.h>
+#include <nanobind/stl/shared_ptr.h>
+#include <nanobind/stl/string.h>
+#include <nanobind/stl/vector.h>
+
+#include "adaptive_level.hpp"
+#include "dispatcher.hpp"
+#include "frame.hpp"
+#include "memory_budget.hpp"
+#include "mpmc_ring.hpp"
+#include "offset_writer.hpp"
+#include "ordered_queue.hpp"
+#include "tdf_collector.hpp"
+#include "tdf_compressor.hpp"
+#include "worker_pool.hpp"
+#include "zstd_dictionary.hpp"
+
+namespace nb = nanobind;
+using namespace nb::literals;
+
+
+namespace {
+
+nb::dict histogram_dict(const HistogramSnapshot& h)
+{
+    nb::dict d;
+    d["count"] = h.count;
+    d["total"] = h.sum;
+    d["mean"] = h.mean();
+    d["max"] = h.max;
+    d["p50"] = h.quantile(0.5);
+    d["p90"] = h.quantile(0.9);
+    d["p99"] = h.quantile(0.99);
+    return d;
+}
+
+nb::dict container_dict(const ContainerStatsSnapshot& c)
+{
+    nb::dict d;
+    d["pushes"] = c.pushes;
+    d["pops"] = c.pops;
+    d["push_wait_ns"] = histogram_dict(c.push_wait_ns);
+    d["pop_wait_ns"] = histogram_dict(c.pop_wait_ns);
+    d["occupancy"] = histogram_dict(c.occupancy);
+    return d;
+}
+
+// A Python callable passed to the pipeline as a callback, which calls it
+// from its own threads: the GIL is taken to call it and to drop it, and
+// what it raises is reported as unraisable rather than let into the
+// pipeline.
+class PyCallback
+{
+    std::shared_ptr<nb::object> callable;
+
+public:
+    explicit PyCallback(nb::callable f)
+        : callable(new nb::object(std::move(f)), [](nb::object* p) {
+              nb::gil_scoped_acquire acquire;
+              delete p;
+          })
+    {}
+
+    void operator()() const
+    {
+        nb::gil_scoped_acquire acquire;
+        try {
+            (*callable)();
+        } catch(nb::python_error& e) {
+            e.discard_as_unraisable("in a TdfWriter callback");
+        }
+    }
+};
+
+} // namespace
+
+
+using UInt32Array = nb::ndarray<const uint32_t, nb::ndim<1>, nb::c_contig, nb::device::cpu>;
+using TdfDispatcher = Dispatcher<TdfFrameViewMapper, TdfCollector, MPMCRingBuffer, SyncReorderWindow>;
+using TdfStream = PooledStream<TdfFrameViewMapper, TdfCollector, SyncReorderWindow>;
+using OffsetTdfMapper = OffsetWritingMapper<TdfFrameViewMapper>;
+using OffsetTdfDispatcher = Dispatcher<OffsetTdfMapper, OffsetTdfCollector, MPMCRingBuffer, SyncReorderWindow>;
+using OffsetTdfStream = PooledStream<OffsetTdfMapper, OffsetTdfCollector, SyncReorderWindow>;
+
+
+// Python-facing writer of an analysis.tdf / analysis.tdf_bin pair.
+//
+// Frames are passed as numpy arrays and enter the pipeline as FrameViews:
+// the peak data is read in place by the mapper threads, and the arrays
+// are kept alive by the view until the frame has been compressed.
+// Arrays already of dtype uint32 and C-contiguous are never copied;
+// anything else is converted once by nanobind at the call boundary.
+//
+// GIL: every call that can block inside the pipeline (add_frame waiting
+// for input buffer space, close and destruction joining the workers)
+// releases the GIL for the whole wait, so other Python threads keep
+// running during a write. Mapper threads only take the GIL briefly to
+// drop their references to consumed arrays.
+//
+// Concurrency: add_frame may be called from several Python threads at
+// once; frames are numbered in the order the calls get through. close()
+// may be called from any thread; add_frame calls racing with it raise.
+// block_index() is only available once close() has returned.
+//
+// Errors: if compressing or writing a frame fails, the writer stops and
+// the exception is raised by the next add_frame and by close(); the
+// files stay as far as they got (with their last checkpoint, if any).
+// cancel() stops the same way without an error, e.g. when the user
+// aborts a conversion, and returns once the threads have stopped.
+//
+// Event loops: try_add_frame never waits for room, on_space registers a
+// callback telling when to try again and close_async one telling when the
+// write is complete; the callbacks come from the pipeline threads (see
+// PyCallback). tdf_writer.aio builds coroutines on them.
+//
+// Given a WorkerPool, the writer compresses on the pool's threads instead
+// of starting its own, so several writers can run side by side without
+// oversubscribing the machine; the thread and CPU arguments are then
+// ignored.
+//
+// With offset_ordered, the compression threads write their blocks to
+// analysis.tdf_bin themselves (see offset_writer.hpp) and only the block
+// locations and Frames rows pass through the ordering stage.
+//
+// With checkpoint_interval, analysis.tdf_bin is synced and its progress
+// recorded every that many frames; resume=True reopens both files at the
+// last checkpoint and resumed_frames tells the caller where to continue.
+//
+// A MemoryBudget bounds the bytes held by the queued frames, the
+// compressed frames waiting for their turn and the staging blocks; pass
+// the same one to several writers to bound them together.
+class PyTdfWriter
+{
+    std::variant<std::unique_ptr<TdfDispatcher>,
+                 std::unique_ptr<TdfStream>,
+                 std::unique_ptr<OffsetTdfDispatcher>,
+                 std::unique_ptr<OffsetTdfStream>> pipeline;
+    size_t resumed = 0;
+    std::shared_ptr<AdaptiveCompressionLevel> adaptive_level;
+    std::shared_ptr<SharedZstdDictionary> dictionary;
+    std::shared_ptr<MemoryBudget> memory_budget;
+
+public:
+    PyTdfWriter(const std::string& bin_filename,
+                const std::string& tdf_filename,
+                int compression_level,
+                size_t num_threads,
+                size_t input_buffer_size,
+                size_t reorder_window_size,
+                size_t mapper_batch_size,
+                size_t metadata_batch_size,
+                bool direct_io,
+                uint64_t writeback_interval,
+                bool drop_written_pages,
+                uint64_t expected_size,
+                const std::vector<int>& mapper_cpus,
+                const std::string& affinity,
+                const std::vector<int>& reducer_cpus,
+                std::shared_ptr<WorkerPool> pool,
+                bool offset_ordered,
+                size_t checkpoint_interval,
+                bool resume,
+                int max_compression_level,
+                size_t dictionary_frames,
+                size_t dictionary_size,
+                std::shared_ptr<MemoryBudget> memory_budget_,
+                bool collect_timings)
+        : memory_budget(std::move(memory_budget_))
+    {
+        DispatcherOptions options;
+        options.num_mapper_threads = num_threads;
+        options.input_buffer_size = input_buffer_size;
+        options.reorder_window_size = reorder_window_size;
+        options.mapper_batch_size = mapper_batch_size;
+        options.mapper_cpus = mapper_cpus;
+        options.mapper_affinity = parse_affinity_policy(affinity);
+        options.reducer_cpus = reducer_cpus;
+        options.memory_budget = memory_budget;
+        options.collect_timings = collect_timings;
+        FileWriterOptions binary_options;
+        binary_options.direct_io = direct_io;
+        binary_options.writeback_interval = writeback_interval;
+        binary_options.drop_written_pages = drop_written_pages;
+        binary_options.expected_size = expected_size;
+        binary_options.memory_budget = memory_budget;
+        binary_options.collect_timings = collect_timings;
+        if(!pool) {
+            binary_options.writer_cpus = reducer_cpus;
+        }
+        if(max_compression_level > 0) {
+            AdaptiveLevelOptions levels;
+            levels.min_level = compression_level;
+            levels.max_level = max_compression_level;
+            adaptive_level = std::make_shared<AdaptiveCompressionLevel>(levels);
+        }
+        if(dictionary_frames > 0) {
+            DictionaryOptions trained;
+            trained.training_frames = dictionary_frames;
+            trained.dictionary_size = dictionary_size;
+            trained.path = bin_filename + ".dict";
+            trained.resume = resume;
+            dictionary = std::make_shared<SharedZstdDictionary>(trained);
+        }
+        auto mapper_factory = [compression_level, adaptive = adaptive_level, dictionary = dictionary]() {
+            return std::make_unique<TdfFrameViewMapper>(compression_level, adaptive, dictionary);
+        };
+        if(offset_ordered) {
+            if(checkpoint_interval > 0 || resume) {
+                throw std::invalid_argument("Checkpoints are not supported with offset_ordered");
+            }
+            auto file = std::make_shared<ParallelFileWriter>(bin_filename, binary_options);
+            auto offset_mapper_factory = [mapper_factory, file]() {
+                return std::make_unique<OffsetTdfMapper>(mapper_factory(), file);
+            };
+            auto collector = std::make_unique<OffsetTdfCollector>(file, tdf_filename, metadata_batch_size);
+            if(pool) {
+                pipeline = std::make_unique<OffsetTdfStream>(std::move(pool), offset_mapper_factory, std::move(collector),
+                                                             input_buffer_size, reorder_window_size, 0, memory_budget,
+                                                             collect_timings);
+            } else {
+                pipeline = std::make_unique<OffsetTdfDispatcher>(offset_mapper_factory, std::move(collector), options);
+            }
+            follow_backpressure();
+            return;
+        }
+        CheckpointOptions checkpoint;
+        checkpoint.interval = checkpoint_interval;
+        checkpoint.resume = resume;
+        auto collector = std::make_unique<TdfCollector>(bin_filename, tdf_filename, metadata_batch_size,
+                                                        TdfCollector::default_metadata_queue_size, binary_options,
+                                                        checkpoint);
+        resumed = collector->resumed_frames();
+        options.first_job_index = resumed;
+        if(pool) {
+            pipeline = std::make_unique<TdfStream>(std::move(pool), mapper_factory, std::move(collector),
+                                                   input_buffer_size, reorder_window_size, resumed, memory_budget,
+                                                   collect_timings);
+        } else {
+            pipeline = std::make_unique<TdfDispatcher>(mapper_factory, std::move(collector), options);
+        }
+        follow_backpressure();
+    }
+
+    void add_frame(UInt32Array scan_offsets,
+                   UInt32Array tof_indices,
+                   UInt32Array intensities,
+                   double time,
+                   const std::string& polarity,
+                   int scan_mode,
+                   int msms_type)
+    {
+        FrameView frame = make_frame(scan_offsets, tof_indices, intensities, time, polarity, scan_mode, msms_type);
+
+        // Mapper threads drop the array references once a frame is
+        // compressed, which needs the GIL, so it must not be held while
+        // this call waits for space in the input buffer.
+        nb::gil_scoped_release release;
+        visit([&](auto& pipeline) { pipeline.add_input(std::move(frame)); });
+    }
+
+    // add_frame that returns false instead of waiting for room. The GIL is
+    // still released, as the pipeline's locks are shared with threads that
+    // may be waiting for it; a frame that does not get in is dropped (and
+    // its references with it) after the GIL is taken back.
+    bool try_add_frame(UInt32Array scan_offsets,
+                       UInt32Array tof_indices,
+                       UInt32Array intensities,
+                       double time,
+                       const std::string& polarity,
+                       int scan_mode,
+                       int msms_type)
+    {
+        FrameView frame = make_frame(scan_offsets, tof_indices, intensities, time, polarity, scan_mode, msms_type);
+        nb::gil_scoped_release release;
+        return visit([&](auto& pipeline) { return pipeline.try_add_input(std::move(frame)); });
+    }
+
+    void on_space(nb::callable callback)
+    {
+        PyCallback wake(std::move(callback));
+        visit([&](auto& pipeline) { pipeline.on_space(wake); });
+    }
+
+    // done() is called once every frame is written (or the writer has
+    // stopped); close() then returns at once, raising the error if any.
+    void close_async(nb::callable done)
+    {
+        PyCallback callback(std::move(done));
+        nb::gil_scoped_release release;
+        visit([&](auto& pipeline) { pipeline.close_async([callback](std::exception_ptr) { callback(); }); });
+    }
+
+    // Called with the GIL released, see the call_guard in the bindings.
+    void close()
+    {
+        visit([](auto& pipeline) { pipeline.close(); });
+        if(adaptive_level) {
+            adaptive_level->detach();
+        }
+    }
+
+    // Called with the GIL released, see the call_guard in the bindings.
+    void cancel()
+    {
+        visit([](auto& pipeline) { pipeline.cancel(); });
+        if(adaptive_level) {
+            adaptive_level->detach();
+        }
+    }
+
+    // Instrumentation snapshot as nested dicts; callable while writing.
+    nb::dict stats()
+    {
+        const DispatcherStats s = visit([](auto& pipeline) { return pipeline.stats(); });
+        nb::dict d;
+        d["frames_added"] = s.jobs_added;
+        d["frames_compressed"] = s.jobs_mapped;
+        d["frames_written"] = s.jobs_reduced;
+        d["add_frame_ns"] = histogram_dict(s.add_input_ns);
+        d["input_wait_ns"] = histogram_dict(s.input_wait_ns);
+        d["compress_ns"] = histogram_dict(s.map_ns);
+        d["reorder_push_ns"] = histogram_dict(s.reorder_push_ns);
+        d["reducer_wait_ns"] = histogram_dict(s.reducer_wait_ns);
+        d["reduce_ns"] = histogram_dict(s.reduce_ns);
+        d["reduce_batch_size"] = histogram_dict(s.reduce_batch_size);
+        if(adaptive_level) {
+            d["compression_level"] = adaptive_level->level();
+            d["compression_level_changes"] = adaptive_level->changes();
+        }
+        if(s.reorder_queue) {
+            d["reorder_queue"] = container_dict(*s.reorder_queue);
+        }
+        if(dictionary) {
+            static const char* const states[] = {"collecting", "training", "ready", "failed"};
+            const SharedZstdDictionary::State state = dictionary->state();
+            nb::dict dict;
+            dict["state"] = states[static_cast<int>(state)];
+            if(state == SharedZstdDictionary::State::ready) {
+                dict["id"] = dictionary->id();
+                dict["size"] = dictionary->data().size();
+                dict["path"] = dictionary->path();
+            } else if(state == SharedZstdDictionary::State::failed) {
+                dict["error"] = dictionary->failure();
+            }
+            d["dictionary"] = dict;
+        }
+        if(memory_budget) {
+            nb::dict memory;
+            memory["limit"] = memory_budget->limit();
+            memory["used"] = memory_budget->used_bytes();
+            memory["peak"] = memory_budget->peak_bytes();
+            d["memory"] = memory;
+        }
+        const FileWriterStats w = visit([](auto& pipeline) { return pipeline.get_reducer().binary_collector().stats(); });
+        nb::dict output;
+        output["bytes_staged"] = w.bytes_staged;
+        output["bytes_written"] = w.bytes_written;
+        output["write_ns"] = histogram_dict(w.write_ns);
+        output["staging_wait_ns"] = histogram_dict(w.staging_wait_ns);
+        output["offset_wait_ns"] = histogram_dict(w.offset_wait_ns);
+        d["output"] = output;
+        return d;
+    }
+
+    // (n, 2) uint64 array of (offset, size) per frame in analysis.tdf_bin.
+    nb::ndarray<nb::numpy, uint64_t, nb::shape<-1, 2>> block_index()
+    {
+        if(!visit([](auto& pipeline) { return pipeline.is_closed(); })) {
+            throw std::runtime_error("block_index() is only available after close()");
+        }
+        const std::vector<BlockLocation>& index = visit([](auto& pipeline) -> const std::vector<BlockLocation>& {
+            return pipeline.get_reducer().binary_collector().block_index();
+        });
+        uint64_t* data = new uint64_t[2 * index.size()];
+        for(size_t i = 0; i < index.size(); ++i) {
+            data[2*i] = index[i].offset;
+            data[2*i + 1] = index[i].size;
+        }
+        nb::capsule owner(data, [](void* p) noexcept { delete[] static_cast<uint64_t*>(p); });
+        return nb::ndarray<nb::numpy, uint64_t, nb::shape<-1, 2>>(data, {index.size(), 2}, owner);
+    }
+
+    // Frames kept from a checkpoint when resuming; add_frame continues
+    // with the frame after them.
+    inline size_t resumed_frames() const { return resumed; }
+
+    ~PyTdfWriter()
+    {
+        nb::gil_scoped_release release;
+        if(adaptive_level) {
+            adaptive_level->detach();
+        }
+        std::visit([](auto& p) { p.reset(); }, pipeline);
+    }
+
+private:
+    static FrameView make_frame(UInt32Array scan_offsets,
+                                UInt32Array tof_indices,
+                                UInt32Array intensities,
+                                double time,
+                                const std::string& polarity,
+                                int scan_mode,
+                                int msms_type)
+    {
+        if(polarity != "+" && polarity != "-") {
+            throw std::invalid_argument("Polarity must be '+' or '-'");
+        }
+
+        FrameView frame;
+        frame.scan_offsets = std::span<const uint32_t>(scan_offsets.data(), scan_offsets.size());
+        frame.tof_indices = std::span<const uint32_t>(tof_indices.data(), tof_indices.size());
+        frame.intensities = std::span<const uint32_t>(intensities.data(), intensities.size());
+        frame.metadata.time = time;
+        frame.metadata.polarity = polarity[0];
+        frame.metadata.scan_mode = scan_mode;
+        frame.metadata.msms_type = msms_type;
+        TdfFrameCompressor::validate(frame.scan_offsets, frame.tof_indices, frame.intensities);
+        frame.keep_alive = std::make_shared<const std::array<UInt32Array, 3>>(
+            std::array<UInt32Array, 3>{scan_offsets, tof_indices, intensities});
+        return frame;
+    }
+
+    // The controller can only watch the pipeline once it exists; it is
+    // detached again on close() and before the pipeline is destroyed.
+    void follow_backpressure()
+    {
+        if(adaptive_level) {
+            visit([this](auto& pipeline) { adaptive_level->attach(pipeline); });
+        }
+    }
+
+    // Calls f with whichever pipeline this writer runs.
+    template <typename F>
+    decltype(auto) visit(F&& f)
+    {
+        return std::visit([&](auto& p) -> decltype(auto) {
+            if(!p) {
+                throw std::runtime_error("TdfWriter is not initialized");
+            }
+            return f(*p);
+        }, pipeline);
+    }
+};
+
+
+NB_MODULE(tdf_writer_cpp, m)
+{
+    m.doc() = "Parallelized writer of Bruker TDF files";
+
+    nb::class_<WorkerPool>(m, "WorkerPool")
+        .def("__init__", [](WorkerPool* self, size_t num_threads, const std::string& affinity) {
+                 new (self) WorkerPool(num_threads, parse_affinity_policy(affinity));
+             },
+             "num_threads"_a = 0, "affinity"_a = "none",
+             "Compression threads shared by the TdfWriters created with pool=this one, serving them\n"
+             "round-robin. num_threads = 0 uses all hardware threads; affinity = 'compact' or 'scatter'\n"
+             "places them by NUMA node.")
+        .def_prop_ro("size", &WorkerPool::size, "Number of threads.");
+
+    nb::class_<MemoryBudget>(m, "MemoryBudget")
+        .def(nb::init<size_t>(), "limit"_a,
+             "Byte limit on the frames buffered by the TdfWriters created with memory_budget=this one:\n"
+             "queued and compressed frames waiting to be written, and the output staging blocks.")
+        .def_prop_ro("limit", &MemoryBudget::limit)
+        .def_prop_ro("used", &MemoryBudget::used_bytes, "Bytes currently charged.")
+        .def_prop_ro("peak", &MemoryBudget::peak_bytes, "Most bytes charged at once so far.");
+
+    nb::class_<PyTdfWriter>(m, "TdfWriter")
+        .def(nb::init<const std::string&, const std::string&, int, size_t, size_t, size_t, size_t, size_t, bool, uint64_t, bool, uint64_t,
+                      const std::vector<int>&, const std::string&, const std::vector<int>&, std::shared_ptr<WorkerPool>, bool, size_t, bool, int,
+                      size_t, size_t, std::shared_ptr<MemoryBudget>, bool>(),
+             "bin_filename"_a, "tdf_filename"_a, nb::kw_only(),
+             "compression_level"_a = 1,
+             "num_threads"_a = 0,
+             "input_buffer_size"_a = 0,
+             "reorder_window_size"_a = 0,
+             "mapper_batch_size"_a = 1,
+             "metadata_batch_size"_a = 10000,
+             "direct_io"_a = false,
+             "writeback_interval"_a = 0,
+             "drop_written_pages"_a = false,
+             "expected_size"_a = 0,
+             "mapper_cpus"_a = std::vector<int>(),
+             "affinity"_a = "none",
+             "reducer_cpus"_a = std::vector<int>(),
+             "pool"_a = nb::none(),
+             "offset_ordered"_a = false,
+             "checkpoint_interval"_a = 0,
+             "resume"_a = false,
+             "max_compression_level"_a = 0,
+             "dictionary_frames"_a = 0,
+             "dictionary_size"_a = 112640,
+             "memory_budget"_a = nb::none(),
+             "collect_timings"_a = true,
+             "Start a writer producing bin_filename (analysis.tdf_bin) and tdf_filename (analysis.tdf).\n"
+             "All other arguments are keyword-only.\n"
+             "num_threads = 0 uses all hardware threads; input_buffer_size = 0 picks num_threads + 1;\n"
+             "reorder_window_size bounds compressed frames waiting for a slower earlier one (0 = 4 * num_threads);\n"
+             "mapper_batch_size frames are taken by a worker at a time (raise it for many tiny frames);\n"
+             "direct_io writes analysis.tdf_bin with O_DIRECT, bypassing the page cache;\n"
+             "writeback_interval > 0 flushes written data every that many bytes; with drop_written_pages the\n"
+             "flushed ranges are also dropped from the page cache;\n"
+             "expected_size (bytes of analysis.tdf_bin, if known) is reserved up front to avoid fragmentation;\n"
+             "mapper_cpus pins worker i to mapper_cpus[i % len]; otherwise affinity = 'compact' or 'scatter'\n"
+             "places workers by NUMA node; reducer_cpus pins the threads writing the files: the reducer, the\n"
+             "analysis.tdf_bin writer and the analysis.tdf writer (see numa_node_cpus);\n"
+             "pool (a WorkerPool) compresses on shared threads, replacing num_threads, mapper_batch_size,\n"
+             "mapper_cpus, affinity and reducer_cpus;\n"
+             "offset_ordered has the compression threads write their blocks at precomputed offsets instead\n"
+             "of one writer thread (not with direct_io, writeback_interval or checkpoints);\n"
+             "checkpoint_interval > 0 syncs analysis.tdf_bin every that many frames and records the progress in\n"
+             "bin_filename + '.checkpoint'; resume continues an interrupted write from its last checkpoint,\n"
+             "skipping the resumed_frames frames already written;\n"
+             "max_compression_level > 0 varies the level per frame between compression_level and it, following\n"
+             "the queue occupancies: up while the disk is the bottleneck or there is headroom, down while\n"
+             "compression cannot keep up (the current level is in stats());\n"
+             "dictionary_frames > 0 trains a zstd dictionary of up to dictionary_size bytes on that many frames,\n"
+             "stores it as bin_filename + '.dict' and, once trained in the background, compresses frames with it. Such frames need the\n"
+             "dictionary to be read, which standard TDF readers do not support; leave it off for plain TDF;\n"
+             "memory_budget (a MemoryBudget) bounds the bytes of buffered frames on top of the buffer sizes;\n"
+             "add_frame then also waits while the budget is exhausted;\n"
+             "collect_timings = False leaves the *_ns histograms of stats(), the output writer's included, empty, saving the clock\n"
+             "reads and shared updates they cost per frame.")
+        .def("add_frame", &PyTdfWriter::add_frame,
+             "scan_offsets"_a, "tof_indices"_a, "intensities"_a,
+             "time"_a = 0.0, "polarity"_a = "+", "scan_mode"_a = 0, "msms_type"_a = 0,
+             "Queue one frame. scan_offsets has num_scans + 1 entries delimiting the peaks of each scan.\n"
+             "The arrays are read without copying and must not be modified until close() returns.\n"
+             "Releases the GIL while waiting for buffer space; may be called from several threads at once.")
+        .def("try_add_frame", &PyTdfWriter::try_add_frame,
+             "scan_offsets"_a, "tof_indices"_a, "intensities"_a,
+             "time"_a = 0.0, "polarity"_a = "+", "scan_mode"_a = 0, "msms_type"_a = 0,
+             "add_frame without waiting: returns False, queueing nothing, if the frame cannot be taken\n"
+             "right away (buffers full, memory budget exhausted). Raises as add_frame.")
+        .def("on_space", &PyTdfWriter::on_space, "callback"_a,
+             "Call callback() once, from a writer thread, when try_add_frame may succeed again (it may\n"
+             "not yet). Register it before the last try, so that space freed in between is not missed;\n"
+             "it should only wake the producer, e.g. with loop.call_soon_threadsafe.")
+        .def("close_async", &PyTdfWriter::close_async, "done"_a,
+             "Begin close() without waiting: done() is called, from a writer thread, once all frames are\n"
+             "written or the writer has stopped. Then call close(), which returns at once and raises\n"
+             "the error if writing failed. See tdf_writer.aio for coroutines built on these.")
+        .def("close", &PyTdfWriter::close, nb::call_guard<nb::gil_scoped_release>(),
+             "Wait for all queued frames to be written and finalize both files.\n"
+             "Releases the GIL while waiting; safe to call from any thread, more than once.\n"
+             "If writing a frame failed, raises that error (add_frame raises it as well).")
+        .def("cancel", &PyTdfWriter::cancel, nb::call_guard<nb::gil_scoped_release>(),
+             "Stop as soon as possible, dropping the frames not yet written; the files are left as far\n"
+             "as they got, resumable from their last checkpoint. Safe to call from any thread; does not raise.")
+        .def_prop_ro("resumed_frames", &PyTdfWriter::resumed_frames,
+             "Frames kept from the checkpoint when resuming; pass only the frames after them to add_frame.")
+        .def("stats", &PyTdfWriter::stats,
+             "Pipeline counters and timing histograms (count/total/mean/max/p50/p90/p99, in ns),\n"
+             "to tell compression-bound from reorder- or I/O-bound runs; may be called while writing.")
+        .def("block_index", &PyTdfWriter::block_index,
+             "(n, 2) array of (offset, size) of each frame in the binary file; valid after close().");
+
+    m.def("numa_node_cpus", &numa_node_cpus, "node"_a,
+          "CPUs of a NUMA node, e.g. the one an NVMe drive is attached to\n"
+          "(/sys/class/nvme/nvme0/device/numa_node); for reducer_cpus.");
+}
@@ -3,15 +3,26 @@
 
 #include <semaphore>
 #include <mutex>
+#include <atomic>
 #include <thread>
+#include <functional>
 #include <queue>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <memory>
+#include <algorithm>
 #include <optional>
+#include <exception>
+#include <span>
 #include <stdexcept>
 
+#include "affinity.hpp"
+#include "memory_budget.hpp"
+#include "stats.hpp"
 #include "sync_buffer.hpp"
+#include "ordered_queue.hpp"
 
 
 template <typename Input_t, typename Output_t>
@@ -23,7 +34,19 @@ public:
     using OutputType = Output_t;
 
     virtual Output_t map(const Input_t& input) = 0;
+    // Called by Dispatcher, which hands over each input it owns. Mappers
+    // that can reuse the input's storage override this as well; the default
+    // forwards to the const& overload. Derived mappers need a
+    // using Mapper<...>::map; so that overriding one overload does not hide
+    // the other.
+    virtual Output_t map(Input_t&& input) { return map(std::as_const(input)); }
     virtual ~Mapper() = default;
+
+    // Whether one instance may map on several threads at once. Mappers
+    // without state (or that lock it) set this to true in order to be
+    // shared by the mapper threads, see Dispatcher's single-mapper
+    // constructor.
+    static constexpr bool thread_safe = false;
 };
 
 template <typename Input_t>
@@ -33,11 +56,297 @@ public:
     using InputType = Input_t;
 
     virtual void reduce(const Input_t& input) = 0;
+    // Dispatcher hands over every result that is ready in index order at
+    // once; reducers that can write several inputs in one go (vectored
+    // I/O) override this. The default reduces them one by one.
+    virtual void reduce_batch(std::span<const Input_t> inputs)
+    {
+        for(const Input_t& input : inputs) {
+            reduce(input);
+        }
+    }
+    // Called once on the reducer thread after the last reduce().
+    virtual void finish() {}
     virtual ~Reducer() = default;
 };
 
 
-template <typename Mapper_t, typename Reducer_t>
+// Runs one job. Mappers that need to know the job index (such as
+// OffsetWritingMapper, which places blocks in the output file itself)
+// provide map_indexed(index, input); for all others the index is dropped.
+template <typename Mapper_t, typename Input>
+auto map_job(Mapper_t& mapper, size_t index, Input&& input)
+{
+    if constexpr (requires { mapper.map_indexed(index, std::forward<Input>(input)); }) {
+        return mapper.map_indexed(index, std::forward<Input>(input));
+    } else {
+        return mapper.map(std::forward<Input>(input));
+    }
+}
+
+
+// Occupancy of a container as a fraction of its capacity, read without
+// locking, for containers that expose size() and capacity(); 0 for the
+// others.
+template <typename Container>
+double container_fill(const Container& container)
+{
+    if constexpr (requires { container.size(); container.capacity(); }) {
+        const size_t capacity = container.capacity();
+        return capacity == 0 ? 0.0 : static_cast<double>(container.size()) / static_cast<double>(capacity);
+    } else {
+        return 0.0;
+    }
+}
+
+
+// Interrupts a mapper that is blocked inside a job, for mappers that can
+// be (e.g. OffsetWritingMapper waiting for its offset); called from
+// another thread while the mapper may be running.
+template <typename Mapper_t>
+void cancel_mapper(Mapper_t& mapper)
+{
+    if constexpr (requires { mapper.cancel(); }) {
+        mapper.cancel();
+    }
+}
+
+
+// First exception raised on any thread of a pipeline, and whether the
+// pipeline is stopping, because of it or because it was cancelled.
+// Errors raised once it is stopping are consequences of the stop (pushes
+// to the closed queues, interrupted mappers) and are dropped. Thread-safe.
+class PipelineError
+{
+    mutable std::mutex mtx;
+    std::exception_ptr first;
+    std::atomic<bool> stopped = false;
+
+public:
+    // Records error and stops the pipeline; returns false (and drops the
+    // error) if it was stopping already.
+    bool capture(std::exception_ptr error)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(stopped.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        first = std::move(error);
+        stopped.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // Stops the pipeline without an error; returns false if it was
+    // stopping already.
+    bool stop()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return !stopped.exchange(true, std::memory_order_acq_rel);
+    }
+
+    inline bool stopping() const { return stopped.load(std::memory_order_acquire); }
+
+    // The recorded error, or null.
+    std::exception_ptr error() const
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return first;
+    }
+
+    // Rethrows the recorded error, if any.
+    void rethrow() const
+    {
+        if(std::exception_ptr recorded = error()) {
+            std::rethrow_exception(recorded);
+        }
+    }
+};
+
+
+// One-shot callbacks of producers waiting for room in a pipeline without
+// blocking a thread (see Dispatcher::on_space). run() is called by the
+// threads that make room, after making it, and calls and forgets every
+// callback registered so far; it costs a fence and a load while none is.
+//
+// A callback only says that there may be room: the producer retries and
+// registers again if it still cannot get in. It registers before its
+// last retry, so either that retry sees the room or run() sees the
+// callback. Callbacks run outside the pipeline's locks and must not
+// throw.
+class SpaceCallbacks
+{
+    std::mutex mtx;
+    std::vector<std::function<void()>> callbacks;
+    std::atomic<size_t> count = 0;
+
+public:
+    void add(std::function<void()> callback)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            callbacks.push_back(std::move(callback));
+            count.store(callbacks.size(), std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void run()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(count.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        std::vector<std::function<void()>> due;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            due.swap(callbacks);
+            count.store(0, std::memory_order_relaxed);
+        }
+        for(auto& callback : due) {
+            callback();
+        }
+    }
+};
+
+
+// Callbacks waiting for a pipeline to finish (see Dispatcher::close_async).
+// complete() calls each of them once with the pipeline's first error, or
+// null; callbacks added afterwards are called right away, on the adding
+// thread. They must not throw.
+class CompletionCallbacks
+{
+    std::mutex mtx;
+    bool done = false;
+    std::exception_ptr outcome;
+    std::vector<std::function<void(std::exception_ptr)>> callbacks;
+
+public:
+    void add(std::function<void(std::exception_ptr)> callback)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if(!done) {
+                callbacks.push_back(std::move(callback));
+                return;
+            }
+        }
+        // outcome no longer changes once done.
+        callback(outcome);
+    }
+
+    void complete(std::exception_ptr error)
+    {
+        std::vector<std::function<void(std::exception_ptr)>> due;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            done = true;
+            outcome = std::move(error);
+            due.swap(callbacks);
+        }
+        for(auto& callback : due) {
+            callback(outcome);
+        }
+    }
+};
+
+
+// Construction parameters of a Dispatcher. Zero sizes pick the defaults
+// noted below.
+struct DispatcherOptions
+{
+    static constexpr size_t default_reorder_factor = 4;
+
+    // 0 uses every hardware thread.
+    size_t num_mapper_threads = 0;
+    // Capacity of the input buffer; 0 picks num_mapper_threads + 1.
+    size_t input_buffer_size = 0;
+    // Bounds how many mapped results may wait in the reorder queue for an
+    // earlier, slower job; mapper threads that would exceed it block until
+    // the reducer catches up. 0 picks
+    // default_reorder_factor * num_mapper_threads.
+    size_t reorder_window_size = 0;
+    // How many inputs a mapper thread takes from the input buffer (and
+    // pushes to the reorder queue) at a time; raising it amortizes locking
+    // for many tiny inputs at the cost of coarser load balancing.
+    size_t mapper_batch_size = 1;
+
+    // Mapper thread i is pinned to mapper_cpus[i % mapper_cpus.size()].
+    // If the list is empty, mapper_affinity picks it: compact fills one
+    // NUMA node first, scatter alternates between nodes. A pinned mapper
+    // allocates its output buffers from its own pool on its own thread,
+    // so they are placed on its node by first touch and stay there.
+    std::vector<int> mapper_cpus;
+    AffinityPolicy mapper_affinity = AffinityPolicy::none;
+    // CPUs the reducer thread may run on, e.g. numa_node_cpus() of the
+    // node the output device is attached to. Empty leaves it unpinned.
+    // A reducer with threads of its own pins them separately (see
+    // FileWriterOptions::writer_cpus). A thread that cannot be pinned
+    // fails the pipeline like any other error.
+    std::vector<int> reducer_cpus;
+
+    // Index of the first job; later jobs are numbered on from it. Set it
+    // to the jobs already written when resuming from a checkpoint (see
+    // FileCollector), so that indices keep matching positions in the
+    // output.
+    size_t first_job_index = 0;
+
+    // Bounds the bytes (see memory_footprint) of the inputs not yet
+    // mapped and of the results in the reorder queue together, on top of
+    // the item counts above. Share it with the output's staging blocks
+    // (FileWriterOptions::memory_budget), and with other pipelines, to
+    // bound all of them at once; see MemoryBudget.
+    std::shared_ptr<MemoryBudget> memory_budget;
+
+    // Time add_input, the mapper and the reducer steps into the *_ns
+    // histograms of stats(). That costs two clock reads and a few atomic
+    // updates on histograms shared by all mapper threads per job; see
+    // tdf_writer_bench for what it amounts to. Off leaves those
+    // histograms empty; the job counts are kept either way.
+    bool collect_timings = true;
+};
+
+
+// Snapshot of a Dispatcher's instrumentation, see Dispatcher::stats().
+// Durations are in nanoseconds. Comparing where the time goes tells a
+// compression-bound run (map_ns dominates, mappers rarely wait) from a
+// reorder- or I/O-bound one (mappers blocked in reorder_push_ns while
+// reduce_ns dominates on the reducer thread).
+struct DispatcherStats
+{
+    uint64_t jobs_added = 0;
+    uint64_t jobs_mapped = 0;
+    uint64_t jobs_reduced = 0;
+    HistogramSnapshot add_input_ns;      // Per add_input, including waiting for space
+    HistogramSnapshot input_wait_ns;     // Per mapper pop from the input buffer
+    HistogramSnapshot map_ns;            // Per job
+    HistogramSnapshot reorder_push_ns;   // Per mapper batch pushed to the reorder queue
+    HistogramSnapshot reducer_wait_ns;   // Per reducer pop from the reorder queue
+    HistogramSnapshot reduce_ns;         // Per reduce_batch call
+    HistogramSnapshot reduce_batch_size;
+    // Container-level figures, for containers that keep them.
+    std::optional<ContainerStatsSnapshot> input_buffer;
+    std::optional<ContainerStatsSnapshot> reorder_queue;
+};
+
+
+// InputBuffer_t is the thread-safe FIFO feeding the mapper threads:
+// SynchronizedBuffer (mutex and condition variables), MPMCRingBuffer
+// (lock-free, for many mapper threads and small inputs) or
+// WorkStealingBuffer (a deque per mapper thread, for inputs of very
+// uneven cost). It must provide a capacity constructor, push, emplace,
+// pop_batch, close and is_closed, and try_push for try_add_input.
+// Buffers that also take the number of workers and the chunk size
+// (mapper_batch_size) are constructed with them, and buffers with
+// pop_batch(worker, n) are popped per worker.
+//
+// ReorderQueue_t restores job order between mappers and reducer:
+// SyncBoundedPriorityQueue (a heap bounded by item count) or
+// SyncReorderWindow (O(1) slot array bounded by index distance), both
+// OrderedQueue instantiations from ordered_queue.hpp. It is constructed
+// from the reorder window size.
+template <typename Mapper_t, typename Reducer_t,
+          template <typename> class InputBuffer_t = SynchronizedBuffer,
+          template <typename> class ReorderQueue_t = SyncBoundedPriorityQueue>
 class Dispatcher
 {
 public:
@@ -48,77 +357,597 @@ public:
     static_assert(std::is_same<IntermediateType, typename Reducer_t::InputType>::value,
                   "Mapper output type must match Reducer input type");
 
+    // The mapper threads share mapper_, so with more than one of them
+    // Mapper_t must declare itself thread_safe; mappers with per-thread
+    // state take the mapper-factory constructor instead.
     Dispatcher(std::unique_ptr<Mapper_t> mapper_,
                std::unique_ptr<Reducer_t> reducer_,
-               size_t input_buffer_size = std::thread::hardware_concurrency()+1,
-               size_t num_mapper_threads = std::thread::hardware_concurrency())
-        : input_buffer(input_buffer_size),
-            intermediate_queue(),
-            mapper(std::move(mapper_)),
-            reducer(std::move(reducer_))
+               const DispatcherOptions& options)
+        : settings(resolve_options(options)),
+          input_buffer(make_input_buffer(settings)),
+          intermediate_queue(settings.reorder_window_size, settings.first_job_index),
+          reducer(std::move(reducer_))
     {
-        if(!mapper) {
+        if(!mapper_) {
             throw std::invalid_argument("Mapper cannot be null");
         }
+        if(!Mapper_t::thread_safe && settings.num_mapper_threads > 1) {
+            throw std::invalid_argument("Mapper is not thread-safe: pass a mapper factory to use several mapper threads");
+        }
+        mappers.push_back(std::move(mapper_));
+        start_threads();
+    }
+
+    // Each mapper thread gets its own instance created by mapper_factory,
+    // so mappers may keep per-thread state (compression contexts, scratch
+    // buffers, buffer pools) without locking. The factory is called on the
+    // constructing thread, num_mapper_threads times, before any worker
+    // starts; allocations a mapper makes while mapping happen on its own
+    // (possibly pinned) thread.
+    Dispatcher(std::function<std::unique_ptr<Mapper_t>()> mapper_factory,
+               std::unique_ptr<Reducer_t> reducer_,
+               const DispatcherOptions& options)
+        : settings(resolve_options(options)),
+          input_buffer(make_input_buffer(settings)),
+          intermediate_queue(settings.reorder_window_size, settings.first_job_index),
+          reducer(std::move(reducer_))
+    {
+        if(!mapper_factory) {
+            throw std::invalid_argument("Mapper factory cannot be empty");
+        }
+        for(size_t i = 0; i < settings.num_mapper_threads; ++i) {
+            mappers.push_back(mapper_factory());
+            if(!mappers.back()) {
+                throw std::invalid_argument("Mapper factory returned null");
+            }
+        }
+        start_threads();
+    }
+
+    // Positional forms of the above, see DispatcherOptions.
+    Dispatcher(std::unique_ptr<Mapper_t> mapper_,
+               std::unique_ptr<Reducer_t> reducer_,
+               size_t input_buffer_size = std::thread::hardware_concurrency()+1,
+               size_t num_mapper_threads = std::thread::hardware_concurrency(),
+               size_t reorder_window_size = 0,
+               size_t mapper_batch_size_ = 1)
+        : Dispatcher(std::move(mapper_), std::move(reducer_),
+                     positional_options(input_buffer_size, num_mapper_threads, reorder_window_size, mapper_batch_size_))
+    {}
+
+    Dispatcher(std::function<std::unique_ptr<Mapper_t>()> mapper_factory,
+               std::unique_ptr<Reducer_t> reducer_,
+               size_t input_buffer_size = std::thread::hardware_concurrency()+1,
+               size_t num_mapper_threads = std::thread::hardware_concurrency(),
+               size_t reorder_window_size = 0,
+               size_t mapper_batch_size_ = 1)
+        : Dispatcher(std::move(mapper_factory), std::move(reducer_),
+                     positional_options(input_buffer_size, num_mapper_threads, reorder_window_size, mapper_batch_size_))
+    {}
+
+
+    // Blocks while the input buffer is full. Safe to call from several
+    // threads at once: calls are serialized, so job indices follow the
+    // order in which the calls acquired the producer lock, and each job is
+    // in the input buffer before the next index is handed out (the reorder
+    // queue relies on that to never wait for an index still held back by a
+    // producer). Throws if the dispatcher is closed, including when close()
+    // is called while this call is blocked, and once a job has failed
+    // (rethrowing that job's exception) or the dispatcher was cancelled.
+    void add_input(const InputType& input)
+    {
+        emplace_input(input);
+    }
+
+    void add_input(InputType&& input)
+    {
+        emplace_input(std::move(input));
+    }
+
+    // Constructs the input from args directly inside its (index, input)
+    // job pair, which is then moved into the input buffer. With a memory
+    // budget it is built first, to be weighed, and the call also blocks
+    // while the budget cannot take it.
+    template <typename... Args>
+    void emplace_input(Args&&... args)
+    {
+        Timing call(counters.add_input_ns, settings.collect_timings);
+        {
+            std::lock_guard<std::mutex> lock(producer_mtx);
+            queue_input(std::forward<Args>(args)...);
+        }
+        // A try_add_input that found the producer lock taken may get in now.
+        space.run();
+        call.record();
+    }
+
+    // Non-blocking add_input, for producers that must not wait, such as an
+    // event loop: queues input and returns true if it can be taken right
+    // away, or returns false and leaves input untouched if the input
+    // buffer is full, the memory budget exhausted or another add_input is
+    // waiting for room. Throws as add_input. Use on_space() to learn when
+    // to try again.
+    bool try_add_input(const InputType& input)
+    {
+        return offer_input(input);
+    }
+
+    bool try_add_input(InputType&& input)
+    {
+        return offer_input(std::move(input));
+    }
+
+    // Calls callback once, from one of the threads that make room for an
+    // input (or close the dispatcher), when try_add_input may succeed
+    // again. The callback does not queue anything itself and may come
+    // early; register it before the last try_add_input attempt, so that
+    // room freed in between is not missed:
+    //
+    //     while(!dispatcher.try_add_input(input)) {
+    //         dispatcher.on_space(wake_me);
+    //         if(dispatcher.try_add_input(input)) break;
+    //         wait_for(wake_me);
+    //     }
+    //
+    // It runs on a pipeline thread, outside the pipeline's locks, and
+    // should only hand over to the producer (e.g. post to its event loop);
+    // it must not throw.
+    void on_space(std::function<void()> callback)
+    {
+        space.add(std::move(callback));
+    }
+
+    // Blocks until every queued input has been mapped and reduced. Closing
+    // is idempotent and may be called from any thread, also concurrently;
+    // a dispatcher that was not closed explicitly finishes the remaining
+    // work on destruction.
+    //
+    // If a mapper or the reducer threw, the pipeline stops at the first
+    // such exception: the remaining inputs and results are dropped, the
+    // reducer's finish() is not called (the output stays as far as it got,
+    // with its last checkpoint if it has one), and close() rethrows the
+    // exception, every time it is called.
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(close_mtx);
+        close_input();
+        for(auto& t : mapper_threads) {
+            if(t.joinable()) t.join();
+        }
+        if(reducer_thread.joinable()) {
+            reducer_thread.join();
+        }
+        closed = true;
+        errors.rethrow();
+    }
+
+    // Closes the input like close(), but returns right away: done is
+    // called once every queued input has been mapped and reduced, or the
+    // pipeline has stopped, with the exception close() would throw (or
+    // null), from the pipeline thread that finished last, or at once if
+    // that has happened already. close() must still be called, or the
+    // dispatcher destroyed, to join the threads; by then it does not have
+    // to wait for them. done must not throw, nor call close() itself.
+    void close_async(std::function<void(std::exception_ptr)> done)
+    {
+        completion.add(std::move(done));
+        close_input();
+    }
+
+    // Stops as soon as possible: like a failure (see close()), but without
+    // an error. Queued inputs are dropped, mappers that support it are
+    // interrupted in their current job, and only the jobs already being
+    // mapped or reduced run to their end. Returns once every thread has
+    // stopped; never throws, even if a job failed before (close() still
+    // reports that). Does nothing once the dispatcher is closed.
+    void cancel()
+    {
+        if(!closed && errors.stop()) {
+            abort();
+        }
+        try {
+            close();
+        } catch(...) {}
+    }
+
+    // True once close() has returned, i.e. when the reducer may be inspected.
+    inline bool is_closed() const { return closed; }
+
+    // A failure not collected by an explicit close() is dropped here.
+    ~Dispatcher()
+    {
+        try {
+            close();
+        } catch(...) {}
+    }
+
+    // The reducer is owned by the dispatcher; inspect it only after close(),
+    // when the reducer thread has finished.
+    inline Reducer_t& get_reducer() { return *reducer; }
+    inline const Reducer_t& get_reducer() const { return *reducer; }
+
+    // Safe to call from any thread at any time, also while running.
+    DispatcherStats stats() const
+    {
+        DispatcherStats result;
+        result.jobs_added = counters.jobs_added.load(std::memory_order_relaxed);
+        result.jobs_mapped = counters.jobs_mapped.load(std::memory_order_relaxed);
+        result.jobs_reduced = counters.jobs_reduced.load(std::memory_order_relaxed);
+        result.add_input_ns = counters.add_input_ns.snapshot();
+        result.input_wait_ns = counters.input_wait_ns.snapshot();
+        result.map_ns = counters.map_ns.snapshot();
+        result.reorder_push_ns = counters.reorder_push_ns.snapshot();
+        result.reducer_wait_ns = counters.reducer_wait_ns.snapshot();
+        result.reduce_ns = counters.reduce_ns.snapshot();
+        result.reduce_batch_size = counters.reduce_batch_size.snapshot();
+        if constexpr (requires { input_buffer.stats(); }) {
+            result.input_buffer = input_buffer.stats();
+        }
+        if constexpr (requires { intermediate_queue.stats(); }) {
+            result.reorder_queue = intermediate_queue.stats();
+        }
+        return result;
+    }
+
+    // Current occupancy of the input buffer and of the reorder queue, as
+    // fractions of their capacity. Cheap enough to sample per job, see
+    // AdaptiveCompressionLevel.
+    inline double input_fill() const { return container_fill(input_buffer); }
+    inline double reorder_fill() const { return container_fill(intermediate_queue); }
+
+    // The options in effect, with the defaults resolved.
+    inline const DispatcherOptions& options() const { return settings; }
+
+    static constexpr size_t default_reorder_factor = DispatcherOptions::default_reorder_factor;
+    static constexpr size_t max_reduce_batch = 256;
+
+private:
+    using InputBufferType = InputBuffer_t<std::pair<size_t, InputType>>;
+
+    struct Counters
+    {
+        std::atomic<uint64_t> jobs_added = 0;
+        std::atomic<uint64_t> jobs_mapped = 0;
+        std::atomic<uint64_t> jobs_reduced = 0;
+        Histogram add_input_ns;
+        Histogram input_wait_ns;
+        Histogram map_ns;
+        Histogram reorder_push_ns;
+        Histogram reducer_wait_ns;
+        Histogram reduce_ns;
+        Histogram reduce_batch_size;
+    };
+
+    static DispatcherOptions positional_options(size_t input_buffer_size,
+                                                size_t num_mapper_threads,
+                                                size_t reorder_window_size,
+                                                size_t mapper_batch_size)
+    {
+        DispatcherOptions options;
+        options.input_buffer_size = input_buffer_size;
+        options.num_mapper_threads = num_mapper_threads;
+        options.reorder_window_size = reorder_window_size;
+        options.mapper_batch_size = mapper_batch_size;
+        return options;
+    }
+
+    static DispatcherOptions resolve_options(DispatcherOptions options)
+    {
+        if(options.num_mapper_threads == 0) {
+            options.num_mapper_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        if(options.input_buffer_size == 0) {
+            options.input_buffer_size = options.num_mapper_threads + 1;
+        }
+        if(options.reorder_window_size == 0) {
+            options.reorder_window_size = DispatcherOptions::default_reorder_factor * options.num_mapper_threads;
+        }
+        if(options.mapper_batch_size == 0) {
+            throw std::invalid_argument("Mapper batch size must be greater than zero");
+        }
+        if(options.mapper_cpus.empty()) {
+            options.mapper_cpus = ordered_cpus(options.mapper_affinity);
+        }
+        check_cpus(options.mapper_cpus);
+        check_cpus(options.reducer_cpus);
+        return options;
+    }
+
+    static InputBufferType make_input_buffer(const DispatcherOptions& options)
+    {
+        if constexpr (std::is_constructible_v<InputBufferType, size_t, size_t, size_t>) {
+            return InputBufferType(options.input_buffer_size, options.num_mapper_threads, options.mapper_batch_size);
+        } else {
+            return InputBufferType(options.input_buffer_size);
+        }
+    }
+
+    void start_threads()
+    {
         if(!reducer) {
             throw std::invalid_argument("Reducer cannot be null");
         }
-        if(num_mapper_threads == 0) {
-            throw std::invalid_argument("Number of mapper threads must be greater than zero");
+        if(settings.memory_budget) {
+            intermediate_queue.set_memory_budget(settings.memory_budget);
         }
+        running_mappers = settings.num_mapper_threads;
+        running_threads = settings.num_mapper_threads + 1;
 
-        // Start mapper threads
-        for(size_t i = 0; i < num_mapper_threads; ++i) {
-            mapper_threads.emplace_back([this]() {
-                while(true) {
-                    auto item = input_buffer.pop();
-                    if(!item.has_value()) break; // Buffer closed and empty
-                    auto& [idx, input] = item.value();
-                    IntermediateType intermediate = mapper->map(input);
-                    intermediate_queue.push({idx, std::move(intermediate)});
+        // Start mapper threads. Each one pins itself before doing anything
+        // else, so that what it allocates is first touched on its node.
+        for(size_t i = 0; i < settings.num_mapper_threads; ++i) {
+            Mapper_t* mapper = mappers[i % mappers.size()].get();
+            std::vector<int> cpus;
+            if(!settings.mapper_cpus.empty()) {
+                cpus.push_back(settings.mapper_cpus[i % settings.mapper_cpus.size()]);
+            }
+            mapper_threads.emplace_back([this, mapper, i, cpus]() {
+                std::vector<std::pair<size_t, IntermediateType>> results;
+                try {
+                    pin_current_thread(cpus);
+                    results.reserve(settings.mapper_batch_size);
+                    while(true) {
+                        Timing waiting(counters.input_wait_ns, settings.collect_timings);
+                        auto items = pop_inputs(i);
+                        waiting.record();
+                        if(items.empty() || errors.stopping()) break; // Buffer closed and empty, or stopped
+                        space.run();
+                        for(auto& [idx, input] : items) {
+                            const size_t bytes = settings.memory_budget ? memory_footprint(input) : 0;
+                            Timing mapping(counters.map_ns, settings.collect_timings);
+                            results.emplace_back(idx, map_job(*mapper, idx, std::move(input)));
+                            mapping.record();
+                            release_input(bytes);
+                        }
+                        if(settings.memory_budget) {
+                            space.run();
+                        }
+                        counters.jobs_mapped.fetch_add(results.size(), std::memory_order_relaxed);
+                        Timing pushing(counters.reorder_push_ns, settings.collect_timings);
+                        intermediate_queue.push_batch(results);
+                        pushing.record();
+                        results.clear();
+                    }
+                } catch(...) {
+                    fail(std::current_exception());
                 }
+                mapper_exited();
             });
         }
 
-        // Start reducer thread
+        // Start reducer thread: wait for the next result, then take every
+        // consecutive one already waiting and reduce them as one batch
         reducer_thread = std::thread([this]() {
-            while(true) {
-                auto item = intermediate_queue.pop();
-                if(!item.has_value()) break; // Queue closed and empty
-                reducer->reduce(item.value().second);
+            std::vector<IntermediateType> batch;
+            try {
+                pin_current_thread(settings.reducer_cpus);
+                batch.reserve(max_reduce_batch);
+                while(true) {
+                    Timing waiting(counters.reducer_wait_ns, settings.collect_timings);
+                    auto items = intermediate_queue.pop_batch(max_reduce_batch);
+                    waiting.record();
+                    if(items.empty() || errors.stopping()) break; // Queue closed and empty, or stopped
+                    for(auto& item : items) {
+                        batch.push_back(std::move(item.second));
+                    }
+                    Timing reducing(counters.reduce_ns, settings.collect_timings);
+                    reducer->reduce_batch(batch);
+                    reducing.record();
+                    counters.reduce_batch_size.record(batch.size());
+                    counters.jobs_reduced.fetch_add(batch.size(), std::memory_order_relaxed);
+                    batch.clear();
+                }
+                if(!errors.stopping()) {
+                    reducer->finish();
+                }
+            } catch(...) {
+                fail(std::current_exception());
             }
+            thread_exited();
         });
     }
 
+    // Stops the pipeline at the first error: the closed queues wake every
+    // thread blocked on them (and the producers in add_input), and the
+    // mappers are interrupted. The reorder queue would otherwise wait
+    // forever for the index of the failed job.
+    void fail(std::exception_ptr error)
+    {
+        if(errors.capture(std::move(error))) {
+            abort();
+        }
+    }
+
+    void abort()
+    {
+        close_input();
+        intermediate_queue.close();
+        for(auto& mapper : mappers) {
+            cancel_mapper(*mapper);
+        }
+    }
 
-    void add_input(const InputType& input)
+    // Wakes add_input calls waiting for room, so that they throw, and
+    // tells the producers waiting through on_space().
+    void close_input()
+    {
+        input_buffer.close();
+        if(settings.memory_budget) {
+            settings.memory_budget->notify();
+        }
+        space.run();
+    }
+
+    // The last mapper thread to stop closes the reorder queue, so that the
+    // reducer finishes without close() having to join the mappers first,
+    // and returns the budget charged for inputs a stopped pipeline left
+    // unmapped; producers release their own charges under producer_mtx.
+    void mapper_exited()
+    {
+        if(running_mappers.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            {
+                std::lock_guard<std::mutex> lock(producer_mtx);
+                release_input(input_bytes.load(std::memory_order_relaxed));
+            }
+            intermediate_queue.close();
+        }
+        thread_exited();
+    }
+
+    void thread_exited()
+    {
+        if(running_threads.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            completion.complete(errors.error());
+        }
+    }
+
+    // Caller holds producer_mtx.
+    template <typename... Args>
+    void queue_input(Args&&... args)
     {
         if(input_buffer.is_closed()) {
-            throw std::runtime_error("Cannot add input to closed dispatcher");
+            throw_closed();
+        }
+        try {
+            if(settings.memory_budget) {
+                InputType input(std::forward<Args>(args)...);
+                const size_t bytes = memory_footprint(input);
+                charge_input(bytes);
+                try {
+                    input_buffer.emplace(std::piecewise_construct,
+                                         std::forward_as_tuple(next_job_index),
+                                         std::forward_as_tuple(std::move(input)));
+                } catch(...) {
+                    release_input(bytes);
+                    throw;
+                }
+            } else {
+                input_buffer.emplace(std::piecewise_construct,
+                                     std::forward_as_tuple(next_job_index),
+                                     std::forward_as_tuple(std::forward<Args>(args)...));
+            }
+        } catch(const std::runtime_error&) {
+            if(input_buffer.is_closed()) {
+                throw_closed();
+            }
+            throw;
         }
-        input_buffer.push(std::make_pair(input, next_job_index++));
+        ++next_job_index;
+        counters.jobs_added.fetch_add(1, std::memory_order_relaxed);
     }
 
-    void close()
+    template <typename Input>
+    bool offer_input(Input&& input)
     {
-        input_buffer.close();
-        for(auto& t : mapper_threads) {
-            if(t.joinable()) t.join();
+        Timing call(counters.add_input_ns, settings.collect_timings);
+        {
+            std::unique_lock<std::mutex> lock(producer_mtx, std::try_to_lock);
+            if(!lock.owns_lock()) {
+                return false;
+            }
+            if(input_buffer.is_closed()) {
+                throw_closed();
+            }
+            const size_t bytes = settings.memory_budget ? memory_footprint(input) : 0;
+            if(settings.memory_budget && !try_charge_input(bytes)) {
+                return false;
+            }
+            std::pair<size_t, InputType> job(next_job_index, std::forward<Input>(input));
+            bool pushed = false;
+            try {
+                pushed = input_buffer.try_push(std::move(job));
+            } catch(const std::runtime_error&) {
+                release_input(bytes);
+                if(input_buffer.is_closed()) {
+                    throw_closed();
+                }
+                throw;
+            }
+            if(!pushed) {
+                release_input(bytes);
+                if constexpr (!std::is_lvalue_reference_v<Input>) {
+                    input = std::move(job.second);
+                }
+                return false;
+            }
+            ++next_job_index;
+            counters.jobs_added.fetch_add(1, std::memory_order_relaxed);
         }
-        intermediate_queue.close();
-        if(reducer_thread.joinable()) {
-            reducer_thread.join();
+        space.run();
+        call.record();
+        return true;
+    }
+
+    // Caller holds producer_mtx. Inputs are charged from add_input until
+    // they have been mapped, whatever the input buffer type; the first
+    // one while none is held always gets in. Blocks while the budget is
+    // exhausted, unless the dispatcher is closed meanwhile.
+    void charge_input(size_t bytes)
+    {
+        const bool acquired = settings.memory_budget->acquire(
+            bytes,
+            [this]() { return input_bytes.load(std::memory_order_seq_cst) == 0; },
+            [this]() { return input_buffer.is_closed(); });
+        if(!acquired) {
+            throw_closed();
         }
+        input_bytes.fetch_add(bytes, std::memory_order_relaxed);
     }
 
-private:
-    SynchronizedBuffer<std::pair<size_t,InputType>> input_buffer;
-    SyncBoundedPriorityQueue<IntermediateType> intermediate_queue;
-    std::unique_ptr<Mapper_t> mapper;
+    // Caller holds producer_mtx. charge_input without waiting.
+    bool try_charge_input(size_t bytes)
+    {
+        if(input_bytes.load(std::memory_order_seq_cst) == 0) {
+            settings.memory_budget->force_acquire(bytes);
+        } else if(!settings.memory_budget->try_acquire(bytes)) {
+            return false;
+        }
+        input_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        return true;
+    }
+
+    void release_input(size_t bytes)
+    {
+        if(bytes > 0) {
+            input_bytes.fetch_sub(bytes, std::memory_order_seq_cst);
+            settings.memory_budget->release(bytes);
+        }
+    }
+
+    [[noreturn]] void throw_closed()
+    {
+        errors.rethrow();
+        throw std::runtime_error(errors.stopping() ? "Dispatcher was cancelled" : "Cannot add input to closed dispatcher");
+    }
+
+    std::vector<std::pair<size_t, InputType>> pop_inputs(size_t worker)
+    {
+        if constexpr (requires { input_buffer.pop_batch(worker, settings.mapper_batch_size); }) {
+            return input_buffer.pop_batch(worker, settings.mapper_batch_size);
+        } else {
+            return input_buffer.pop_batch(settings.mapper_batch_size);
+        }
+    }
+
+    DispatcherOptions settings;
+    InputBufferType input_buffer;
+    ReorderQueue_t<IntermediateType> intermediate_queue;
+    std::vector<std::unique_ptr<Mapper_t>> mappers;
     std::unique_ptr<Reducer_t> reducer;
     std::vector<std::thread> mapper_threads;
     std::thread reducer_thread;
-    size_t next_job_index = 0;
+    std::mutex producer_mtx;
+    std::mutex close_mtx;
+    std::atomic<bool> closed = false;
+    PipelineError errors;
+    // Bytes charged to the memory budget for inputs not yet mapped.
+    std::atomic<size_t> input_bytes = 0;
+    std::atomic<size_t> running_mappers = 0;
+    std::atomic<size_t> running_threads = 0;
+    SpaceCallbacks space;
+    CompletionCallbacks completion;
+    Counters counters;
+    size_t next_job_index = settings.first_job_index;
 };
 
 #endif // TDF_WRITER_DISPATCHER_HPP
\ No newline at end of file
@@ -1,50 +1,176 @@
 #ifndef TDF_WRITER_FILE_COLLECTOR_HPP
 #define TDF_WRITER_FILE_COLLECTOR_HPP
 
-#include <iostream>
-#include <cstdio>
-#include <vector>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
-#include <stdexcept>
-
+#include <vector>
 
+#include "checkpoint.hpp"
 #include "dispatcher.hpp"
 #include "simple_buffer.hpp"
+#include "staged_file_writer.hpp"
+
+
+struct CheckpointOptions
+{
+    // Checkpoint after every interval blocks; 0 disables checkpoints.
+    size_t interval = 0;
+    // Sidecar file; empty uses the output file name + ".checkpoint".
+    std::string path;
+    // Continue the output file from its checkpoint (if it has one; if not,
+    // the file is started anew), keeping at most resume_limit blocks.
+    bool resume = false;
+    size_t resume_limit = SIZE_MAX;
+};
 
 
+// Reducer appending every block to a single file, in job order.
+//
+// Alongside the data the collector records where each block landed:
+// block_index()[i] is the location of the i-th reduced block, which for a
+// Dispatcher is job index i. For analysis.tdf_bin the offsets are the
+// Frames.TimsId values.
+//
+// The collector is only the ordering stage: blocks are copied into the
+// staging blocks of a StagedFileWriter, whose own thread writes them out,
+// so the reducer thread goes back to popping ready blocks while the disk
+// catches up. The file is complete once finish() has returned. options
+// selects the staging sizes, the O_DIRECT / writeback pacing modes and
+// preallocation (an expected size hint avoids fragmenting the file).
+//
+// With checkpoint.interval set, every interval blocks the data written so
+// far is synced and recorded in a FileCheckpoint sidecar. A collector
+// created with checkpoint.resume truncates the file back to the last
+// checkpoint and continues after it: resumed_blocks() jobs are already on
+// disk, so the producer starts at that job (DispatcherOptions::
+// first_job_index) and only the frames after it are compressed again.
+// finish() leaves a final checkpoint behind; remove_checkpoint() deletes
+// it once the output is known to be complete.
 class FileCollector : public Reducer<SimpleBuffer<char>>
 {
-    FILE* file = nullptr;
+    std::unique_ptr<StagedFileWriter> writer;
+    uint64_t current_offset = 0;
+    std::vector<BlockLocation> index;
+    std::vector<const SimpleBuffer<char>*> pending;
+    size_t checkpoint_interval;
+    size_t resumed = 0;
+    size_t checkpointed = 0;
+    std::unique_ptr<CheckpointLog> checkpoint_log;
 
-public:
-    FileCollector(std::string filename)
+    static std::optional<FileCheckpoint> load_checkpoint(const CheckpointOptions& checkpoint, const std::string& path)
     {
-        file = std::fopen(filename.c_str(), "wb");
-        if(!file) {
-            throw std::runtime_error("Failed to open file: " + filename);
+        if(!checkpoint.resume) {
+            return std::nullopt;
         }
+        return FileCheckpoint::load(path);
     }
 
-    FileCollector(const FileCollector&) = delete;
-    FileCollector& operator=(const FileCollector&) = delete;
-    FileCollector(FileCollector&& other) noexcept : file(other.file)
+    FileCollector(std::string filename, const FileWriterOptions& options,
+                  const CheckpointOptions& checkpoint, const std::string& path,
+                  std::optional<FileCheckpoint> resume_from)
+        : checkpoint_interval(checkpoint.interval)
     {
-        other.file = nullptr;
+        FileWriterOptions writer_options = options;
+        size_t stored_blocks = 0;
+        if(resume_from) {
+            stored_blocks = resume_from->blocks();
+            resume_from->keep_first(checkpoint.resume_limit);
+            index = std::move(resume_from->index);
+            current_offset = index.empty() ? 0 : index.back().offset + index.back().size;
+            resumed = checkpointed = index.size();
+            writer_options.resume_offset = current_offset;
+        }
+        // The checkpoint is cut down to the kept blocks before the file is.
+        if(checkpoint_interval > 0 || checkpoint.resume) {
+            checkpoint_log = std::make_unique<CheckpointLog>(path, index, stored_blocks);
+        }
+        writer = std::make_unique<StagedFileWriter>(filename, writer_options);
+    }
+
+public:
+    FileCollector(std::string filename, const FileWriterOptions& options = {}, const CheckpointOptions& checkpoint = {})
+        : FileCollector(filename, options, checkpoint, checkpoint_path(filename, checkpoint),
+                        load_checkpoint(checkpoint, checkpoint_path(filename, checkpoint)))
+    {}
+
+    static std::string checkpoint_path(const std::string& filename, const CheckpointOptions& checkpoint = {})
+    {
+        return checkpoint.path.empty() ? filename + ".checkpoint" : checkpoint.path;
     }
+
+    FileCollector(const FileCollector&) = delete;
+    FileCollector& operator=(const FileCollector&) = delete;
+    FileCollector(FileCollector&&) noexcept = default;
     FileCollector& operator=(FileCollector&&) = delete;
 
     void reduce(const SimpleBuffer<char>& input) override
     {
-        std::fwrite(input.data(), 1, input.size(), file);
+        const SimpleBuffer<char>* block = &input;
+        write_blocks(std::span<const SimpleBuffer<char>* const>(&block, 1));
     }
 
-    ~FileCollector()
+    void reduce_batch(std::span<const SimpleBuffer<char>> inputs) override
     {
-        if(file) {
-            std::fclose(file);
+        pending.clear();
+        for(const auto& input : inputs) {
+            pending.push_back(&input);
         }
+        write_blocks(pending);
     }
+
+    // Appends the blocks in order, recording their locations.
+    void write_blocks(std::span<const SimpleBuffer<char>* const> blocks)
+    {
+        for(const SimpleBuffer<char>* block : blocks) {
+            writer->append(block->data(), block->size());
+            index.push_back({current_offset, block->size()});
+            current_offset += block->size();
+        }
+        if(checkpoint_interval > 0 && index.size() - checkpointed >= checkpoint_interval) {
+            checkpoint();
+        }
+    }
+
+    // Syncs everything written so far and records it as the checkpoint to
+    // resume from. Without checkpointing enabled this only syncs.
+    void checkpoint()
+    {
+        writer->sync();
+        if(checkpoint_log) {
+            checkpoint_log->commit(index);
+        }
+        checkpointed = index.size();
+    }
+
+    // Flushes the staged data and waits for it to be written.
+    void finish() override
+    {
+        writer->finish();
+        if(checkpoint_log) {
+            checkpoint();
+        }
+    }
+
+    void remove_checkpoint()
+    {
+        if(checkpoint_log) {
+            checkpoint_log->remove();
+        }
+    }
+
+    // Blocks kept from the checkpoint the collector resumed from.
+    inline size_t resumed_blocks() const { return resumed; }
+
+    // Safe to call from any thread while the collector is in use.
+    inline FileWriterStats stats() const { return writer->stats(); }
+
+    // Only safe to read once the producing Dispatcher has been closed.
+    inline const std::vector<BlockLocation>& block_index() const { return index; }
+    inline uint64_t bytes_written() const { return current_offset; }
 };
 
 
-#endif // TDF_WRITER_FILE_COLLECTOR_HPP
\ No newline at end of file
+#endif // TDF_WRITER_FILE_COLLECTOR_HPP
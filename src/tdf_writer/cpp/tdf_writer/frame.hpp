@@ -0,0 +1,77 @@
+#ifndef TDF_WRITER_FRAME_HPP
+#define TDF_WRITER_FRAME_HPP
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+
+// Per-frame row of the Frames table in analysis.tdf.
+//
+// time, polarity, scan_mode and msms_type describe the acquisition and are
+// supplied by the caller. The remaining fields are derived while writing:
+// the peak statistics by TdfFrameMapper, tims_id (the block offset in
+// analysis.tdf_bin) by TdfCollector.
+struct FrameMetadata
+{
+    double time = 0.0;
+    char polarity = '+';
+    int scan_mode = 0;
+    int msms_type = 0;
+    uint32_t num_scans = 0;
+    uint32_t num_peaks = 0;
+    uint64_t max_intensity = 0;
+    uint64_t summed_intensities = 0;
+    uint64_t tims_id = 0;
+};
+
+
+// A single timsTOF frame in CSR layout.
+//
+// scan_offsets has num_scans + 1 entries; the peaks of scan i are
+// tof_indices[scan_offsets[i] .. scan_offsets[i+1]) and the matching
+// range of intensities. TOF indices are expected to be non-decreasing
+// within each scan.
+struct Frame
+{
+    std::vector<uint32_t> scan_offsets;
+    std::vector<uint32_t> tof_indices;
+    std::vector<uint32_t> intensities;
+    FrameMetadata metadata;
+
+    inline size_t num_scans() const { return scan_offsets.empty() ? 0 : scan_offsets.size() - 1; }
+    inline size_t num_peaks() const { return tof_indices.size(); }
+    // Bytes held, for MemoryBudget.
+    inline size_t memory_footprint() const
+    {
+        return sizeof(*this) + (scan_offsets.capacity() + tof_indices.capacity() + intensities.capacity()) * sizeof(uint32_t);
+    }
+};
+
+
+// Non-owning counterpart of Frame, with the same layout requirements.
+//
+// keep_alive owns whatever storage the spans point into (e.g. the numpy
+// arrays passed from Python) and is released only when the last copy of
+// the view is destroyed, i.e. after the mapper has consumed the frame.
+// Copying a FrameView never copies peak data.
+struct FrameView
+{
+    std::span<const uint32_t> scan_offsets;
+    std::span<const uint32_t> tof_indices;
+    std::span<const uint32_t> intensities;
+    FrameMetadata metadata;
+    std::shared_ptr<const void> keep_alive;
+
+    inline size_t num_scans() const { return scan_offsets.empty() ? 0 : scan_offsets.size() - 1; }
+    inline size_t num_peaks() const { return tof_indices.size(); }
+    // The viewed data counts as held, since keep_alive keeps it from
+    // being freed until the view is consumed.
+    inline size_t memory_footprint() const
+    {
+        return sizeof(*this) + (scan_offsets.size() + tof_indices.size() + intensities.size()) * sizeof(uint32_t);
+    }
+};
+
+#endif // TDF_WRITER_FRAME_HPP
@@ -0,0 +1,186 @@
+#ifndef TDF_WRITER_MEMORY_BUDGET_HPP
+#define TDF_WRITER_MEMORY_BUDGET_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+// Bytes an item accounts for in a MemoryBudget: its memory_footprint()
+// if it has one (counting the heap storage it owns or keeps alive), the
+// sum over both members for pairs such as the (index, item) jobs of the
+// pipeline queues, and sizeof for everything else. The footprint must
+// not change while the item is held by a budgeted stage.
+template <typename T>
+size_t memory_footprint(const T& item)
+{
+    if constexpr (requires { { item.memory_footprint() } -> std::convertible_to<size_t>; }) {
+        return item.memory_footprint();
+    } else if constexpr (requires { item.first; item.second; }) {
+        return memory_footprint(item.first) + memory_footprint(item.second);
+    } else {
+        return sizeof(T);
+    }
+}
+
+
+// Byte budget shared by the buffering stages of a pipeline, or of several
+// pipelines, so that what they hold together stays within a fixed limit
+// however large the individual frames are: the inputs waiting to be
+// mapped (Dispatcher, PooledStream), the results waiting in the reorder
+// queue (SyncBoundedContainer::set_memory_budget) and the staging blocks
+// of the output file (FileWriterOptions::memory_budget).
+//
+// Each stage charges an item before taking it and releases it once the
+// item is gone, blocking while the budget is exhausted. Two kinds of item
+// are charged even then, since refusing them could stall the pipeline for
+// good: the next index the reorder queue waits for, and an item for a
+// stage that holds nothing (so that a single item larger than the whole
+// budget still gets through). The total may therefore exceed the limit by
+// at most one item per stage. Working memory of the threads themselves
+// (a frame being compressed, compression contexts) is not counted.
+//
+// Stages blocked on their own locks register a wake-up with subscribe();
+// releases call it while anyone is waiting. Those wake-ups lock the
+// stage, so release() must not be called with a stage's lock held.
+class MemoryBudget
+{
+    const size_t max_bytes;
+    std::atomic<size_t> used = 0;
+    std::atomic<size_t> peak = 0;
+    std::atomic<size_t> waiters = 0;
+
+    std::mutex mtx;
+    std::condition_variable released;
+    // Guarded by mtx.
+    std::vector<std::pair<const void*, std::function<void()>>> listeners;
+
+    void record_peak(size_t total)
+    {
+        size_t current = peak.load(std::memory_order_relaxed);
+        while(total > current && !peak.compare_exchange_weak(current, total, std::memory_order_relaxed)) {}
+    }
+
+public:
+    explicit MemoryBudget(size_t limit_bytes) : max_bytes(limit_bytes)
+    {
+        if(max_bytes == 0) {
+            throw std::invalid_argument("Memory budget must be greater than zero");
+        }
+    }
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    // Counts a blocked caller for as long as it lives, so that releases
+    // know to wake it. Create it before the last check of the budget.
+    class Waiter
+    {
+        MemoryBudget* budget;
+
+    public:
+        explicit Waiter(MemoryBudget* budget_) : budget(budget_)
+        {
+            if(budget) budget->waiters.fetch_add(1, std::memory_order_seq_cst);
+        }
+        Waiter(const Waiter&) = delete;
+        Waiter& operator=(const Waiter&) = delete;
+        ~Waiter()
+        {
+            if(budget) budget->waiters.fetch_sub(1, std::memory_order_seq_cst);
+        }
+    };
+
+    // Charges bytes if they fit; never blocks.
+    bool try_acquire(size_t bytes)
+    {
+        size_t current = used.load(std::memory_order_seq_cst);
+        do {
+            if(bytes > max_bytes - std::min(current, max_bytes)) {
+                return false;
+            }
+        } while(!used.compare_exchange_weak(current, current + bytes, std::memory_order_seq_cst));
+        record_peak(current + bytes);
+        return true;
+    }
+
+    // Charges bytes whether they fit or not, see above.
+    void force_acquire(size_t bytes)
+    {
+        record_peak(used.fetch_add(bytes, std::memory_order_seq_cst) + bytes);
+    }
+
+    // Blocks until bytes fit, or until force() holds, and charges them;
+    // returns false without charging anything if give_up() holds first.
+    // Both are checked with the budget's lock held, after every release
+    // and notify().
+    template <typename Force, typename GiveUp>
+    bool acquire(size_t bytes, Force force, GiveUp give_up)
+    {
+        auto charged = [&]() {
+            if(force()) {
+                force_acquire(bytes);
+                return true;
+            }
+            return try_acquire(bytes);
+        };
+        if(charged()) {
+            return true;
+        }
+        Waiter waiter(this);
+        std::unique_lock<std::mutex> lock(mtx);
+        bool acquired = false;
+        released.wait(lock, [&]() { return give_up() || (acquired = charged()); });
+        return acquired;
+    }
+
+    void release(size_t bytes)
+    {
+        if(bytes == 0) {
+            return;
+        }
+        used.fetch_sub(bytes, std::memory_order_seq_cst);
+        if(waiters.load(std::memory_order_seq_cst) > 0) {
+            notify();
+        }
+    }
+
+    // Wakes every waiter, e.g. for it to notice that its pipeline stopped.
+    void notify()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        released.notify_all();
+        for(auto& listener : listeners) {
+            listener.second();
+        }
+    }
+
+    // Registers wake, called on releases while someone waits, under key
+    // (the stage's address). unsubscribe() before the stage goes away.
+    void subscribe(const void* key, std::function<void()> wake)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        listeners.emplace_back(key, std::move(wake));
+    }
+
+    void unsubscribe(const void* key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        listeners.erase(std::remove_if(listeners.begin(), listeners.end(),
+                                       [key](const auto& listener) { return listener.first == key; }),
+                        listeners.end());
+    }
+
+    inline size_t limit() const { return max_bytes; }
+    inline size_t used_bytes() const { return used.load(std::memory_order_relaxed); }
+    inline size_t peak_bytes() const { return peak.load(std::memory_order_relaxed); }
+};
+
+#endif // TDF_WRITER_MEMORY_BUDGET_HPP
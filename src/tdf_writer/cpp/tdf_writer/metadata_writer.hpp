@@ -0,0 +1,194 @@
+#ifndef TDF_WRITER_METADATA_WRITER_HPP
+#define TDF_WRITER_METADATA_WRITER_HPP
+
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+
+#include <sqlite3.h>
+
+#include "dispatcher.hpp"
+#include "frame.hpp"
+
+
+// Reducer writing FrameMetadata rows into the Frames table of analysis.tdf.
+//
+// Rows are expected in job order and get consecutive Ids starting at 1.
+// Inserts go through one prepared statement and are grouped into
+// transactions of batch_size rows; indices are only built in finish(),
+// after the last row, so SQLite does not maintain them during the bulk load.
+//
+// If the database has no Frames table yet, one is created with just the
+// columns filled here. An existing (e.g. template) schema is used as is.
+//
+// With resume, rows already in the table are kept and numbering continues
+// after the highest Id; discard_rows_after() trims them back to match a
+// resumed binary file.
+class SqliteFrameWriter : public Reducer<FrameMetadata>
+{
+    sqlite3* db = nullptr;
+    sqlite3_stmt* insert_stmt = nullptr;
+    size_t batch_size;
+    size_t rows_in_transaction = 0;
+    int64_t next_frame_id = 1;
+    bool finished = false;
+
+    void exec(const char* sql)
+    {
+        char* errmsg = nullptr;
+        if(sqlite3_exec(db, sql, nullptr, nullptr, &errmsg) != SQLITE_OK) {
+            std::string message = errmsg ? errmsg : sqlite3_errmsg(db);
+            sqlite3_free(errmsg);
+            throw std::runtime_error("SQLite error: " + message);
+        }
+    }
+
+    void check(int rc, int expected = SQLITE_OK)
+    {
+        if(rc != expected) {
+            throw std::runtime_error(std::string("SQLite error: ") + sqlite3_errmsg(db));
+        }
+    }
+
+    int64_t max_frame_id()
+    {
+        sqlite3_stmt* stmt = nullptr;
+        check(sqlite3_prepare_v2(db, "SELECT COALESCE(MAX(Id), 0) FROM Frames", -1, &stmt, nullptr));
+        const int rc = sqlite3_step(stmt);
+        const int64_t id = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+        sqlite3_finalize(stmt);
+        check(rc, SQLITE_ROW);
+        return id;
+    }
+
+    void release()
+    {
+        if(insert_stmt) {
+            sqlite3_finalize(insert_stmt);
+            insert_stmt = nullptr;
+        }
+        if(db) {
+            sqlite3_close(db);
+            db = nullptr;
+        }
+    }
+
+public:
+    static constexpr const char* create_table_sql =
+        "CREATE TABLE IF NOT EXISTS Frames ("
+        "Id INTEGER PRIMARY KEY, "
+        "Time REAL NOT NULL, "
+        "Polarity CHAR(1) CHECK (Polarity IN ('+', '-')) NOT NULL, "
+        "ScanMode INTEGER NOT NULL, "
+        "MsMsType INTEGER NOT NULL, "
+        "TimsId INTEGER, "
+        "MaxIntensity INTEGER NOT NULL, "
+        "SummedIntensities INTEGER NOT NULL, "
+        "NumScans INTEGER NOT NULL, "
+        "NumPeaks INTEGER NOT NULL)";
+
+    static constexpr const char* insert_sql =
+        "INSERT INTO Frames "
+        "(Id, Time, Polarity, ScanMode, MsMsType, TimsId, MaxIntensity, SummedIntensities, NumScans, NumPeaks) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+
+    static constexpr const char* create_indices_sql =
+        "CREATE INDEX IF NOT EXISTS FramesMsMsTypeIndex ON Frames (MsMsType)";
+
+    explicit SqliteFrameWriter(const std::string& filename, size_t batch_size_ = 10000, bool resume = false)
+        : batch_size(batch_size_)
+    {
+        if(batch_size == 0) {
+            throw std::invalid_argument("Batch size must be greater than zero");
+        }
+        if(sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+            std::string message = db ? sqlite3_errmsg(db) : "out of memory";
+            release();
+            throw std::runtime_error("Failed to open database " + filename + ": " + message);
+        }
+        try {
+            exec(create_table_sql);
+            check(sqlite3_prepare_v2(db, insert_sql, -1, &insert_stmt, nullptr));
+            if(resume) {
+                next_frame_id = max_frame_id() + 1;
+            }
+            exec("BEGIN");
+        } catch(...) {
+            release();
+            throw;
+        }
+    }
+
+    SqliteFrameWriter(const SqliteFrameWriter&) = delete;
+    SqliteFrameWriter& operator=(const SqliteFrameWriter&) = delete;
+    SqliteFrameWriter(SqliteFrameWriter&&) = delete;
+    SqliteFrameWriter& operator=(SqliteFrameWriter&&) = delete;
+
+    void reduce(const FrameMetadata& metadata) override
+    {
+        const char polarity[1] = { metadata.polarity };
+        check(sqlite3_bind_int64(insert_stmt, 1, next_frame_id));
+        check(sqlite3_bind_double(insert_stmt, 2, metadata.time));
+        check(sqlite3_bind_text(insert_stmt, 3, polarity, 1, SQLITE_TRANSIENT));
+        check(sqlite3_bind_int(insert_stmt, 4, metadata.scan_mode));
+        check(sqlite3_bind_int(insert_stmt, 5, metadata.msms_type));
+        check(sqlite3_bind_int64(insert_stmt, 6, static_cast<sqlite3_int64>(metadata.tims_id)));
+        check(sqlite3_bind_int64(insert_stmt, 7, static_cast<sqlite3_int64>(metadata.max_intensity)));
+        check(sqlite3_bind_int64(insert_stmt, 8, static_cast<sqlite3_int64>(metadata.summed_intensities)));
+        check(sqlite3_bind_int64(insert_stmt, 9, metadata.num_scans));
+        check(sqlite3_bind_int64(insert_stmt, 10, metadata.num_peaks));
+        check(sqlite3_step(insert_stmt), SQLITE_DONE);
+        check(sqlite3_reset(insert_stmt));
+        ++next_frame_id;
+
+        if(++rows_in_transaction >= batch_size) {
+            exec("COMMIT");
+            exec("BEGIN");
+            rows_in_transaction = 0;
+        }
+    }
+
+    // Commits the last batch and builds the indices.
+    void finish() override
+    {
+        if(finished) return;
+        finished = true;
+        exec("COMMIT");
+        exec(create_indices_sql);
+    }
+
+    // Deletes the rows with Id > rows (committing at once) and continues
+    // numbering after them.
+    void discard_rows_after(size_t rows)
+    {
+        exec("COMMIT");
+        sqlite3_stmt* stmt = nullptr;
+        check(sqlite3_prepare_v2(db, "DELETE FROM Frames WHERE Id > ?", -1, &stmt, nullptr));
+        int rc = sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(rows));
+        if(rc == SQLITE_OK) {
+            rc = sqlite3_step(stmt);
+        }
+        sqlite3_finalize(stmt);
+        check(rc, SQLITE_DONE);
+        rows_in_transaction = 0;
+        next_frame_id = static_cast<int64_t>(rows) + 1;
+        exec("BEGIN");
+    }
+
+    inline size_t rows_written() const { return static_cast<size_t>(next_frame_id - 1); }
+
+    ~SqliteFrameWriter()
+    {
+        if(db && !finished) {
+            try {
+                finish();
+            } catch(...) {
+                // Nothing sensible to do in a destructor; the open
+                // transaction is rolled back when the connection closes.
+            }
+        }
+        release();
+    }
+};
+
+#endif // TDF_WRITER_METADATA_WRITER_HPP
@@ -0,0 +1,333 @@
+#ifndef TDF_WRITER_MPMC_RING_HPP
+#define TDF_WRITER_MPMC_RING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// MPMCRingBuffer: bounded lock-free multi-producer multi-consumer FIFO
+// (Dmitry Vyukov's sequence-numbered ring), with the same push/pop/close
+// interface as SynchronizedBuffer, so it can be used as Dispatcher's input
+// buffer.
+//
+// push and pop only touch the ring's atomics while the ring is neither full
+// nor empty. Threads that find it full or empty register as waiters and
+// sleep on an epoch counter with std::atomic::wait (a futex on Linux); the
+// opposite side only issues a wake-up when someone is registered.
+//
+// emplace constructs the item directly in the cell it claimed. Since a
+// claimed cell cannot be given back, one whose construction throws is
+// published empty and skipped by consumers.
+//
+// The capacity is rounded up to a power of two (at least 2).
+template <typename T>
+class MPMCRingBuffer
+{
+    static constexpr size_t cache_line = 64;
+    static constexpr uint64_t closed_flag = uint64_t(1) << 63;
+
+    struct alignas(cache_line) Cell
+    {
+        std::atomic<size_t> sequence;
+        // False if the item's constructor threw (see emplace).
+        bool filled;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+
+    alignas(cache_line) std::atomic<size_t> enqueue_pos = 0;
+    alignas(cache_line) std::atomic<size_t> dequeue_pos = 0;
+
+    // Number of pushes in progress, with closed_flag set once closed. A push
+    // registers before checking for closure, so after close() consumers can
+    // wait for in-flight pushes to land instead of missing them.
+    alignas(cache_line) std::atomic<uint64_t> push_state = 0;
+
+    alignas(cache_line) std::atomic<uint32_t> items_epoch = 0;
+    std::atomic<uint32_t> pop_waiters = 0;
+    alignas(cache_line) std::atomic<uint32_t> space_epoch = 0;
+    std::atomic<uint32_t> push_waiters = 0;
+
+    static size_t round_up_capacity(size_t capacity)
+    {
+        size_t result = 2;
+        while(result < capacity) {
+            if(result > std::numeric_limits<size_t>::max() / 2) {
+                throw std::invalid_argument("Ring buffer capacity too large");
+            }
+            result *= 2;
+        }
+        return result;
+    }
+
+    // Uses args only once a cell is claimed.
+    template <typename... Args>
+    bool try_emplace_impl(Args&&... args)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while(true) {
+            cell = &cells[pos & mask];
+            const size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if(diff == 0) {
+                if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if(diff < 0) {
+                return false; // Full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        try {
+            std::construct_at(reinterpret_cast<T*>(cell->storage), std::forward<Args>(args)...);
+            cell->filled = true;
+        } catch(...) {
+            cell->filled = false;
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            throw;
+        }
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::optional<T> try_pop_impl()
+    {
+        while(true) {
+            size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            Cell* cell;
+            while(true) {
+                cell = &cells[pos & mask];
+                const size_t seq = cell->sequence.load(std::memory_order_acquire);
+                const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                if(diff == 0) {
+                    if(dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                } else if(diff < 0) {
+                    return std::nullopt; // Empty
+                } else {
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            if(!cell->filled) {
+                cell->sequence.store(pos + mask + 1, std::memory_order_release);
+                wake(space_epoch, push_waiters);
+                continue;
+            }
+            T* stored = std::launder(reinterpret_cast<T*>(cell->storage));
+            std::optional<T> item(std::move(*stored));
+            stored->~T();
+            cell->sequence.store(pos + mask + 1, std::memory_order_release);
+            return item;
+        }
+    }
+
+    // Pairs with the fence in wait_on: either the waiter's retry sees our
+    // change to the ring, or we see the waiter and bump its epoch.
+    static void wake(std::atomic<uint32_t>& epoch, std::atomic<uint32_t>& waiters)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiters.load(std::memory_order_relaxed) != 0) {
+            epoch.fetch_add(1, std::memory_order_seq_cst);
+            epoch.notify_all();
+        }
+    }
+
+    // Registers as a waiter, retries attempt() once and sleeps on epoch if
+    // it still fails and the ring is open. Returns attempt()'s result.
+    template <typename Attempt>
+    auto wait_on(std::atomic<uint32_t>& epoch, std::atomic<uint32_t>& waiters, Attempt&& attempt)
+    {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const uint32_t seen = epoch.load(std::memory_order_seq_cst);
+        auto result = attempt();
+        if(!result && !is_closed()) {
+            epoch.wait(seen, std::memory_order_seq_cst);
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    template <typename... Args>
+    void emplace_registered(Args&&... args)
+    {
+        while(true) {
+            if(is_closed()) {
+                throw std::runtime_error("Push to a closed container");
+            }
+            if(try_emplace_impl(std::forward<Args>(args)...)) {
+                wake(items_epoch, pop_waiters);
+                return;
+            }
+            if(wait_on(space_epoch, push_waiters, [&]() { return try_emplace_impl(std::forward<Args>(args)...); })) {
+                wake(items_epoch, pop_waiters);
+                return;
+            }
+        }
+    }
+
+public:
+    explicit MPMCRingBuffer(size_t capacity)
+        : cells(new Cell[round_up_capacity(capacity)]),
+          mask(round_up_capacity(capacity) - 1)
+    {
+        for(size_t i = 0; i <= mask; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~MPMCRingBuffer()
+    {
+        while(try_pop_impl().has_value()) {}
+    }
+
+    MPMCRingBuffer(const MPMCRingBuffer&) = delete;
+    MPMCRingBuffer& operator=(const MPMCRingBuffer&) = delete;
+    MPMCRingBuffer(MPMCRingBuffer&&) = delete;
+    MPMCRingBuffer& operator=(MPMCRingBuffer&&) = delete;
+
+    // Blocks while the ring is full; throws if the ring is or gets closed.
+    void push(T&& item)
+    {
+        emplace(std::move(item));
+    }
+
+    // As push, constructing the item from args in its cell once one is
+    // free; args are left untouched if this throws before that.
+    template <typename... Args>
+    void emplace(Args&&... args)
+    {
+        if(push_state.fetch_add(1, std::memory_order_seq_cst) & closed_flag) {
+            push_state.fetch_sub(1, std::memory_order_seq_cst);
+            throw std::runtime_error("Push to a closed container");
+        }
+        try {
+            emplace_registered(std::forward<Args>(args)...);
+        } catch(...) {
+            push_state.fetch_sub(1, std::memory_order_seq_cst);
+            throw;
+        }
+        push_state.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    // Never blocks: returns false, leaving item untouched, if the ring is
+    // full; throws if it is closed.
+    bool try_push(T&& item)
+    {
+        if(push_state.fetch_add(1, std::memory_order_seq_cst) & closed_flag) {
+            push_state.fetch_sub(1, std::memory_order_seq_cst);
+            throw std::runtime_error("Push to a closed container");
+        }
+        bool pushed = false;
+        try {
+            pushed = try_emplace_impl(std::move(item));
+        } catch(...) {
+            push_state.fetch_sub(1, std::memory_order_seq_cst);
+            throw;
+        }
+        push_state.fetch_sub(1, std::memory_order_seq_cst);
+        if(pushed) {
+            wake(items_epoch, pop_waiters);
+        }
+        return pushed;
+    }
+
+    // Blocks while the ring is empty; returns std::nullopt once the ring is
+    // closed and every item pushed before closing has been taken.
+    std::optional<T> pop()
+    {
+        while(true) {
+            if(auto item = try_pop_impl()) {
+                wake(space_epoch, push_waiters);
+                return item;
+            }
+            if(is_closed()) {
+                return drain_closed();
+            }
+            if(auto item = wait_on(items_epoch, pop_waiters, [this]() { return try_pop_impl(); })) {
+                wake(space_epoch, push_waiters);
+                return item;
+            }
+        }
+    }
+
+    // Blocks for the first item, then takes whatever else is available,
+    // up to max_n items in total. Empty once closed and drained.
+    std::vector<T> pop_batch(size_t max_n)
+    {
+        if(max_n == 0) {
+            throw std::invalid_argument("Batch size must be greater than zero");
+        }
+        std::vector<T> items;
+        auto first = pop();
+        if(!first.has_value()) return items;
+        items.push_back(std::move(first.value()));
+        while(items.size() < max_n) {
+            auto item = try_pop_impl();
+            if(!item.has_value()) break;
+            items.push_back(std::move(item.value()));
+        }
+        if(items.size() > 1) {
+            wake(space_epoch, push_waiters);
+        }
+        return items;
+    }
+
+    void close()
+    {
+        push_state.fetch_or(closed_flag, std::memory_order_seq_cst);
+        items_epoch.fetch_add(1, std::memory_order_seq_cst);
+        items_epoch.notify_all();
+        space_epoch.fetch_add(1, std::memory_order_seq_cst);
+        space_epoch.notify_all();
+    }
+
+    bool is_closed() const
+    {
+        return push_state.load(std::memory_order_seq_cst) & closed_flag;
+    }
+
+    inline size_t capacity() const { return mask + 1; }
+
+    // Approximate number of stored items, for monitoring (see
+    // SyncBoundedContainer::size()).
+    size_t size() const
+    {
+        const size_t dequeued = dequeue_pos.load(std::memory_order_relaxed);
+        const size_t enqueued = enqueue_pos.load(std::memory_order_relaxed);
+        return std::min(enqueued - std::min(enqueued, dequeued), capacity());
+    }
+
+private:
+    // After close(): wait for in-flight pushes to publish, then hand out
+    // what is left. Pushes that lost the race with close() throw instead.
+    std::optional<T> drain_closed()
+    {
+        while(true) {
+            if(auto item = try_pop_impl()) {
+                wake(space_epoch, push_waiters);
+                return item;
+            }
+            if((push_state.load(std::memory_order_seq_cst) & ~closed_flag) == 0) {
+                if(auto item = try_pop_impl()) {
+                    return item;
+                }
+                return std::nullopt;
+            }
+            std::this_thread::yield();
+        }
+    }
+};
+
+#endif // TDF_WRITER_MPMC_RING_HPP
@@ -0,0 +1,380 @@
+#ifndef TDF_WRITER_OFFSET_WRITER_HPP
+#define TDF_WRITER_OFFSET_WRITER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dispatcher.hpp"
+#include "file_collector.hpp"
+#include "metadata_writer.hpp"
+#include "simple_buffer.hpp"
+#include "stats.hpp"
+#include "staged_file_writer.hpp"
+#include "tdf_compressor.hpp"
+
+
+// Offset-ordered output: instead of funnelling every block through the
+// reducer thread, each mapper thread writes its own block with pwrite as
+// soon as it is compressed. A block's offset is the sum of the sizes of
+// the blocks before it, so the only step that has to follow job order is
+// handing out offsets, done by OffsetSequencer. What goes through the
+// reorder queue to the reducer is just each block's location (and, for
+// TDF, its metadata row); the compressed data is never copied.
+//
+// Usage with a Dispatcher:
+//
+//     auto file = std::make_shared<ParallelFileWriter>("analysis.tdf_bin");
+//     Dispatcher<OffsetWritingMapper<TdfFrameMapper>, OffsetTdfCollector> dispatcher(
+//         [&]() { return std::make_unique<OffsetWritingMapper<TdfFrameMapper>>(
+//                     std::make_unique<TdfFrameMapper>(), file); },
+//         std::make_unique<OffsetTdfCollector>(file, "analysis.tdf"),
+//         DispatcherOptions{});
+//
+// Waiting for an offset does not break the reorder queue's progress
+// guarantee: a job only waits for lower indices, and the lowest index not
+// yet placed is always held by a mapper that is not waiting.
+
+
+// Hands out the offsets of consecutive blocks in job order.
+class OffsetSequencer
+{
+    // next_index is set to cancelled for good by cancel().
+    static constexpr size_t cancelled = SIZE_MAX;
+    std::atomic<size_t> next_index = 0;
+    // Only touched by the caller whose turn it is.
+    uint64_t end = 0;
+
+public:
+    // Blocks until blocks 0 .. index - 1 have been assigned, then returns
+    // the offset of block index and advances past its size. Every index
+    // must be assigned exactly once. Throws once cancel() was called.
+    uint64_t assign(size_t index, uint64_t size)
+    {
+        size_t current = next_index.load(std::memory_order_acquire);
+        while(current != index) {
+            if(current == cancelled) {
+                throw std::runtime_error("Offset assignment cancelled");
+            }
+            if(current > index) {
+                throw std::logic_error("Offset already assigned for block " + std::to_string(index));
+            }
+            next_index.wait(current, std::memory_order_acquire);
+            current = next_index.load(std::memory_order_acquire);
+        }
+        const uint64_t offset = end;
+        end += size;
+        if(!next_index.compare_exchange_strong(current, index + 1, std::memory_order_release, std::memory_order_relaxed)) {
+            throw std::runtime_error("Offset assignment cancelled");
+        }
+        next_index.notify_all();
+        return offset;
+    }
+
+    // Wakes every assign() waiting for its turn, which then throws, as
+    // does every later call. A job that failed before getting its offset
+    // would otherwise keep all later ones waiting forever.
+    void cancel()
+    {
+        next_index.store(cancelled, std::memory_order_release);
+        next_index.notify_all();
+    }
+
+    // Blocks assigned so far; SIZE_MAX once cancelled.
+    inline size_t assigned() const { return next_index.load(std::memory_order_acquire); }
+
+    // Total size of the assigned blocks; only meaningful once no assign()
+    // is running.
+    inline uint64_t total_size() const { return end; }
+};
+
+
+// Output file written concurrently by the mapper threads, each block at
+// the offset the sequencer assigns for its job index.
+//
+// Of FileWriterOptions only the preallocation and timing settings apply: blocks land
+// at arbitrary offsets, so O_DIRECT (which needs aligned ones) and
+// writeback pacing (which assumes a growing written prefix) are rejected.
+class ParallelFileWriter
+{
+    int fd = -1;
+    OffsetSequencer sequencer;
+    std::atomic<uint64_t> preallocation_chunk;
+    std::mutex allocation_mtx;
+    std::atomic<uint64_t> allocated_end = 0;
+    bool collect_timings;
+    bool finished = false;
+
+    std::atomic<uint64_t> bytes_written = 0;
+    Histogram write_ns;
+    Histogram offset_wait_ns;
+
+    // Like StagedFileWriter, preallocation is only a hint.
+    void preallocate_for(uint64_t block_end)
+    {
+        if(preallocation_chunk.load(std::memory_order_relaxed) == 0
+           || block_end <= allocated_end.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(allocation_mtx);
+        const uint64_t start = allocated_end.load(std::memory_order_relaxed);
+        const uint64_t chunk = preallocation_chunk.load(std::memory_order_relaxed);
+        if(chunk == 0 || block_end <= start) {
+            return;
+        }
+        const uint64_t end = block_end + chunk;
+        if(::fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(start), static_cast<off_t>(end - start)) != 0) {
+            preallocation_chunk.store(0, std::memory_order_relaxed);
+            return;
+        }
+        allocated_end.store(end, std::memory_order_release);
+    }
+
+public:
+    explicit ParallelFileWriter(const std::string& filename, const FileWriterOptions& options = {})
+        : preallocation_chunk(options.preallocation_chunk),
+          collect_timings(options.collect_timings)
+    {
+        if(options.direct_io) {
+            throw std::invalid_argument("O_DIRECT is not supported for offset-ordered output");
+        }
+        if(options.writeback_interval > 0) {
+            throw std::invalid_argument("Writeback pacing is not supported for offset-ordered output");
+        }
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) {
+            throw std::runtime_error("Failed to open file: " + filename);
+        }
+        if(preallocation_chunk > 0 && options.expected_size > 0) {
+            if(::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(options.expected_size)) == 0) {
+                allocated_end = options.expected_size;
+            } else {
+                preallocation_chunk = 0;
+            }
+        }
+    }
+
+    ParallelFileWriter(const ParallelFileWriter&) = delete;
+    ParallelFileWriter& operator=(const ParallelFileWriter&) = delete;
+
+    // Writes block index right after blocks 0 .. index - 1, waiting for
+    // their offsets first, and returns its offset. Thread-safe.
+    uint64_t write(size_t index, const char* data, size_t size)
+    {
+        Timing waiting(offset_wait_ns, collect_timings);
+        const uint64_t offset = sequencer.assign(index, size);
+        waiting.record();
+        preallocate_for(offset + size);
+        Timing writing(write_ns, collect_timings);
+        pwrite_all(fd, data, size, offset);
+        writing.record();
+        bytes_written.fetch_add(size, std::memory_order_relaxed);
+        return offset;
+    }
+
+    // Makes pending and later write() calls throw, see OffsetSequencer.
+    inline void cancel() { sequencer.cancel(); }
+
+    // Frees the unused preallocated space, which lies past the end of the
+    // file (the blocks are contiguous, so the file already ends at the
+    // last one). Call once every write() has returned; further calls do
+    // nothing.
+    void finish()
+    {
+        if(finished) {
+            return;
+        }
+        finished = true;
+        if(allocated_end.load(std::memory_order_acquire) > sequencer.total_size()) {
+            if(::ftruncate(fd, static_cast<off_t>(sequencer.total_size())) != 0) {
+                throw_errno("Failed to truncate output file");
+            }
+        }
+    }
+
+    // Safe to call from any thread while writing. write_ns is per block.
+    FileWriterStats stats() const
+    {
+        FileWriterStats result;
+        result.bytes_written = bytes_written.load(std::memory_order_relaxed);
+        result.bytes_staged = result.bytes_written;
+        result.write_ns = write_ns.snapshot();
+        result.offset_wait_ns = offset_wait_ns.snapshot();
+        return result;
+    }
+
+    ~ParallelFileWriter()
+    {
+        try {
+            finish();
+        } catch(...) {}
+        if(fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+
+// What an OffsetWritingMapper passes on for each kind of block: plain
+// blocks leave just their location, TDF blocks their Frames row as well.
+template <typename Block>
+struct OffsetPlacement;
+
+template <>
+struct OffsetPlacement<SimpleBuffer<char>>
+{
+    using Record = BlockLocation;
+
+    static const SimpleBuffer<char>& data(const SimpleBuffer<char>& block) { return block; }
+    static Record record(BlockLocation location, SimpleBuffer<char>&&) { return location; }
+};
+
+// Location and metadata row (with TimsId filled in) of a written TDF block.
+struct PlacedTdfBlock
+{
+    BlockLocation location;
+    FrameMetadata metadata;
+};
+
+template <>
+struct OffsetPlacement<TdfBlock>
+{
+    using Record = PlacedTdfBlock;
+
+    static const SimpleBuffer<char>& data(const TdfBlock& block) { return block.data; }
+    static Record record(BlockLocation location, TdfBlock&& block)
+    {
+        PlacedTdfBlock placed{location, block.metadata};
+        placed.metadata.tims_id = location.offset;
+        return placed;
+    }
+};
+
+
+// Mapper wrapper writing the inner mapper's block to the file itself and
+// passing on only its OffsetPlacement record. Needs the job index, which
+// Dispatcher and PooledStream supply through map_indexed().
+template <typename Inner_t>
+class OffsetWritingMapper
+    : public Mapper<typename Inner_t::InputType,
+                    typename OffsetPlacement<typename Inner_t::OutputType>::Record>
+{
+    using Placement = OffsetPlacement<typename Inner_t::OutputType>;
+
+    std::unique_ptr<Inner_t> inner;
+    std::shared_ptr<ParallelFileWriter> file;
+
+public:
+    using InputType = typename Inner_t::InputType;
+    using OutputType = typename Placement::Record;
+
+    OffsetWritingMapper(std::unique_ptr<Inner_t> inner_, std::shared_ptr<ParallelFileWriter> file_)
+        : inner(std::move(inner_)), file(std::move(file_))
+    {
+        if(!inner || !file) {
+            throw std::invalid_argument("Inner mapper and file cannot be null");
+        }
+    }
+
+    using Mapper<InputType, OutputType>::map;
+
+    OutputType map(const InputType&) override
+    {
+        throw std::logic_error("OffsetWritingMapper needs the job index, see map_indexed()");
+    }
+
+    OutputType map_indexed(size_t index, InputType input)
+    {
+        auto block = inner->map(std::move(input));
+        const SimpleBuffer<char>& data = Placement::data(block);
+        const uint64_t offset = file->write(index, data.data(), data.size());
+        return Placement::record(BlockLocation{offset, data.size()}, std::move(block));
+    }
+
+    // Called by the pipeline when it stops early, from another thread:
+    // interrupts every mapper of the file waiting for its offset.
+    inline void cancel() { file->cancel(); }
+};
+
+
+// Reducer counterpart of FileCollector for offset-ordered output: the
+// blocks are already written, so it only records their locations in job
+// order and finishes the file.
+class OffsetFileCollector : public Reducer<BlockLocation>
+{
+    std::shared_ptr<ParallelFileWriter> file;
+    std::vector<BlockLocation> index;
+    uint64_t end = 0;
+
+public:
+    explicit OffsetFileCollector(std::shared_ptr<ParallelFileWriter> file_)
+        : file(std::move(file_))
+    {
+        if(!file) {
+            throw std::invalid_argument("File cannot be null");
+        }
+    }
+
+    void reduce(const BlockLocation& location) override
+    {
+        index.push_back(location);
+        end = location.offset + location.size;
+    }
+
+    // Runs after every mapper thread has stopped, i.e. after the last write.
+    void finish() override
+    {
+        file->finish();
+    }
+
+    // Safe to call from any thread while the collector is in use.
+    inline FileWriterStats stats() const { return file->stats(); }
+
+    // Only safe to read once the producing Dispatcher has been closed.
+    inline const std::vector<BlockLocation>& block_index() const { return index; }
+    inline uint64_t bytes_written() const { return end; }
+};
+
+
+// Offset-ordered counterpart of TdfCollector. With the binary writes off
+// the reducer thread, the Frames rows are inserted on it directly.
+class OffsetTdfCollector : public Reducer<PlacedTdfBlock>
+{
+    OffsetFileCollector binary;
+    SqliteFrameWriter metadata;
+
+public:
+    OffsetTdfCollector(std::shared_ptr<ParallelFileWriter> file,
+                       const std::string& tdf_filename,
+                       size_t metadata_batch_size = 10000)
+        : binary(std::move(file)),
+          metadata(tdf_filename, metadata_batch_size)
+    {}
+
+    void reduce(const PlacedTdfBlock& block) override
+    {
+        binary.reduce(block.location);
+        metadata.reduce(block.metadata);
+    }
+
+    void finish() override
+    {
+        binary.finish();
+        metadata.finish();
+    }
+
+    // Only safe to use once the producing Dispatcher has been closed.
+    inline const OffsetFileCollector& binary_collector() const { return binary; }
+    inline const SqliteFrameWriter& metadata_writer() const { return metadata; }
+};
+
+#endif // TDF_WRITER_OFFSET_WRITER_HPP
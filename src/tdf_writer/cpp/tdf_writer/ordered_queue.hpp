@@ -1,45 +1,227 @@
 #ifndef TDF_WRITER_ORDERED_QUEUE_HPP
 #define TDF_WRITER_ORDERED_QUEUE_HPP
 
+#include <cassert>
+#include <limits>
+#include <optional>
 #include <queue>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include "sync_bouded_container.hpp"
 
-// A thread-safe priority queue that allows pushing items with an associated index
-// and popping them in order of their indices, guaranteeing that items are retrieved
-// in the order of their indices, without skipping any indices.
-// Pop blocks if the next expected index is not available yet.
 
 template <typename T>
-class OrderedQueue : public SyncBoundedContainer<std::pair<size_t, T>>
+class PriorityQueue
 {
-    struct Compare {
-        bool operator()(const std::pair<size_t, T>& a, const std::pair<size_t, T>& b) const {
-            return a.first > b.first; // Min-heap based on the index
+    struct ComparePair {
+        bool operator()(const std::pair<size_t, T>& a, const std::pair<size_t, T>& b) const
+        {
+            return a.first > b.first; // Min-heap based on the first element (priority)
         }
     };
+    std::priority_queue<std::pair<size_t, T>,
+                        std::vector<std::pair<size_t, T>>,
+                        ComparePair> pq;
+public:
+    PriorityQueue() = default;
+    ~PriorityQueue() = default;
+    void push(size_t priority, T&& item)
+    {
+        std::pair<size_t, T> p(priority, std::move(item));
+        pq.push(std::move(p));
+    }
+    std::pair<size_t, T> pop()
+    {
+        auto item = std::move(const_cast<std::pair<size_t, T>&>(pq.top()));
+        pq.pop();
+        return item;
+    }
+    const std::pair<size_t, T>& top() const
+    {
+        return pq.top();
+    }
+    bool empty() const
+    {
+        return pq.empty();
+    }
+    size_t size() const
+    {
+        return pq.size();
+    }
+};
 
-    std::priority_queue<std::pair<size_t, T>, std::vector<std::pair<size_t, T>>, Compare> pq;
-    size_t next_index = 0;
+
+// Storage policies for OrderedQueue. Each one holds the values that are
+// waiting for their turn, keyed by index, and provides:
+//
+//   void insert(size_t index, T&& value);
+//   T take(size_t index);                      // only if contains(index)
+//   bool contains(size_t index) const;
+//   bool can_accept(size_t index, size_t next_index) const;
+//   bool empty() const;
+//   size_t size() const;
+//   size_t capacity() const;
+//
+// can_accept must hold for index == next_index whatever the occupancy:
+// that item is what unblocks the consumer, so refusing it would deadlock
+// a queue whose room is taken by later indices.
+
+// Binary heap bounded by the number of waiting items. Indices may be
+// sparse; insertion and removal are O(log n).
+template <typename T>
+class HeapOrderStorage
+{
+    PriorityQueue<T> pq;
     size_t max_size;
-protected:
-    inline void insert_into_container(std::pair<size_t, T>&& item) override
+
+public:
+    explicit HeapOrderStorage(size_t max_size_ = std::numeric_limits<size_t>::max()) : max_size(max_size_) {}
+
+    inline void insert(size_t index, T&& value)
     {
-        pq.push(std::move(item));
+        pq.push(index, std::move(value));
     }
-    inline std::pair<size_t, T> remove_from_container() override
+    inline T take(size_t index)
     {
-        std::pair<size_t, T> item = std::move(pq.top());
-        pq.pop();
+        assert(pq.top().first == index);
+        return pq.pop().second;
+    }
+    inline bool contains(size_t index) const
+    {
+        return !pq.empty() && pq.top().first == index;
+    }
+    inline bool can_accept(size_t index, size_t next_index) const
+    {
+        return index == next_index || pq.size() < max_size;
+    }
+    inline bool empty() const { return pq.empty(); }
+    inline size_t size() const { return pq.size(); }
+    inline size_t capacity() const { return max_size; }
+};
+
+// Circular array of window_size slots, item i living in slot
+// i % window_size, for dense indices: insertion and in-order removal are
+// O(1) and never move other items. The bound is on distance rather than
+// count: an item is accepted only if its index is below
+// next_index + window_size.
+template <typename T>
+class WindowOrderStorage
+{
+    std::vector<std::optional<T>> slots;
+    size_t count = 0;
+
+    inline std::optional<T>& slot(size_t index) { return slots[index % slots.size()]; }
+    inline const std::optional<T>& slot(size_t index) const { return slots[index % slots.size()]; }
+
+public:
+    explicit WindowOrderStorage(size_t window_size)
+    {
+        if(window_size == 0) {
+            throw std::invalid_argument("Reorder window size must be greater than zero");
+        }
+        slots.resize(window_size);
+    }
+
+    inline void insert(size_t index, T&& value)
+    {
+        assert(!slot(index).has_value());
+        slot(index).emplace(std::move(value));
+        ++count;
+    }
+    inline T take(size_t index)
+    {
+        std::optional<T>& next = slot(index);
+        assert(next.has_value());
+        T value = std::move(next.value());
+        next.reset();
+        --count;
+        return value;
+    }
+    inline bool contains(size_t index) const
+    {
+        return slot(index).has_value();
+    }
+    inline bool can_accept(size_t index, size_t next_index) const
+    {
+        return index - next_index < slots.size();
+    }
+    inline bool empty() const { return count == 0; }
+    inline size_t size() const { return count; }
+    inline size_t capacity() const { return slots.size(); }
+};
+
+
+// OrderedQueue: thread-safe bounded queue of (index, value) pairs, popped
+// strictly in order of increasing index without skipping any; pop blocks
+// while the next expected index has not arrived. Push blocks while
+// Storage has no room for the item, except that the next expected index
+// is always admitted.
+//
+// Every index must be pushed exactly once and not be below the next
+// expected index. The storage policy is a template parameter, so all the
+// checks made under the lock are inlined. With a memory budget (see
+// SyncBoundedContainer) results are held back by their size as well,
+// again except for the next expected index.
+template <typename T, typename Storage>
+class OrderedQueue : public SyncBoundedContainer<OrderedQueue<T, Storage>, std::pair<size_t, T>>
+{
+    friend class SyncBoundedContainer<OrderedQueue<T, Storage>, std::pair<size_t, T>>;
+
+    Storage storage;
+    size_t next_index = 0;
+
+    static constexpr bool accept_depends_on_item = true;
+
+    inline void insert_into_container(std::pair<size_t, T>&& item)
+    {
+        assert(item.first >= next_index);
+        storage.insert(item.first, std::move(item.second));
+    }
+    inline std::pair<size_t, T> remove_from_container()
+    {
+        std::pair<size_t, T> item(next_index, storage.take(next_index));
+        ++next_index;
         return item;
     }
-    inline bool container_is_full() const override
+    inline bool container_can_accept(const std::pair<size_t, T>& item) const
+    {
+        return storage.can_accept(item.first, next_index);
+    }
+    // The next expected index is admitted over a memory budget as well.
+    inline bool container_must_accept(const std::pair<size_t, T>& item) const
+    {
+        return item.first == next_index;
+    }
+    inline bool container_can_yield() const
+    {
+        return storage.contains(next_index);
+    }
+    inline bool container_is_empty() const
     {
-        return pq.size() >= max_size;
+        return storage.empty();
     }
-    inline bool container_is_empty() const override
+    inline size_t container_size() const
     {
-        return pq.empty() || pq.top().first != next_index;
+        return storage.size();
     }
+public:
+    OrderedQueue() requires std::is_default_constructible_v<Storage> = default;
+    // first_index is the index expected first, for sequences not starting
+    // at 0 (e.g. a resumed write).
+    explicit OrderedQueue(size_t capacity_, size_t first_index = 0) : storage(capacity_), next_index(first_index) {}
+
+    inline size_t capacity() const { return storage.capacity(); }
 };
 
-#endif // TDF_WRITER_ORDERED_QUEUE_HPP
\ No newline at end of file
+// Bounded by the number of buffered items (plus possibly the next
+// expected one).
+template <typename T>
+using SyncBoundedPriorityQueue = OrderedQueue<T, HeapOrderStorage<T>>;
+
+// Bounded by index distance from the next expected item; O(1) per item.
+template <typename T>
+using SyncReorderWindow = OrderedQueue<T, WindowOrderStorage<T>>;
+
+#endif // TDF_WRITER_ORDERED_QUEUE_HPP
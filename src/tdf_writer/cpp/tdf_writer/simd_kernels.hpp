@@ -0,0 +1,472 @@
+#ifndef TDF_WRITER_SIMD_KERNELS_HPP
+#define TDF_WRITER_SIMD_KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TDF_WRITER_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define TDF_WRITER_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+// Vectorized kernels of the TDF payload preprocessing, with runtime
+// dispatch: simd_kernels() returns the best implementation the CPU
+// supports (AVX-512, AVX2, NEON, or the scalar fallback), chosen once.
+// The x86 variants are compiled with per-function target attributes, so
+// the library needs no -mavx2 / -mavx512f flags and still runs on CPUs
+// without them. All variants produce identical output.
+//
+//   byte_shuffle4(values, n, out)     out[k*n + i] = byte k of values[i]
+//   byte_unshuffle4(in, n, values)    inverse of byte_shuffle4
+//   delta_interleave(tof, intensities, n, out)
+//                                     out[2i] = tof[i] - tof[i-1] (tof[-1]
+//                                     taken as -1, so out[0] = tof[0] + 1),
+//                                     out[2i+1] = intensities[i]
+//   prefix_sum(in, n, initial, out)   out[i] = initial + in[0] + .. + in[i]
+//
+// All arithmetic wraps modulo 2^32, which makes prefix_sum the exact
+// inverse of the delta. Memory is accessed unaligned; the output of
+// byte_shuffle4 and delta_interleave must not overlap the input.
+
+enum class SimdLevel
+{
+    scalar,
+    avx2,
+    avx512,
+    neon,
+};
+
+struct SimdKernels
+{
+    SimdLevel level;
+    void (*byte_shuffle4)(const uint32_t* values, size_t count, char* out);
+    void (*byte_unshuffle4)(const char* in, size_t count, uint32_t* values);
+    void (*delta_interleave)(const uint32_t* tof, const uint32_t* intensities, size_t count, uint32_t* out);
+    void (*prefix_sum)(const uint32_t* in, size_t count, uint32_t initial, uint32_t* out);
+};
+
+
+namespace simd_detail {
+
+// Scalar reference implementations, also used for the tails of the
+// vector loops.
+
+inline void byte_shuffle4_scalar(const uint32_t* values, size_t begin, size_t count, char* out)
+{
+    for(size_t i = begin; i < count; ++i) {
+        const uint32_t v = values[i];
+        out[i]             = static_cast<char>(v & 0xFF);
+        out[i + count]     = static_cast<char>((v >> 8) & 0xFF);
+        out[i + 2 * count] = static_cast<char>((v >> 16) & 0xFF);
+        out[i + 3 * count] = static_cast<char>((v >> 24) & 0xFF);
+    }
+}
+
+inline void byte_unshuffle4_scalar(const char* in, size_t begin, size_t count, uint32_t* values)
+{
+    const auto* bytes = reinterpret_cast<const unsigned char*>(in);
+    for(size_t i = begin; i < count; ++i) {
+        values[i] = uint32_t(bytes[i])
+                    | uint32_t(bytes[i + count]) << 8
+                    | uint32_t(bytes[i + 2 * count]) << 16
+                    | uint32_t(bytes[i + 3 * count]) << 24;
+    }
+}
+
+inline void delta_interleave_scalar(const uint32_t* tof, const uint32_t* intensities, size_t begin, size_t count, uint32_t* out)
+{
+    uint32_t previous = begin == 0 ? static_cast<uint32_t>(-1) : tof[begin - 1];
+    for(size_t i = begin; i < count; ++i) {
+        out[2*i] = tof[i] - previous;
+        out[2*i + 1] = intensities[i];
+        previous = tof[i];
+    }
+}
+
+inline void prefix_sum_scalar(const uint32_t* in, size_t begin, size_t count, uint32_t running, uint32_t* out)
+{
+    for(size_t i = begin; i < count; ++i) {
+        running += in[i];
+        out[i] = running;
+    }
+}
+
+inline void byte_shuffle4_generic(const uint32_t* values, size_t count, char* out)
+{
+    byte_shuffle4_scalar(values, 0, count, out);
+}
+
+inline void byte_unshuffle4_generic(const char* in, size_t count, uint32_t* values)
+{
+    byte_unshuffle4_scalar(in, 0, count, values);
+}
+
+inline void delta_interleave_generic(const uint32_t* tof, const uint32_t* intensities, size_t count, uint32_t* out)
+{
+    delta_interleave_scalar(tof, intensities, 0, count, out);
+}
+
+inline void prefix_sum_generic(const uint32_t* in, size_t count, uint32_t initial, uint32_t* out)
+{
+    prefix_sum_scalar(in, 0, count, initial, out);
+}
+
+
+#if defined(TDF_WRITER_SIMD_X86)
+
+// AVX2: 32 values per step. Within each 128-bit lane pshufb gathers the
+// four bytes of each plane into one dword, a cross-lane permute makes
+// each qword one plane of 8 values, and a 4x4 qword transpose over four
+// registers yields 32 bytes of each plane. Every step is its own inverse
+// or has a fixed inverse permutation, which gives the unshuffle.
+
+__attribute__((target("avx2")))
+inline void transpose_qwords_avx2(__m256i& a, __m256i& b, __m256i& c, __m256i& d)
+{
+    const __m256i t0 = _mm256_unpacklo_epi64(a, b);
+    const __m256i t1 = _mm256_unpackhi_epi64(a, b);
+    const __m256i t2 = _mm256_unpacklo_epi64(c, d);
+    const __m256i t3 = _mm256_unpackhi_epi64(c, d);
+    a = _mm256_permute2x128_si256(t0, t2, 0x20);
+    b = _mm256_permute2x128_si256(t1, t3, 0x20);
+    c = _mm256_permute2x128_si256(t0, t2, 0x31);
+    d = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+__attribute__((target("avx2")))
+inline void byte_shuffle4_avx2(const uint32_t* values, size_t count, char* out)
+{
+    const __m256i bytes = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                                           0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m256i planes = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for(; i + 32 <= count; i += 32) {
+        __m256i r[4];
+        for(int k = 0; k < 4; ++k) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i + 8 * k));
+            r[k] = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, bytes), planes);
+        }
+        transpose_qwords_avx2(r[0], r[1], r[2], r[3]);
+        for(int k = 0; k < 4; ++k) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k * count + i), r[k]);
+        }
+    }
+    byte_shuffle4_scalar(values, i, count, out);
+}
+
+__attribute__((target("avx2")))
+inline void byte_unshuffle4_avx2(const char* in, size_t count, uint32_t* values)
+{
+    const __m256i bytes = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                                           0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m256i dwords = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    size_t i = 0;
+    for(; i + 32 <= count; i += 32) {
+        __m256i r[4];
+        for(int k = 0; k < 4; ++k) {
+            r[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + k * count + i));
+        }
+        transpose_qwords_avx2(r[0], r[1], r[2], r[3]);
+        for(int k = 0; k < 4; ++k) {
+            const __m256i v = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(r[k], dwords), bytes);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + i + 8 * k), v);
+        }
+    }
+    byte_unshuffle4_scalar(in, i, count, values);
+}
+
+// The previous TOF of each element is the unaligned load one element back.
+__attribute__((target("avx2")))
+inline void delta_interleave_avx2(const uint32_t* tof, const uint32_t* intensities, size_t count, uint32_t* out)
+{
+    if(count == 0) return;
+    delta_interleave_scalar(tof, intensities, 0, 1, out);
+    size_t i = 1;
+    for(; i + 8 <= count; i += 8) {
+        const __m256i current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tof + i));
+        const __m256i previous = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tof + i - 1));
+        const __m256i intensity = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(intensities + i));
+        const __m256i delta = _mm256_sub_epi32(current, previous);
+        const __m256i lo = _mm256_unpacklo_epi32(delta, intensity);
+        const __m256i hi = _mm256_unpackhi_epi32(delta, intensity);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    delta_interleave_scalar(tof, intensities, i, count, out);
+}
+
+// Log-step scan within each lane, then the low lane's total is carried
+// into the high lane and the running total into both.
+__attribute__((target("avx2")))
+inline void prefix_sum_avx2(const uint32_t* in, size_t count, uint32_t initial, uint32_t* out)
+{
+    __m256i running = _mm256_set1_epi32(static_cast<int>(initial));
+    const __m256i last = _mm256_set1_epi32(7);
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        const __m256i carry = _mm256_shuffle_epi32(x, 0xFF);
+        x = _mm256_add_epi32(x, _mm256_permute2x128_si256(carry, carry, 0x08));
+        x = _mm256_add_epi32(x, running);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), x);
+        running = _mm256_permutevar8x32_epi32(x, last);
+    }
+    prefix_sum_scalar(in, i, count, static_cast<uint32_t>(_mm256_cvtsi256_si32(running)), out);
+}
+
+
+// AVX-512 (F + BW): 64 values per step, same scheme with 128-bit chunks
+// in place of qwords.
+//
+// GCC 12's AVX-512 headers trip -Wmaybe-uninitialized on their own
+// _mm512_undefined_* placeholders (GCC bug 105593).
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__((target("avx512f,avx512bw")))
+inline void transpose_chunks_avx512(__m512i& a, __m512i& b, __m512i& c, __m512i& d)
+{
+    const __m512i t0 = _mm512_shuffle_i64x2(a, b, 0x44);
+    const __m512i t1 = _mm512_shuffle_i64x2(a, b, 0xEE);
+    const __m512i t2 = _mm512_shuffle_i64x2(c, d, 0x44);
+    const __m512i t3 = _mm512_shuffle_i64x2(c, d, 0xEE);
+    a = _mm512_shuffle_i64x2(t0, t2, 0x88);
+    b = _mm512_shuffle_i64x2(t0, t2, 0xDD);
+    c = _mm512_shuffle_i64x2(t1, t3, 0x88);
+    d = _mm512_shuffle_i64x2(t1, t3, 0xDD);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i plane_bytes_avx512()
+{
+    return _mm512_broadcast_i32x4(_mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline void byte_shuffle4_avx512(const uint32_t* values, size_t count, char* out)
+{
+    const __m512i bytes = plane_bytes_avx512();
+    const __m512i planes = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    size_t i = 0;
+    for(; i + 64 <= count; i += 64) {
+        __m512i r[4];
+        for(int k = 0; k < 4; ++k) {
+            const __m512i v = _mm512_loadu_si512(values + i + 16 * k);
+            r[k] = _mm512_permutexvar_epi32(planes, _mm512_shuffle_epi8(v, bytes));
+        }
+        transpose_chunks_avx512(r[0], r[1], r[2], r[3]);
+        for(int k = 0; k < 4; ++k) {
+            _mm512_storeu_si512(out + k * count + i, r[k]);
+        }
+    }
+    byte_shuffle4_scalar(values, i, count, out);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline void byte_unshuffle4_avx512(const char* in, size_t count, uint32_t* values)
+{
+    const __m512i bytes = plane_bytes_avx512();
+    const __m512i planes = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    size_t i = 0;
+    for(; i + 64 <= count; i += 64) {
+        __m512i r[4];
+        for(int k = 0; k < 4; ++k) {
+            r[k] = _mm512_loadu_si512(in + k * count + i);
+        }
+        transpose_chunks_avx512(r[0], r[1], r[2], r[3]);
+        for(int k = 0; k < 4; ++k) {
+            _mm512_storeu_si512(values + i + 16 * k, _mm512_shuffle_epi8(_mm512_permutexvar_epi32(planes, r[k]), bytes));
+        }
+    }
+    byte_unshuffle4_scalar(in, i, count, values);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline void delta_interleave_avx512(const uint32_t* tof, const uint32_t* intensities, size_t count, uint32_t* out)
+{
+    if(count == 0) return;
+    delta_interleave_scalar(tof, intensities, 0, 1, out);
+    const __m512i lo = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+    const __m512i hi = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+    size_t i = 1;
+    for(; i + 16 <= count; i += 16) {
+        const __m512i current = _mm512_loadu_si512(tof + i);
+        const __m512i previous = _mm512_loadu_si512(tof + i - 1);
+        const __m512i intensity = _mm512_loadu_si512(intensities + i);
+        const __m512i delta = _mm512_sub_epi32(current, previous);
+        _mm512_storeu_si512(out + 2 * i, _mm512_permutex2var_epi32(delta, lo, intensity));
+        _mm512_storeu_si512(out + 2 * i + 16, _mm512_permutex2var_epi32(delta, hi, intensity));
+    }
+    delta_interleave_scalar(tof, intensities, i, count, out);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline void prefix_sum_avx512(const uint32_t* in, size_t count, uint32_t initial, uint32_t* out)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i last = _mm512_set1_epi32(15);
+    __m512i running = _mm512_set1_epi32(static_cast<int>(initial));
+    size_t i = 0;
+    for(; i + 16 <= count; i += 16) {
+        __m512i x = _mm512_loadu_si512(in + i);
+        x = _mm512_add_epi32(x, _mm512_alignr_epi32(x, zero, 15));
+        x = _mm512_add_epi32(x, _mm512_alignr_epi32(x, zero, 14));
+        x = _mm512_add_epi32(x, _mm512_alignr_epi32(x, zero, 12));
+        x = _mm512_add_epi32(x, _mm512_alignr_epi32(x, zero, 8));
+        x = _mm512_add_epi32(x, running);
+        _mm512_storeu_si512(out + i, x);
+        running = _mm512_permutexvar_epi32(last, x);
+    }
+    prefix_sum_scalar(in, i, count, static_cast<uint32_t>(_mm512_cvtsi512_si32(running)), out);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // TDF_WRITER_SIMD_X86
+
+
+#if defined(TDF_WRITER_SIMD_NEON)
+
+// NEON: vld4q / vst4q (de)interleave bytes in fours directly.
+
+inline void byte_shuffle4_neon(const uint32_t* values, size_t count, char* out)
+{
+    auto* planes = reinterpret_cast<uint8_t*>(out);
+    size_t i = 0;
+    for(; i + 16 <= count; i += 16) {
+        const uint8x16x4_t v = vld4q_u8(reinterpret_cast<const uint8_t*>(values + i));
+        vst1q_u8(planes + i, v.val[0]);
+        vst1q_u8(planes + count + i, v.val[1]);
+        vst1q_u8(planes + 2 * count + i, v.val[2]);
+        vst1q_u8(planes + 3 * count + i, v.val[3]);
+    }
+    byte_shuffle4_scalar(values, i, count, out);
+}
+
+inline void byte_unshuffle4_neon(const char* in, size_t count, uint32_t* values)
+{
+    const auto* planes = reinterpret_cast<const uint8_t*>(in);
+    size_t i = 0;
+    for(; i + 16 <= count; i += 16) {
+        uint8x16x4_t v;
+        v.val[0] = vld1q_u8(planes + i);
+        v.val[1] = vld1q_u8(planes + count + i);
+        v.val[2] = vld1q_u8(planes + 2 * count + i);
+        v.val[3] = vld1q_u8(planes + 3 * count + i);
+        vst4q_u8(reinterpret_cast<uint8_t*>(values + i), v);
+    }
+    byte_unshuffle4_scalar(in, i, count, values);
+}
+
+inline void delta_interleave_neon(const uint32_t* tof, const uint32_t* intensities, size_t count, uint32_t* out)
+{
+    if(count == 0) return;
+    delta_interleave_scalar(tof, intensities, 0, 1, out);
+    size_t i = 1;
+    for(; i + 4 <= count; i += 4) {
+        uint32x4x2_t v;
+        v.val[0] = vsubq_u32(vld1q_u32(tof + i), vld1q_u32(tof + i - 1));
+        v.val[1] = vld1q_u32(intensities + i);
+        vst2q_u32(out + 2 * i, v);
+    }
+    delta_interleave_scalar(tof, intensities, i, count, out);
+}
+
+inline void prefix_sum_neon(const uint32_t* in, size_t count, uint32_t initial, uint32_t* out)
+{
+    const uint32x4_t zero = vdupq_n_u32(0);
+    uint32x4_t running = vdupq_n_u32(initial);
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        uint32x4_t x = vld1q_u32(in + i);
+        x = vaddq_u32(x, vextq_u32(zero, x, 3));
+        x = vaddq_u32(x, vextq_u32(zero, x, 2));
+        x = vaddq_u32(x, running);
+        vst1q_u32(out + i, x);
+        running = vdupq_laneq_u32(x, 3);
+    }
+    prefix_sum_scalar(in, i, count, vgetq_lane_u32(running, 0), out);
+}
+
+#endif // TDF_WRITER_SIMD_NEON
+
+} // namespace simd_detail
+
+
+// Whether this build and CPU can run level.
+inline bool simd_level_supported(SimdLevel level)
+{
+    switch(level) {
+    case SimdLevel::scalar:
+        return true;
+#if defined(TDF_WRITER_SIMD_X86)
+    case SimdLevel::avx2:
+        return __builtin_cpu_supports("avx2");
+    case SimdLevel::avx512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+#if defined(TDF_WRITER_SIMD_NEON)
+    case SimdLevel::neon:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+inline const char* simd_level_name(SimdLevel level)
+{
+    switch(level) {
+    case SimdLevel::avx2: return "avx2";
+    case SimdLevel::avx512: return "avx512";
+    case SimdLevel::neon: return "neon";
+    default: return "scalar";
+    }
+}
+
+// Kernels of level, which must be supported; see simd_level_supported().
+inline SimdKernels simd_kernels(SimdLevel level)
+{
+    using namespace simd_detail;
+    switch(level) {
+#if defined(TDF_WRITER_SIMD_X86)
+    case SimdLevel::avx2:
+        return {level, byte_shuffle4_avx2, byte_unshuffle4_avx2, delta_interleave_avx2, prefix_sum_avx2};
+    case SimdLevel::avx512:
+        return {level, byte_shuffle4_avx512, byte_unshuffle4_avx512, delta_interleave_avx512, prefix_sum_avx512};
+#endif
+#if defined(TDF_WRITER_SIMD_NEON)
+    case SimdLevel::neon:
+        return {level, byte_shuffle4_neon, byte_unshuffle4_neon, delta_interleave_neon, prefix_sum_neon};
+#endif
+    default:
+        return {SimdLevel::scalar, byte_shuffle4_generic, byte_unshuffle4_generic, delta_interleave_generic, prefix_sum_generic};
+    }
+}
+
+// The best kernels for this CPU, detected on first use.
+inline const SimdKernels& simd_kernels()
+{
+    static const SimdKernels best = []() {
+        for(SimdLevel level : {SimdLevel::avx512, SimdLevel::avx2, SimdLevel::neon}) {
+            if(simd_level_supported(level)) {
+                return simd_kernels(level);
+            }
+        }
+        return simd_kernels(SimdLevel::scalar);
+    }();
+    return best;
+}
+
+#endif // TDF_WRITER_SIMD_KERNELS_HPP
@@ -1,15 +1,39 @@
 #ifndef TDF_WRITER_SIMPLE_BUFFER_HPP
 #define TDF_WRITER_SIMPLE_BUFFER_HPP
 
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <stdexcept>
 
+#include "buffer_pool.hpp"
+
+
+// Move-only heap buffer. Buffers created with a BufferPool take their
+// storage from the pool and hand it back on destruction, whichever thread
+// that happens on; the pool is kept alive by its buffers.
 template <typename T>
 class SimpleBuffer
 {
     T* internal_data = nullptr;
     size_t internal_size = 0;
+    size_t internal_capacity = 0;
+    std::shared_ptr<BufferPool<T>> pool;
+
+    void release()
+    {
+        if(internal_data) {
+            if(pool) {
+                pool->release(internal_data, internal_capacity);
+            } else {
+                free(internal_data);
+            }
+        }
+    }
 
 public:
-    SimpleBuffer(size_t size_) : internal_size(size_)
+    SimpleBuffer(size_t size_) : internal_size(size_), internal_capacity(size_)
     {
         internal_data = (T*) malloc(size_ * sizeof(T));
         if(!internal_data) {
@@ -17,7 +41,7 @@ public:
         }
     }
 
-    SimpleBuffer(const T* data_, size_t size_) : internal_size(size_)
+    SimpleBuffer(const T* data_, size_t size_) : internal_size(size_), internal_capacity(size_)
     {
         internal_data = (T*) malloc(size_ * sizeof(T));
         if(!internal_data) {
@@ -26,39 +50,65 @@ public:
         std::copy(data_, data_ + size_, internal_data);
     }
 
-    ~SimpleBuffer()
+    SimpleBuffer(size_t size_, std::shared_ptr<BufferPool<T>> pool_) :
+        internal_size(size_),
+        pool(std::move(pool_))
     {
-        if(internal_data) {
-            free(internal_data);
+        if(!pool) {
+            throw std::invalid_argument("Buffer pool cannot be null");
         }
+        internal_capacity = pool->rounded_capacity(size_);
+        internal_data = pool->acquire(size_);
+    }
+
+    ~SimpleBuffer()
+    {
+        release();
     }
 
     SimpleBuffer(const SimpleBuffer&) = delete;
     SimpleBuffer& operator=(const SimpleBuffer&) = delete;
     SimpleBuffer(SimpleBuffer&& other) noexcept :
         internal_data(other.internal_data),
-        internal_size(other.internal_size)
+        internal_size(other.internal_size),
+        internal_capacity(other.internal_capacity),
+        pool(std::move(other.pool))
     {
         other.internal_data = nullptr;
         other.internal_size = 0;
+        other.internal_capacity = 0;
     }
     SimpleBuffer& operator=(SimpleBuffer&& other) noexcept
     {
         if(this != &other) {
-            if(internal_data) {
-                free(internal_data);
-            }
+            release();
             internal_data = other.internal_data;
             internal_size = other.internal_size;
+            internal_capacity = other.internal_capacity;
+            pool = std::move(other.pool);
             other.internal_data = nullptr;
             other.internal_size = 0;
+            other.internal_capacity = 0;
         }
         return *this;
     }
 
+    // Changes the logical size without reallocating; new_size may not
+    // exceed capacity().
+    void resize(size_t new_size)
+    {
+        if(new_size > internal_capacity) {
+            throw std::length_error("SimpleBuffer cannot grow beyond its capacity");
+        }
+        internal_size = new_size;
+    }
+
     inline const T* data() const { return internal_data; }
     inline T* data() { return internal_data; }
     inline size_t size() const { return internal_size; }
+    inline size_t capacity() const { return internal_capacity; }
+    // Bytes held, for MemoryBudget.
+    inline size_t memory_footprint() const { return sizeof(*this) + internal_capacity * sizeof(T); }
 };
 
-#endif // TDF_WRITER_SIMPLE_BUFFER_HPP
\ No newline at end of file
+#endif // TDF_WRITER_SIMPLE_BUFFER_HPP
@@ -0,0 +1,544 @@
+#ifndef TDF_WRITER_STAGED_FILE_WRITER_HPP
+#define TDF_WRITER_STAGED_FILE_WRITER_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "affinity.hpp"
+#include "memory_budget.hpp"
+#include "stats.hpp"
+#include "sync_buffer.hpp"
+
+
+struct FileWriterOptions
+{
+    // Size and number of staging blocks; the size must be a multiple of
+    // 4096.
+    size_t staging_block_size = size_t(16) << 20;
+    size_t num_staging_blocks = 2;
+    // Open with O_DIRECT: data bypasses the page cache. The last block is
+    // padded to 4096 bytes and the file truncated to its real size.
+    bool direct_io = false;
+    // Buffered mode only: every writeback_interval bytes, start writeback
+    // of the range just written and wait for the one before it, so dirty
+    // pages are flushed at a steady pace. 0 leaves it to the kernel.
+    uint64_t writeback_interval = 0;
+    // With writeback_interval, drop ranges from the page cache once they
+    // are on disk.
+    bool drop_written_pages = false;
+    // Expected final size in bytes, reserved with fallocate up front so
+    // the file system can lay it out in few extents. 0 if unknown. The
+    // reservation does not change the file size, which always ends at the
+    // data written so far.
+    uint64_t expected_size = 0;
+    // When the data is about to pass the reserved space, reserve this
+    // many bytes more. 0 disables preallocation, including expected_size.
+    uint64_t preallocation_chunk = uint64_t(256) << 20;
+    // Keep the first resume_offset bytes of an existing file and append
+    // after them instead of starting an empty one (resuming from a
+    // checkpoint, see FileCollector).
+    uint64_t resume_offset = 0;
+    // The staging blocks are charged to it for the writer's lifetime; the
+    // writer cannot be created if they do not fit (see MemoryBudget).
+    std::shared_ptr<MemoryBudget> memory_budget;
+    // CPUs the writer thread may run on, e.g. numa_node_cpus() of the node
+    // the drive is attached to. Empty leaves it unpinned. Not used by
+    // ParallelFileWriter, which has no thread of its own.
+    std::vector<int> writer_cpus;
+    // False leaves the *_ns histograms of FileWriterStats empty, saving
+    // their clock reads (see DispatcherOptions::collect_timings).
+    bool collect_timings = true;
+};
+
+
+struct FileWriterStats
+{
+    uint64_t bytes_staged = 0;          // Passed to append()
+    uint64_t bytes_written = 0;         // Written to the file
+    HistogramSnapshot write_ns;         // Per staging block write
+    HistogramSnapshot staging_wait_ns;  // append() waiting for a free block
+    HistogramSnapshot offset_wait_ns;   // ParallelFileWriter: waiting for the block's offset
+};
+
+
+[[noreturn]] inline void throw_errno(const std::string& what)
+{
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// pwrite() until all of data is written, retrying on EINTR.
+inline void pwrite_all(int fd, const char* data, size_t size, uint64_t offset)
+{
+    while(size > 0) {
+        ssize_t written = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            throw_errno("Failed to write output file");
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+        offset += static_cast<uint64_t>(written);
+    }
+}
+
+// fsync()s the directory containing file, making a rename or creation of
+// file durable.
+inline void sync_parent_directory(const std::string& file)
+{
+    const size_t slash = file.rfind('/');
+    const std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : file.substr(0, slash));
+    const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
+        throw_errno("Failed to open directory " + dir);
+    }
+    const int rc = ::fsync(fd);
+    ::close(fd);
+    if(rc != 0) {
+        throw_errno("Failed to sync directory " + dir);
+    }
+}
+
+
+// StagedFileWriter: the I/O stage of FileCollector.
+//
+// append() copies bytes into a large staging block; once a block is full
+// it is handed to a dedicated writer thread and filling continues in the
+// next free block while the previous one is written. With the default
+// two blocks this is double buffering: the caller only waits on disk I/O
+// when it has filled a whole block before the writer finished the last.
+//
+// Errors on the writer thread stop it and are rethrown by the next
+// append() or by finish(). Staging blocks are page aligned, which is what
+// lets them be written with O_DIRECT (see FileWriterOptions).
+class StagedFileWriter
+{
+    struct FreeDeleter
+    {
+        void operator()(char* p) const { std::free(p); }
+    };
+
+    struct StagingBlock
+    {
+        std::unique_ptr<char, FreeDeleter> data;
+        size_t size = 0;
+        uint64_t offset = 0;
+    };
+
+    static constexpr size_t staging_alignment = 4096;
+
+    int fd = -1;
+    size_t block_size;
+    bool direct_io;
+    uint64_t writeback_interval;
+    bool drop_written_pages;
+    uint64_t preallocation_chunk;
+    bool collect_timings;
+    uint64_t appended = 0;
+    // End of the space reserved with fallocate (FALLOC_FL_KEEP_SIZE, so
+    // past the end of the file); what is left unused is given back once
+    // finished. Written by the writer thread only.
+    uint64_t allocated_end = 0;
+    // Writer thread only: start of the range not yet sent to writeback,
+    // and the range sent last time, waited for at the next interval.
+    uint64_t writeback_start = 0;
+    uint64_t previous_writeback_start = 0;
+    uint64_t previous_writeback_size = 0;
+    std::optional<StagingBlock> current;
+    SynchronizedBuffer<StagingBlock> free_blocks;
+    SynchronizedBuffer<StagingBlock> full_blocks;
+    std::thread writer_thread;
+    // Set by the writer thread as it stops, under progress_mtx; read
+    // without the lock only once the thread is joined.
+    std::exception_ptr writer_error;
+    // For sync(): blocks handed to the writer thread (caller side) and
+    // blocks it has written (guarded by progress_mtx).
+    size_t blocks_submitted = 0;
+    size_t blocks_done = 0;
+    bool writer_stopped = false;
+    std::mutex progress_mtx;
+    std::condition_variable progress_cv;
+
+    std::atomic<uint64_t> bytes_staged = 0;
+    std::atomic<uint64_t> bytes_written = 0;
+    Histogram write_ns;
+    Histogram staging_wait_ns;
+
+    // Holds the staging blocks' share of a memory budget.
+    struct BudgetCharge
+    {
+        std::shared_ptr<MemoryBudget> budget;
+        size_t bytes = 0;
+
+        BudgetCharge(std::shared_ptr<MemoryBudget> budget_, size_t bytes_)
+            : budget(std::move(budget_)), bytes(bytes_)
+        {
+            if(budget && !budget->try_acquire(bytes)) {
+                throw std::runtime_error("Memory budget cannot hold the staging blocks");
+            }
+        }
+        BudgetCharge(const BudgetCharge&) = delete;
+        BudgetCharge& operator=(const BudgetCharge&) = delete;
+        ~BudgetCharge()
+        {
+            if(budget) budget->release(bytes);
+        }
+    };
+    BudgetCharge staging_charge;
+
+    static inline size_t align_up(size_t size)
+    {
+        return (size + staging_alignment - 1) / staging_alignment * staging_alignment;
+    }
+
+    // Preallocation is only a hint: if the file system refuses it, the
+    // data is written without.
+    bool reserve(uint64_t end)
+    {
+        if(::fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(allocated_end),
+                       static_cast<off_t>(end - allocated_end)) != 0) {
+            preallocation_chunk = 0;
+            return false;
+        }
+        allocated_end = end;
+        return true;
+    }
+
+    void preallocate_for(uint64_t written_end)
+    {
+        if(preallocation_chunk > 0 && written_end + block_size > allocated_end) {
+            reserve(std::max(allocated_end, written_end) + preallocation_chunk);
+        }
+    }
+
+    void pace_writeback(uint64_t written_end)
+    {
+        if(written_end - writeback_start < writeback_interval) {
+            return;
+        }
+        if(::sync_file_range(fd, static_cast<off_t>(writeback_start),
+                             static_cast<off_t>(written_end - writeback_start),
+                             SYNC_FILE_RANGE_WRITE) != 0) {
+            throw_errno("Failed to start writeback of output file");
+        }
+        if(previous_writeback_size > 0) {
+            if(::sync_file_range(fd, static_cast<off_t>(previous_writeback_start),
+                                 static_cast<off_t>(previous_writeback_size),
+                                 SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+                throw_errno("Failed to write back output file");
+            }
+            if(drop_written_pages) {
+                ::posix_fadvise(fd, static_cast<off_t>(previous_writeback_start),
+                                static_cast<off_t>(previous_writeback_size), POSIX_FADV_DONTNEED);
+            }
+        }
+        previous_writeback_start = writeback_start;
+        previous_writeback_size = written_end - writeback_start;
+        writeback_start = written_end;
+    }
+
+    void run_writer(const std::vector<int>& cpus)
+    {
+        std::exception_ptr error;
+        try {
+            pin_current_thread(cpus);
+            while(true) {
+                auto block = full_blocks.pop();
+                if(!block.has_value()) break;
+                size_t size = block->size;
+                if(direct_io) {
+                    // Only the last block can be partial; the padding is
+                    // truncated away by finish().
+                    size = align_up(size);
+                    std::memset(block->data.get() + block->size, 0, size - block->size);
+                }
+                preallocate_for(block->offset + size);
+                Timing writing(write_ns, collect_timings);
+                pwrite_all(fd, block->data.get(), size, block->offset);
+                writing.record();
+                bytes_written.fetch_add(block->size, std::memory_order_relaxed);
+                if(writeback_interval > 0 && !direct_io) {
+                    pace_writeback(block->offset + block->size);
+                }
+                block->size = 0;
+                free_blocks.push(std::move(block.value()));
+                {
+                    std::lock_guard<std::mutex> lock(progress_mtx);
+                    ++blocks_done;
+                }
+                progress_cv.notify_all();
+            }
+        } catch(...) {
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(progress_mtx);
+            writer_error = error;
+            writer_stopped = true;
+        }
+        progress_cv.notify_all();
+        if(error) {
+            // Unblocks an append() waiting for a free block.
+            free_blocks.close();
+            full_blocks.close();
+        }
+    }
+
+    [[noreturn]] void rethrow_writer_error()
+    {
+        if(writer_thread.joinable()) {
+            writer_thread.join();
+        }
+        if(writer_error) {
+            std::rethrow_exception(writer_error);
+        }
+        throw std::runtime_error("Output writer has stopped");
+    }
+
+    void acquire_block()
+    {
+        Timing waiting(staging_wait_ns, collect_timings);
+        auto block = free_blocks.pop();
+        waiting.record();
+        if(!block.has_value()) {
+            rethrow_writer_error();
+        }
+        current = std::move(block.value());
+        current->offset = appended;
+    }
+
+    void submit_block()
+    {
+        appended += current->size;
+        StagingBlock block = std::move(current.value());
+        current.reset();
+        try {
+            full_blocks.push(std::move(block));
+        } catch(const std::runtime_error&) {
+            rethrow_writer_error();
+        }
+        ++blocks_submitted;
+    }
+
+    // Continues an existing file after its first resume_offset bytes. In
+    // direct mode blocks must start on a page boundary, so the partial
+    // page at the end is read back into the first block.
+    void resume_at(uint64_t resume_offset)
+    {
+        struct stat st;
+        if(::fstat(fd, &st) != 0) {
+            throw_errno("Failed to stat output file");
+        }
+        if(static_cast<uint64_t>(st.st_size) < resume_offset) {
+            throw std::runtime_error("Output file is shorter than the offset to resume at");
+        }
+        if(::ftruncate(fd, static_cast<off_t>(resume_offset)) != 0) {
+            throw_errno("Failed to truncate output file");
+        }
+        appended = resume_offset;
+        if(direct_io && resume_offset % staging_alignment != 0) {
+            acquire_block();
+            current->offset = resume_offset / staging_alignment * staging_alignment;
+            current->size = resume_offset - current->offset;
+            appended = current->offset;
+            size_t read = 0;
+            while(read < current->size) {
+                const ssize_t n = ::pread(fd, current->data.get() + read, staging_alignment - read,
+                                          static_cast<off_t>(current->offset + read));
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) throw_errno("Failed to read back output file");
+                read += static_cast<size_t>(n);
+            }
+        }
+    }
+
+public:
+    StagedFileWriter(const std::string& filename, const FileWriterOptions& options = {})
+        : block_size(options.staging_block_size),
+          direct_io(options.direct_io),
+          writeback_interval(options.writeback_interval),
+          drop_written_pages(options.drop_written_pages),
+          preallocation_chunk(options.preallocation_chunk),
+          collect_timings(options.collect_timings),
+          free_blocks(options.num_staging_blocks),
+          full_blocks(options.num_staging_blocks),
+          staging_charge(options.memory_budget, options.num_staging_blocks * options.staging_block_size)
+    {
+        const size_t num_blocks = options.num_staging_blocks;
+        if(block_size == 0 || block_size % staging_alignment != 0) {
+            throw std::invalid_argument("Staging block size must be a positive multiple of 4096");
+        }
+        if(num_blocks < 2) {
+            throw std::invalid_argument("At least two staging blocks are needed");
+        }
+        check_cpus(options.writer_cpus);
+        for(size_t i = 0; i < num_blocks; ++i) {
+            StagingBlock block;
+            block.data.reset(static_cast<char*>(std::aligned_alloc(staging_alignment, block_size)));
+            if(!block.data) {
+                throw std::bad_alloc();
+            }
+            free_blocks.push(std::move(block));
+        }
+        const bool resume = options.resume_offset > 0;
+        int flags = (resume ? O_RDWR : O_WRONLY | O_TRUNC) | O_CREAT | O_CLOEXEC;
+        if(direct_io) {
+            flags |= O_DIRECT;
+        }
+        fd = ::open(filename.c_str(), flags, 0644);
+        if(fd < 0) {
+            if(direct_io && errno == EINVAL) {
+                throw std::runtime_error("Filesystem does not support O_DIRECT: " + filename);
+            }
+            throw std::runtime_error("Failed to open file: " + filename);
+        }
+        try {
+            if(resume) {
+                resume_at(options.resume_offset);
+            }
+            if(preallocation_chunk > 0 && options.expected_size > 0) {
+                reserve(options.expected_size);
+            }
+            writer_thread = std::thread([this, cpus = options.writer_cpus]() { run_writer(cpus); });
+        } catch(...) {
+            ::close(fd);
+            throw;
+        }
+    }
+
+    StagedFileWriter(const StagedFileWriter&) = delete;
+    StagedFileWriter& operator=(const StagedFileWriter&) = delete;
+    StagedFileWriter(StagedFileWriter&&) = delete;
+    StagedFileWriter& operator=(StagedFileWriter&&) = delete;
+
+    // Copies size bytes to the end of the file; blocks only while every
+    // staging block is full or being written.
+    void append(const char* data, size_t size)
+    {
+        if(!writer_thread.joinable()) {
+            throw std::runtime_error("Write to a finished file");
+        }
+        while(size > 0) {
+            if(!current.has_value()) {
+                acquire_block();
+            }
+            const size_t n = std::min(size, block_size - current->size);
+            std::memcpy(current->data.get() + current->size, data, n);
+            current->size += n;
+            bytes_staged.fetch_add(n, std::memory_order_relaxed);
+            data += n;
+            size -= n;
+            if(current->size == block_size) {
+                submit_block();
+            }
+        }
+    }
+
+    // Makes every byte appended so far durable: waits for the writer
+    // thread to write the blocks handed to it, writes the filled part of
+    // the current block in place (it is written again once full) and
+    // fdatasyncs the file. Returns the number of bytes covered.
+    uint64_t sync()
+    {
+        if(writer_thread.joinable()) {
+            bool caught_up;
+            {
+                std::unique_lock<std::mutex> lock(progress_mtx);
+                progress_cv.wait(lock, [this]() { return blocks_done == blocks_submitted || writer_stopped; });
+                caught_up = blocks_done == blocks_submitted && !writer_error;
+            }
+            if(!caught_up) {
+                rethrow_writer_error();
+            }
+            if(current.has_value() && current->size > 0) {
+                size_t size = current->size;
+                if(direct_io) {
+                    size = align_up(size);
+                    std::memset(current->data.get() + current->size, 0, size - current->size);
+                }
+                pwrite_all(fd, current->data.get(), size, current->offset);
+            }
+        }
+        if(::fdatasync(fd) != 0) {
+            throw_errno("Failed to sync output file");
+        }
+        return bytes_appended();
+    }
+
+    // Writes out the partially filled block and waits for the writer
+    // thread. Further calls do nothing.
+    void finish()
+    {
+        if(!writer_thread.joinable()) {
+            return;
+        }
+        std::exception_ptr submit_error;
+        try {
+            if(current.has_value() && current->size > 0) {
+                submit_block();
+            }
+        } catch(...) {
+            submit_error = std::current_exception();
+        }
+        full_blocks.close();
+        if(writer_thread.joinable()) {
+            writer_thread.join();
+        }
+        if(writer_error) {
+            std::rethrow_exception(writer_error);
+        }
+        if(submit_error) {
+            std::rethrow_exception(submit_error);
+        }
+        // Cuts off the direct mode padding. Otherwise the size is already
+        // right, and truncating to it only frees the unused reserved space.
+        if(allocated_end > appended || (direct_io && appended % staging_alignment != 0)) {
+            if(::ftruncate(fd, static_cast<off_t>(appended)) != 0) {
+                throw_errno("Failed to truncate output file");
+            }
+        }
+    }
+
+    // Safe to call from any thread while writing.
+    FileWriterStats stats() const
+    {
+        FileWriterStats result;
+        result.bytes_staged = bytes_staged.load(std::memory_order_relaxed);
+        result.bytes_written = bytes_written.load(std::memory_order_relaxed);
+        result.write_ns = write_ns.snapshot();
+        result.staging_wait_ns = staging_wait_ns.snapshot();
+        return result;
+    }
+
+    // Bytes passed to append(), written or not.
+    inline uint64_t bytes_appended() const { return appended + (current.has_value() ? current->size : 0); }
+
+    ~StagedFileWriter()
+    {
+        try {
+            finish();
+        } catch(...) {}
+        if(fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+#endif // TDF_WRITER_STAGED_FILE_WRITER_HPP
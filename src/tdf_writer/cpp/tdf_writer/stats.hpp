@@ -0,0 +1,145 @@
+#ifndef TDF_WRITER_STATS_HPP
+#define TDF_WRITER_STATS_HPP
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+
+// Pipeline instrumentation. Every recording is a handful of relaxed
+// atomic operations, so snapshots may be taken from any thread while the
+// pipeline runs; they are consistent per field, not across fields.
+
+struct HistogramSnapshot
+{
+    static constexpr size_t num_buckets = 65;
+
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    // buckets[0] counts zeros, buckets[b] values in [2^(b-1), 2^b).
+    std::array<uint64_t, num_buckets> buckets{};
+
+    double mean() const { return count ? static_cast<double>(sum) / static_cast<double>(count) : 0.0; }
+
+    // Upper bound of the bucket holding the q-quantile (0 <= q <= 1), so
+    // within a factor of two of the true value.
+    uint64_t quantile(double q) const
+    {
+        if(count == 0) return 0;
+        const uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+        uint64_t seen = 0;
+        for(size_t b = 0; b < num_buckets; ++b) {
+            seen += buckets[b];
+            if(seen >= rank) {
+                const uint64_t upper = b == 0 ? 0 : (b >= 64 ? UINT64_MAX : (uint64_t(1) << b) - 1);
+                return upper < max ? upper : max;
+            }
+        }
+        return max;
+    }
+};
+
+// Log2-bucketed histogram of non-negative values (durations in ns, sizes).
+class Histogram
+{
+    std::array<std::atomic<uint64_t>, HistogramSnapshot::num_buckets> buckets{};
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> max = 0;
+
+public:
+    void record(uint64_t value)
+    {
+        buckets[std::bit_width(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t current = max.load(std::memory_order_relaxed);
+        while(value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+
+    HistogramSnapshot snapshot() const
+    {
+        HistogramSnapshot result;
+        result.count = count.load(std::memory_order_relaxed);
+        result.sum = sum.load(std::memory_order_relaxed);
+        result.max = max.load(std::memory_order_relaxed);
+        for(size_t b = 0; b < HistogramSnapshot::num_buckets; ++b) {
+            result.buckets[b] = buckets[b].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+};
+
+class Stopwatch
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+public:
+    uint64_t elapsed_ns() const
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+// Stopwatch recording into a histogram that can be switched off: a
+// disabled one neither reads the clock nor touches the histogram.
+class Timing
+{
+    Histogram* histogram;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    Timing(Histogram& histogram_, bool enabled)
+        : histogram(enabled ? &histogram_ : nullptr)
+    {
+        if(histogram) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    void record() const
+    {
+        if(histogram) {
+            histogram->record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count()));
+        }
+    }
+};
+
+
+// Blocking containers: time spent blocked (only pushes and pops that had
+// to wait are recorded) and the number of items held after each insertion.
+struct ContainerStatsSnapshot
+{
+    uint64_t pushes = 0;
+    uint64_t pops = 0;
+    HistogramSnapshot push_wait_ns;
+    HistogramSnapshot pop_wait_ns;
+    HistogramSnapshot occupancy;
+};
+
+struct ContainerStats
+{
+    std::atomic<uint64_t> pushes = 0;
+    std::atomic<uint64_t> pops = 0;
+    Histogram push_wait_ns;
+    Histogram pop_wait_ns;
+    Histogram occupancy;
+
+    ContainerStatsSnapshot snapshot() const
+    {
+        ContainerStatsSnapshot result;
+        result.pushes = pushes.load(std::memory_order_relaxed);
+        result.pops = pops.load(std::memory_order_relaxed);
+        result.push_wait_ns = push_wait_ns.snapshot();
+        result.pop_wait_ns = pop_wait_ns.snapshot();
+        result.occupancy = occupancy.snapshot();
+        return result;
+    }
+};
+
+#endif // TDF_WRITER_STATS_HPP
@@ -1,157 +1,394 @@
 #ifndef TDF_WRITER_SYNC_BOUNDED_CONTAINER_HPP
 #define TDF_WRITER_SYNC_BOUNDED_CONTAINER_HPP
 
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
-#include <queue>
-#include <limits>
+#include <vector>
 #include <optional>
 #include <stdexcept>
 #include <cassert>
+#include <utility>
 
+#include "memory_budget.hpp"
+#include "stats.hpp"
 
 // A thread-safe bounded container.
-template <typename T>
+//
+// The storage is supplied by Derived through CRTP (static polymorphism), so
+// the checks run under the lock on every push and pop are resolved at
+// compile time and can be inlined. Derived provides, typically as private
+// members with the base declared a friend:
+//
+//   void insert_into_container(T&& item);
+//   T remove_from_container();                  // only called if can_yield
+//   bool container_can_accept(const T&) const;
+//   bool container_can_yield() const;
+//   bool container_is_empty() const;
+//   size_t container_size() const;
+//   static constexpr bool accept_depends_on_item;
+//
+// accept_depends_on_item tells whether container_can_accept looks at the
+// item. If it does, a removal may unblock only some particular producer,
+// so all of them are woken; otherwise one is enough.
+//
+// Derived may also provide, for containers whose acceptance does not depend
+// on the item, container_can_accept_any() and emplace_into_container(args...)
+// to let emplace() construct items in place.
+//
+// With a MemoryBudget (set_memory_budget), items are in addition weighed
+// by memory_footprint and only accepted while the budget has room for
+// them, which bounds the container in bytes rather than items. Derived
+// may provide bool container_must_accept(const T&), for items that must
+// be taken whatever the budget; by default that is any item arriving at
+// an empty container.
+template <typename Derived, typename T>
 class SyncBoundedContainer
 {
     std::mutex mtx;
     std::condition_variable cv_can_accept;
     std::condition_variable cv_can_remove;
     bool finished = false;
+    ContainerStats container_stats;
+    // Mirrors container_size() for lock-free readers, see size().
+    std::atomic<size_t> current_size = 0;
+    std::shared_ptr<MemoryBudget> budget;
+    // Bytes charged to budget for the items held. Guarded by mtx.
+    size_t held_bytes = 0;
+
+    inline Derived& derived() { return static_cast<Derived&>(*this); }
+    inline const Derived& derived() const { return static_cast<const Derived&>(*this); }
+
+    // Caller holds mtx.
+    void notify_removers(size_t inserted)
+    {
+        if(inserted == 1) {
+            cv_can_remove.notify_one();
+        } else if(inserted > 1) {
+            cv_can_remove.notify_all();
+        }
+    }
+
+    // Caller holds mtx. With a budget, whether there is room depends on
+    // the item's size.
+    void notify_acceptors()
+    {
+        if(Derived::accept_depends_on_item || budget) {
+            cv_can_accept.notify_all();
+        } else {
+            cv_can_accept.notify_one();
+        }
+    }
+
+    // Caller holds mtx.
+    bool can_accept(const T& item) const
+    {
+        return derived().container_can_accept(item);
+    }
+
+    // Caller holds mtx.
+    bool must_accept(const T& item) const
+    {
+        if constexpr (requires(const Derived& d) { d.container_must_accept(item); }) {
+            return derived().container_must_accept(item);
+        } else {
+            return derived().container_is_empty();
+        }
+    }
+
+    // Caller holds mtx. Whether item may be inserted now; with a budget,
+    // a true result has charged bytes (its footprint) to it.
+    bool admit(const T& item, size_t bytes)
+    {
+        if(!can_accept(item)) {
+            return false;
+        }
+        if(!budget) {
+            return true;
+        }
+        if(must_accept(item)) {
+            budget->force_acquire(bytes);
+            return true;
+        }
+        return budget->try_acquire(bytes);
+    }
+
+    // Caller holds mtx. Waits on cv_can_accept until ready(); waiting
+    // producers are counted by the budget, whose releases (from other
+    // containers too) then wake them.
+    template <typename Predicate>
+    void wait_for_room(std::unique_lock<std::mutex>& lock, Predicate ready)
+    {
+        if(ready()) return;
+        MemoryBudget::Waiter waiter(budget.get());
+        wait_timed(lock, cv_can_accept, container_stats.push_wait_ns, ready);
+    }
+
+    // Caller holds mtx; returns the bytes to release once it is dropped.
+    size_t uncharge(const T& item)
+    {
+        if(!budget) {
+            return 0;
+        }
+        const size_t bytes = memory_footprint(item);
+        held_bytes -= bytes;
+        return bytes;
+    }
+
+    // Caller does not hold mtx, see MemoryBudget.
+    void release_bytes(size_t bytes)
+    {
+        if(bytes > 0) {
+            budget->release(bytes);
+        }
+    }
+
+    // Caller holds mtx. The condition is checked before timing, so pushes
+    // and pops that do not block cost no clock reads.
+    template <typename Predicate>
+    void wait_timed(std::unique_lock<std::mutex>& lock, std::condition_variable& cv, Histogram& waits, Predicate ready)
+    {
+        if(ready()) return;
+        Stopwatch blocked;
+        cv.wait(lock, ready);
+        waits.record(blocked.elapsed_ns());
+    }
+
+    // Caller holds mtx.
+    void record_insertion(size_t count)
+    {
+        container_stats.pushes.fetch_add(count, std::memory_order_relaxed);
+        const size_t size = derived().container_size();
+        container_stats.occupancy.record(size);
+        current_size.store(size, std::memory_order_relaxed);
+    }
+
+    // Caller holds mtx.
+    void record_removal(size_t count)
+    {
+        container_stats.pops.fetch_add(count, std::memory_order_relaxed);
+        current_size.store(derived().container_size(), std::memory_order_relaxed);
+    }
 
 protected:
-    virtual void insert_into_container(T&& item) = 0;
-    virtual T remove_from_container() = 0;
-    virtual bool container_can_accept(const T&) const = 0;
-    virtual bool container_can_yield() const = 0;
-    virtual bool container_is_empty() const = 0;
+    SyncBoundedContainer() = default;
+    ~SyncBoundedContainer()
+    {
+        if(budget) {
+            budget->unsubscribe(this);
+            budget->release(held_bytes);
+        }
+    }
 
 public:
-    SyncBoundedContainer() = default;
-    virtual ~SyncBoundedContainer() = default;
+    using value_type = T;
 
     SyncBoundedContainer(const SyncBoundedContainer&) = delete;
     SyncBoundedContainer& operator=(const SyncBoundedContainer&) = delete;
     SyncBoundedContainer(SyncBoundedContainer&&) = delete;
     SyncBoundedContainer& operator=(SyncBoundedContainer&&) = delete;
 
+    // Weighs items against budget, shared with other containers or
+    // stages, from now on; see MemoryBudget. Call before the first push.
+    void set_memory_budget(std::shared_ptr<MemoryBudget> budget_)
+    {
+        if(!budget_) {
+            throw std::invalid_argument("Memory budget cannot be null");
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if(budget) {
+                throw std::logic_error("Container already has a memory budget");
+            }
+            budget = budget_;
+        }
+        // Not under mtx: the budget's lock is always taken first.
+        budget_->subscribe(this, [this]() {
+            std::lock_guard<std::mutex> lock(mtx);
+            cv_can_accept.notify_all();
+        });
+    }
+
+    inline const std::shared_ptr<MemoryBudget>& memory_budget() const { return budget; }
+
     void push(T&& item)
     {
         std::unique_lock<std::mutex> lock(mtx);
-        cv_can_accept.wait(lock, [this, &item]() { return container_can_accept(item) || finished; });
+        const size_t bytes = budget ? memory_footprint(item) : 0;
+        // finished is checked first: once admit() is true, bytes are charged.
+        wait_for_room(lock, [this, &item, bytes]() { return finished || admit(item, bytes); });
         if(finished) {
             throw std::runtime_error("Push to a closed container");
         }
-        insert_into_container(std::move(item));
+        held_bytes += bytes;
+        derived().insert_into_container(std::move(item));
+        record_insertion(1);
         cv_can_remove.notify_one();
     }
 
-    std::optional<T> pop()
+    // Non-blocking push: inserts item, moving from it, and returns true if
+    // the container can take it right away; otherwise leaves it untouched
+    // and returns false. Throws if the container is closed.
+    bool try_push(T&& item)
     {
         std::unique_lock<std::mutex> lock(mtx);
-        cv_can_remove.wait(lock, [this]() { return container_can_yield() || finished; });
-        if(finished && container_is_empty()) {
-            return std::nullopt;
+        if(finished) {
+            throw std::runtime_error("Push to a closed container");
         }
-        T item = remove_from_container();
-        cv_can_accept.notify_one();
-        return std::move(item);
+        const size_t bytes = budget ? memory_footprint(item) : 0;
+        if(!admit(item, bytes)) {
+            return false;
+        }
+        held_bytes += bytes;
+        derived().insert_into_container(std::move(item));
+        record_insertion(1);
+        cv_can_remove.notify_one();
+        return true;
     }
 
-    void close()
+    // Constructs the item from args and pushes it. Containers that can tell
+    // whether they have room without seeing the item build it in place
+    // inside the container once there is space; for the others, and with
+    // a memory budget, it has to be built first, since it is weighed.
+    template <typename... Args>
+    void emplace(Args&&... args)
     {
-        std::unique_lock<std::mutex> lock(mtx);
-        finished = true;
-        cv_can_accept.notify_all();
-        cv_can_remove.notify_all();
+        if constexpr (requires(Derived& d) { d.emplace_into_container(std::forward<Args>(args)...); }) {
+            std::unique_lock<std::mutex> lock(mtx);
+            if(!budget) {
+                wait_for_room(lock, [this]() { return derived().container_can_accept_any() || finished; });
+                if(finished) {
+                    throw std::runtime_error("Push to a closed container");
+                }
+                derived().emplace_into_container(std::forward<Args>(args)...);
+                record_insertion(1);
+                cv_can_remove.notify_one();
+                return;
+            }
+        }
+        push(T(std::forward<Args>(args)...));
     }
 
-    bool is_closed()
+    // Blocks until an item can be yielded. Returns std::nullopt once the
+    // container is closed and no item can be: it is empty, or (an ordered
+    // queue stopped early) the next index never arrived. Same rule as
+    // pop_batch.
+    std::optional<T> pop()
     {
         std::unique_lock<std::mutex> lock(mtx);
-        return finished;
-    }
-};
-
-
-template <typename T>
-class PriorityQueue
-{
-    struct ComparePair {
-        bool operator()(const std::pair<size_t, T>& a, const std::pair<size_t, T>& b) const
-        {
-            return a.first > b.first; // Min-heap based on the first element (priority)
+        wait_timed(lock, cv_can_remove, container_stats.pop_wait_ns,
+                   [this]() { return derived().container_can_yield() || finished; });
+        if(!derived().container_can_yield()) {
+            return std::nullopt;
         }
-    };
-    std::priority_queue<std::pair<size_t, T>,
-                        std::vector<std::pair<size_t, T>>,
-                        ComparePair> pq;
-public:
-    PriorityQueue() = default;
-    ~PriorityQueue() = default;
-    void push(size_t priority, T&& item)
-    {
-        std::pair<size_t, T> p(priority, std::move(item));
-        pq.push(std::move(p));
-    }
-    std::pair<size_t, T> pop()
-    {
-        auto item = std::move(const_cast<std::pair<size_t, T>&>(pq.top()));
-        pq.pop();
+        T item = derived().remove_from_container();
+        const size_t bytes = uncharge(item);
+        record_removal(1);
+        notify_acceptors();
+        lock.unlock();
+        release_bytes(bytes);
         return item;
     }
-    const std::pair<size_t, T>& top() const
-    {
-        return pq.top();
-    }
-    bool empty() const
+
+    // Pushes the items of range in order, moving from them, under a single
+    // lock acquisition as long as they fit; consumers are notified once
+    // for everything inserted before the next wait (if any).
+    template <typename Range>
+    void push_batch(Range&& items)
     {
-        return pq.empty();
+        std::unique_lock<std::mutex> lock(mtx);
+        size_t count = 0;
+        for(auto&& item : items) {
+            const size_t bytes = budget ? memory_footprint(item) : 0;
+            if(!finished && !admit(item, bytes)) {
+                notify_removers(count);
+                count = 0;
+                wait_for_room(lock, [this, &item, bytes]() { return finished || admit(item, bytes); });
+            }
+            if(finished) {
+                throw std::runtime_error("Push to a closed container");
+            }
+            held_bytes += bytes;
+            derived().insert_into_container(std::move(item));
+            record_insertion(1);
+            ++count;
+        }
+        notify_removers(count);
     }
-    size_t size() const
+
+    // Blocks until at least one item can be yielded, then removes up to
+    // max_n items under the same lock. Returns an empty vector once the
+    // container is closed and no item can be yielded (see pop).
+    std::vector<T> pop_batch(size_t max_n)
     {
-        return pq.size();
+        if(max_n == 0) {
+            throw std::invalid_argument("Batch size must be greater than zero");
+        }
+        std::vector<T> items;
+        std::unique_lock<std::mutex> lock(mtx);
+        wait_timed(lock, cv_can_remove, container_stats.pop_wait_ns,
+                   [this]() { return derived().container_can_yield() || finished; });
+        size_t bytes = 0;
+        while(items.size() < max_n && derived().container_can_yield()) {
+            items.push_back(derived().remove_from_container());
+            bytes += uncharge(items.back());
+        }
+        record_removal(items.size());
+        if(items.size() == 1) {
+            notify_acceptors();
+        } else if(!items.empty()) {
+            cv_can_accept.notify_all();
+        }
+        lock.unlock();
+        release_bytes(bytes);
+        return items;
     }
-};
 
-
-// A thread-safe priority queue that stores pairs of (index, value).
-// Items are pushed with an associated index and popped strictly in order of increasing index.
-// The queue blocks on pop if the next expected index is not available, ensuring no indices are skipped.
-template <typename T>
-class SyncBoundedPriorityQueue : public SyncBoundedContainer<std::pair<size_t, T>>
-{
-    using QueueElement = std::pair<size_t, T>;
-    PriorityQueue<T> pq;
-    size_t next_index = 0;
-    size_t max_size;
-
-protected:
-    inline virtual void insert_into_container(std::pair<size_t, T>&& item) override
+    // Non-blocking pop: returns std::nullopt if no item can be yielded
+    // right now (including when the container is closed and empty).
+    std::optional<T> try_pop()
     {
-        pq.push(item.first, std::move(item.second));
+        std::unique_lock<std::mutex> lock(mtx);
+        if(!derived().container_can_yield()) {
+            return std::nullopt;
+        }
+        T item = derived().remove_from_container();
+        const size_t bytes = uncharge(item);
+        record_removal(1);
+        notify_acceptors();
+        lock.unlock();
+        release_bytes(bytes);
+        return item;
     }
-    inline virtual std::pair<size_t, T> remove_from_container() override
+
+    void close()
     {
-        assert(pq.top().first == next_index);
-        ++next_index;
-        return pq.pop();
+        std::unique_lock<std::mutex> lock(mtx);
+        finished = true;
+        cv_can_accept.notify_all();
+        cv_can_remove.notify_all();
     }
-    inline virtual bool container_can_accept(const std::pair<size_t, T>& item) const override
+
+    bool is_closed()
     {
-        return pq.size() < max_size || item.first < pq.top().first;
+        std::unique_lock<std::mutex> lock(mtx);
+        return finished;
     }
-    inline virtual bool container_can_yield() const override
+
+    // Number of items as of the last push or pop, read without locking;
+    // a hint for monitoring and flow control (see adaptive_level.hpp),
+    // not a basis for synchronization.
+    inline size_t size() const
     {
-        return (!pq.empty()) && (pq.top().first == next_index);
+        return current_size.load(std::memory_order_relaxed);
     }
-    inline virtual bool container_is_empty() const override
+
+    // Safe to call while the container is in use.
+    ContainerStatsSnapshot stats() const
     {
-        return pq.empty();
+        return container_stats.snapshot();
     }
-public:
-    explicit SyncBoundedPriorityQueue(size_t max_size_ = std::numeric_limits<size_t>::max()) : max_size(max_size_) {}
-    ~SyncBoundedPriorityQueue() override = default;
 };
 
-#endif // TDF_WRITER_SYNC_BOUNDED_CONTAINER_HPP
\ No newline at end of file
+#endif // TDF_WRITER_SYNC_BOUNDED_CONTAINER_HPP
@@ -11,6 +11,7 @@
 // Usage:
 //   - Construct with a maximum size.
 //   - Use push() to add items (blocks if full).
+//   - Use emplace() to construct items in place in the buffer (blocks if full).
 //   - Use pop() to retrieve items (blocks if empty, returns std::nullopt if closed and empty).
 //   - Call close() to signal no more items will be added.
 //
@@ -24,35 +25,54 @@
 //   auto item = buf.pop();
 
 template <typename T>
-class SynchronizedBuffer : public SyncBoundedContainer<T>
+class SynchronizedBuffer : public SyncBoundedContainer<SynchronizedBuffer<T>, T>
 {
+    friend class SyncBoundedContainer<SynchronizedBuffer<T>, T>;
+
     std::deque<T> buffer;
     size_t max_size;
-protected:
-    inline void insert_into_container(T&& item) override
+
+    static constexpr bool accept_depends_on_item = false;
+
+    inline void insert_into_container(T&& item)
     {
         buffer.push_back(std::move(item));
     }
-    inline T remove_from_container() override
+    template <typename... Args>
+    inline void emplace_into_container(Args&&... args)
+    {
+        buffer.emplace_back(std::forward<Args>(args)...);
+    }
+    inline T remove_from_container()
     {
         T item = std::move(buffer.front());
         buffer.pop_front();
         return item;
     }
-    inline bool container_can_accept(const T&) const override
+    inline bool container_can_accept_any() const
     {
         return buffer.size() < max_size;
     }
-    inline bool container_can_yield() const override
+    inline bool container_can_accept(const T&) const
+    {
+        return container_can_accept_any();
+    }
+    inline bool container_can_yield() const
     {
         return !buffer.empty();
     }
-    inline bool container_is_empty() const override
+    inline bool container_is_empty() const
     {
         return buffer.empty();
     }
+    inline size_t container_size() const
+    {
+        return buffer.size();
+    }
 public:
     explicit SynchronizedBuffer(size_t max_size_) : max_size(max_size_) {}
+
+    inline size_t capacity() const { return max_size; }
 };
 
-#endif // TDF_WRITER_SYNC_BUFFER_HPP
\ No newline at end of file
+#endif // TDF_WRITER_SYNC_BUFFER_HPP
@@ -0,0 +1,145 @@
+#ifndef TDF_WRITER_TDF_COLLECTOR_HPP
+#define TDF_WRITER_TDF_COLLECTOR_HPP
+
+#include <algorithm>
+#include <exception>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dispatcher.hpp"
+#include "file_collector.hpp"
+#include "metadata_writer.hpp"
+#include "sync_buffer.hpp"
+#include "tdf_compressor.hpp"
+
+
+// Reducer writing a complete TDF pair: the compressed blocks go to
+// analysis.tdf_bin through a FileCollector, and each block's metadata row,
+// with TimsId set to the block offset, goes to analysis.tdf.
+//
+// The SQLite inserts run on their own thread, fed in job order through a
+// bounded buffer, so the metadata stage overlaps with the binary writes
+// instead of adding to the reducer thread's work.
+//
+// Checkpoints (see FileCollector) cover analysis.tdf_bin; on resume the
+// Frames rows committed to analysis.tdf, which may lag behind the binary
+// checkpoint, limit how many frames are kept, and both files are trimmed
+// back to the same frame.
+class TdfCollector : public Reducer<TdfBlock>
+{
+    SqliteFrameWriter metadata;
+    FileCollector binary;
+    SynchronizedBuffer<FrameMetadata> metadata_queue;
+    std::thread metadata_thread;
+    std::exception_ptr metadata_error;
+    std::vector<const SimpleBuffer<char>*> pending;
+
+    static CheckpointOptions limit_resume(CheckpointOptions checkpoint, size_t rows)
+    {
+        checkpoint.resume_limit = std::min(checkpoint.resume_limit, rows);
+        return checkpoint;
+    }
+
+    void stop_metadata_thread()
+    {
+        metadata_queue.close();
+        if(metadata_thread.joinable()) {
+            metadata_thread.join();
+        }
+    }
+
+public:
+    static constexpr size_t default_metadata_queue_size = 4096;
+
+    TdfCollector(const std::string& bin_filename,
+                 const std::string& tdf_filename,
+                 size_t metadata_batch_size = 10000,
+                 size_t metadata_queue_size = default_metadata_queue_size,
+                 const FileWriterOptions& binary_options = {},
+                 const CheckpointOptions& checkpoint = {})
+        : metadata(tdf_filename, metadata_batch_size, checkpoint.resume),
+          binary(bin_filename, binary_options, limit_resume(checkpoint, metadata.rows_written())),
+          metadata_queue(metadata_queue_size)
+    {
+        if(checkpoint.resume) {
+            metadata.discard_rows_after(binary.resumed_blocks());
+        }
+        // The SQLite writes go to the same drive as the binary ones.
+        metadata_thread = std::thread([this, cpus = binary_options.writer_cpus]() {
+            try {
+                pin_current_thread(cpus);
+                while(true) {
+                    auto row = metadata_queue.pop();
+                    if(!row.has_value()) break;
+                    metadata.reduce(row.value());
+                }
+                metadata.finish();
+            } catch(...) {
+                metadata_error = std::current_exception();
+                metadata_queue.close();
+            }
+        });
+    }
+
+    TdfCollector(const TdfCollector&) = delete;
+    TdfCollector& operator=(const TdfCollector&) = delete;
+    TdfCollector(TdfCollector&&) = delete;
+    TdfCollector& operator=(TdfCollector&&) = delete;
+
+    void reduce(const TdfBlock& block) override
+    {
+        reduce_batch(std::span<const TdfBlock>(&block, 1));
+    }
+
+    void reduce_batch(std::span<const TdfBlock> blocks) override
+    {
+        pending.clear();
+        for(const TdfBlock& block : blocks) {
+            pending.push_back(&block.data);
+        }
+        const size_t first = binary.block_index().size();
+        binary.write_blocks(pending);
+        for(size_t i = 0; i < blocks.size(); ++i) {
+            FrameMetadata row = blocks[i].metadata;
+            row.tims_id = binary.block_index()[first + i].offset;
+            try {
+                metadata_queue.push(std::move(row));
+            } catch(const std::runtime_error&) {
+                // The metadata thread closes the queue when it fails;
+                // report why rather than the closed queue.
+                if(metadata_error) {
+                    std::rethrow_exception(metadata_error);
+                }
+                throw;
+            }
+        }
+    }
+
+    // Finishes the binary file, then waits for the metadata thread to
+    // commit the remaining rows and build the indices.
+    void finish() override
+    {
+        binary.finish();
+        stop_metadata_thread();
+        if(metadata_error) {
+            std::rethrow_exception(metadata_error);
+        }
+        binary.remove_checkpoint();
+    }
+
+    // Frames already on disk when resuming, see FileCollector.
+    inline size_t resumed_frames() const { return binary.resumed_blocks(); }
+
+    // Only safe to use once the producing Dispatcher has been closed.
+    inline const FileCollector& binary_collector() const { return binary; }
+    inline const SqliteFrameWriter& metadata_writer() const { return metadata; }
+
+    ~TdfCollector()
+    {
+        stop_metadata_thread();
+    }
+};
+
+#endif // TDF_WRITER_TDF_COLLECTOR_HPP
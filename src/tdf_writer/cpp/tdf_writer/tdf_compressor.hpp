@@ -0,0 +1,301 @@
+#ifndef TDF_WRITER_TDF_COMPRESSOR_HPP
+#define TDF_WRITER_TDF_COMPRESSOR_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <zstd.h>
+
+#include "adaptive_level.hpp"
+#include "dispatcher.hpp"
+#include "frame.hpp"
+#include "simple_buffer.hpp"
+#include "simd_kernels.hpp"
+#include "zstd_dictionary.hpp"
+
+
+// Mapper turning one Frame into a ready-to-write analysis.tdf_bin block.
+//
+// Block layout (all integers little-endian uint32):
+//   [total block size in bytes, including this 8-byte header]
+//   [number of scans]
+//   [zstd-compressed payload]
+//
+// The uncompressed payload is num_scans + 2 * num_peaks uint32 values:
+//   payload[0]                  = num_scans
+//   payload[1 .. num_scans)     = 2 * (number of peaks in scan i-1)
+//   payload[num_scans + 2*p]    = TOF index of peak p, delta-encoded within
+//                                 its scan (first peak of a scan stores tof+1)
+//   payload[num_scans + 2*p + 1]= intensity of peak p
+// The peak count of the last scan is implied by the payload length.
+// Before compression the payload is byte-shuffled: all lowest bytes first,
+// then all second bytes, and so on. Both steps run on the vectorized
+// kernels of simd_kernels.hpp.
+//
+// A frame with no scans is written as a bare header.
+//
+// Each instance owns a ZSTD compression context and scratch buffers that
+// are reused across frames, so an instance must not be used by several
+// threads at once: give every mapper thread its own compressor through
+// Dispatcher's mapper-factory constructor.
+//
+// Frames are compressed into a scratch buffer and copied out into blocks
+// of their compressed size from a BufferPool, which get recycled once the
+// reducer has written and dropped them. By default every compressor has
+// its own pool; pass one to share it.
+//
+// Given an AdaptiveCompressionLevel, the level is taken from it for every
+// frame instead of being fixed.
+//
+// Given a SharedZstdDictionary, frames are compressed with it once it has
+// been trained, and offered to it as training samples before that.
+class TdfFrameCompressor : public Mapper<Frame, SimpleBuffer<char>>
+{
+    struct CCtxDeleter {
+        void operator()(ZSTD_CCtx* ctx) const { ZSTD_freeCCtx(ctx); }
+    };
+
+    int compression_level;
+    std::shared_ptr<AdaptiveCompressionLevel> adaptive_level;
+    std::shared_ptr<SharedZstdDictionary> dictionary;
+    // Digested dictionary for cdict_level, looked up again on level changes.
+    const ZSTD_CDict* cdict = nullptr;
+    int cdict_level = 0;
+    std::unique_ptr<ZSTD_CCtx, CCtxDeleter> cctx;
+    std::shared_ptr<BufferPool<char>> pool;
+    std::vector<uint32_t> payload;
+    std::vector<char> shuffled;
+    // Worst-case sized output of the last compression; only the compressed
+    // bytes are copied into the pooled block, so that the block's footprint
+    // (what a MemoryBudget is charged) follows the compressed size.
+    std::vector<char> compressed;
+
+    // The shared dictionary digested for level, or nullptr to compress
+    // without one.
+    const ZSTD_CDict* dictionary_for(int level)
+    {
+        if(!dictionary) {
+            return nullptr;
+        }
+        if(!cdict || cdict_level != level) {
+            cdict = dictionary->cdict(level);
+            cdict_level = level;
+        }
+        return cdict;
+    }
+
+public:
+    static constexpr size_t header_size = 2 * sizeof(uint32_t);
+
+    explicit TdfFrameCompressor(int compression_level_ = 1,
+                                std::shared_ptr<BufferPool<char>> pool_ = nullptr,
+                                std::shared_ptr<AdaptiveCompressionLevel> adaptive_level_ = nullptr,
+                                std::shared_ptr<SharedZstdDictionary> dictionary_ = nullptr)
+        : compression_level(compression_level_),
+          adaptive_level(std::move(adaptive_level_)),
+          dictionary(std::move(dictionary_)),
+          cctx(ZSTD_createCCtx()),
+          pool(pool_ ? std::move(pool_) : std::make_shared<BufferPool<char>>())
+    {
+        if(!cctx) {
+            throw std::bad_alloc();
+        }
+    }
+
+    using Mapper<Frame, SimpleBuffer<char>>::map;
+
+    SimpleBuffer<char> map(const Frame& frame) override
+    {
+        return compress(frame.scan_offsets, frame.tof_indices, frame.intensities);
+    }
+
+    // Frees the peak data as soon as it is compressed rather than when the
+    // mapper is done with its whole batch.
+    SimpleBuffer<char> map(Frame&& frame) override
+    {
+        const Frame consumed = std::move(frame);
+        return map(consumed);
+    }
+
+    SimpleBuffer<char> compress(std::span<const uint32_t> scan_offsets,
+                                std::span<const uint32_t> tof_indices,
+                                std::span<const uint32_t> intensities)
+    {
+        const size_t num_scans = validate(scan_offsets, tof_indices, intensities);
+
+        if(num_scans == 0) {
+            SimpleBuffer<char> block(header_size, pool);
+            write_header(block.data(), header_size, 0);
+            return block;
+        }
+
+        payload.resize(num_scans + 2 * tof_indices.size());
+        encode_payload(scan_offsets, tof_indices, intensities, payload.data());
+
+        shuffled.resize(payload.size() * sizeof(uint32_t));
+        byte_shuffle(payload.data(), payload.size(), shuffled.data());
+
+        const int level = adaptive_level ? adaptive_level->level() : compression_level;
+        const ZSTD_CDict* digested = dictionary_for(level);
+        compressed.resize(ZSTD_compressBound(shuffled.size()));
+        size_t compressed_size = digested
+            ? ZSTD_compress_usingCDict(cctx.get(), compressed.data(), compressed.size(),
+                                       shuffled.data(), shuffled.size(), digested)
+            : ZSTD_compressCCtx(cctx.get(), compressed.data(), compressed.size(),
+                                shuffled.data(), shuffled.size(), level);
+        if(ZSTD_isError(compressed_size)) {
+            throw std::runtime_error(std::string("ZSTD compression failed: ") + ZSTD_getErrorName(compressed_size));
+        }
+        if(dictionary && !digested) {
+            dictionary->add_sample(shuffled.data(), shuffled.size());
+        }
+
+        const size_t block_size = header_size + compressed_size;
+        SimpleBuffer<char> block(block_size, pool);
+        write_header(block.data(), block_size, num_scans);
+        std::memcpy(block.data() + header_size, compressed.data(), compressed_size);
+        return block;
+    }
+
+    // Checks frame consistency and returns the number of scans.
+    static size_t validate(std::span<const uint32_t> scan_offsets,
+                           std::span<const uint32_t> tof_indices,
+                           std::span<const uint32_t> intensities)
+    {
+        if(tof_indices.size() != intensities.size()) {
+            throw std::invalid_argument("TOF indices and intensities must have the same length");
+        }
+        if(scan_offsets.empty()) {
+            if(!tof_indices.empty()) {
+                throw std::invalid_argument("Frame without scans cannot contain peaks");
+            }
+            return 0;
+        }
+        if(scan_offsets.front() != 0 || scan_offsets.back() != tof_indices.size()) {
+            throw std::invalid_argument("Scan offsets must start at 0 and end at the number of peaks");
+        }
+        for(size_t i = 1; i < scan_offsets.size(); ++i) {
+            if(scan_offsets[i] < scan_offsets[i-1]) {
+                throw std::invalid_argument("Scan offsets must be non-decreasing");
+            }
+        }
+        const size_t num_scans = scan_offsets.size() - 1;
+        if(num_scans + 2 * tof_indices.size() > std::numeric_limits<uint32_t>::max() / sizeof(uint32_t)) {
+            throw std::invalid_argument("Frame too large for a TDF block");
+        }
+        return num_scans;
+    }
+
+    static void encode_payload(std::span<const uint32_t> scan_offsets,
+                               std::span<const uint32_t> tof_indices,
+                               std::span<const uint32_t> intensities,
+                               uint32_t* payload)
+    {
+        const size_t num_scans = scan_offsets.size() - 1;
+        payload[0] = static_cast<uint32_t>(num_scans);
+        for(size_t scan = 1; scan < num_scans; ++scan) {
+            payload[scan] = 2 * (scan_offsets[scan] - scan_offsets[scan-1]);
+        }
+
+        // Deltas are taken across the whole frame in one vectorized pass;
+        // then the first peak of every scan is rebased to tof+1.
+        uint32_t* peaks = payload + num_scans;
+        simd_kernels().delta_interleave(tof_indices.data(), intensities.data(), tof_indices.size(), peaks);
+        for(size_t scan = 0; scan < num_scans; ++scan) {
+            const size_t first = scan_offsets[scan];
+            if(first < scan_offsets[scan+1]) {
+                peaks[2*first] = tof_indices[first] + 1;
+            }
+        }
+    }
+
+    static void byte_shuffle(const uint32_t* values, size_t count, char* out)
+    {
+        simd_kernels().byte_shuffle4(values, count, out);
+    }
+
+    static void write_header(char* block, size_t block_size, size_t num_scans)
+    {
+        if(block_size > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("Compressed TDF block exceeds 4 GiB");
+        }
+        const uint32_t header[2] = { static_cast<uint32_t>(block_size), static_cast<uint32_t>(num_scans) };
+        for(size_t i = 0; i < 2; ++i) {
+            for(size_t b = 0; b < sizeof(uint32_t); ++b) {
+                block[i * sizeof(uint32_t) + b] = static_cast<char>((header[i] >> (8 * b)) & 0xFF);
+            }
+        }
+    }
+};
+
+
+// A compressed analysis.tdf_bin block together with its Frames table row.
+struct TdfBlock
+{
+    SimpleBuffer<char> data;
+    FrameMetadata metadata;
+
+    inline size_t memory_footprint() const { return sizeof(metadata) + data.memory_footprint(); }
+};
+
+
+// Mapper producing both the binary block and the frame's metadata row:
+// the acquisition fields are taken from the frame, the peak statistics are
+// computed here. Like TdfFrameCompressor it is not thread-safe.
+//
+// Frame_t is Frame or FrameView (anything exposing the same members).
+template <typename Frame_t>
+class BasicTdfFrameMapper : public Mapper<Frame_t, TdfBlock>
+{
+    TdfFrameCompressor compressor;
+
+public:
+    explicit BasicTdfFrameMapper(int compression_level_ = 1,
+                                 std::shared_ptr<AdaptiveCompressionLevel> adaptive_level = nullptr,
+                                 std::shared_ptr<SharedZstdDictionary> dictionary = nullptr)
+        : compressor(compression_level_, nullptr, std::move(adaptive_level), std::move(dictionary))
+    {}
+
+    using Mapper<Frame_t, TdfBlock>::map;
+
+    TdfBlock map(const Frame_t& frame) override
+    {
+        TdfBlock block{compressor.compress(frame.scan_offsets, frame.tof_indices, frame.intensities), frame.metadata};
+        fill_statistics(block.metadata, frame.num_scans(), frame.intensities);
+        return block;
+    }
+
+    // As TdfFrameCompressor: the peak data, or a view's keep_alive, is let
+    // go of right after compression.
+    TdfBlock map(Frame_t&& frame) override
+    {
+        const Frame_t consumed = std::move(frame);
+        return map(consumed);
+    }
+
+    static void fill_statistics(FrameMetadata& metadata, size_t num_scans, std::span<const uint32_t> intensities)
+    {
+        uint64_t max_intensity = 0;
+        uint64_t summed_intensities = 0;
+        for(uint32_t intensity : intensities) {
+            max_intensity = std::max<uint64_t>(max_intensity, intensity);
+            summed_intensities += intensity;
+        }
+        metadata.num_scans = static_cast<uint32_t>(num_scans);
+        metadata.num_peaks = static_cast<uint32_t>(intensities.size());
+        metadata.max_intensity = max_intensity;
+        metadata.summed_intensities = summed_intensities;
+    }
+};
+
+using TdfFrameMapper = BasicTdfFrameMapper<Frame>;
+using TdfFrameViewMapper = BasicTdfFrameMapper<FrameView>;
+
+#endif // TDF_WRITER_TDF_COMPRESSOR_HPP
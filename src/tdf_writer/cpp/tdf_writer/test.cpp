@@ -1,14 +1,94 @@
 #include "dispatcher.hpp"
 #include "file_collector.hpp"
+#include "memory_budget.hpp"
+#include "offset_writer.hpp"
+#include "ordered_queue.hpp"
+#include "tdf_compressor.hpp"
+#include "worker_pool.hpp"
 
 #include <iostream>
-#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iterator>
 #include <thread>
 #include <memory>
+#include <mutex>
 #include <random>
-#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdlib>
 
 
+// Unlike assert, stays on with NDEBUG.
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+inline void check(bool ok, const char* what, const char* file, int line)
+{
+    if(!ok) {
+        std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+        std::abort();
+    }
+}
+
+// Holds the threads calling wait() until open() is called, so that a test
+// can keep a pipeline stage busy without sleeping.
+class Gate
+{
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool is_open = false;
+
+public:
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this]() { return is_open; });
+    }
+
+    void open()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            is_open = true;
+        }
+        cv.notify_all();
+    }
+};
+
+static std::vector<char> read_file(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(file), {});
+}
+
+// Synthetic frames with a fixed seed, sparse like real PASEF frames.
+static std::vector<Frame> make_frames(size_t count)
+{
+    std::mt19937 rng(42);
+    std::vector<Frame> frames(count);
+    for(Frame& frame : frames) {
+        std::uniform_int_distribution<uint32_t> peaks_per_scan(0, 3);
+        std::uniform_int_distribution<uint32_t> tof(0, 400000);
+        std::geometric_distribution<uint32_t> intensity(0.05);
+        frame.scan_offsets.push_back(0);
+        for(size_t scan = 0; scan < 200; ++scan) {
+            const size_t first = frame.tof_indices.size();
+            for(uint32_t peak = peaks_per_scan(rng); peak > 0; --peak) {
+                frame.tof_indices.push_back(tof(rng));
+                frame.intensities.push_back(intensity(rng) + 1);
+            }
+            std::sort(frame.tof_indices.begin() + first, frame.tof_indices.end());
+            frame.scan_offsets.push_back(static_cast<uint32_t>(frame.tof_indices.size()));
+        }
+    }
+    return frames;
+}
+
 
 class simpleTestDispatcher
 {
@@ -16,49 +96,576 @@ public:
     class simpleMapper : public Mapper<int, SimpleBuffer<char>>
     {
     public:
+        static constexpr bool thread_safe = true;
+
+        using Mapper<int, SimpleBuffer<char>>::map;
+
         SimpleBuffer<char> map(const int& input) override
         {
-            auto sleep_duration = std::chrono::milliseconds(rand() % 100);
-            std::cout << "Mapping: " << input << " (sleep " << sleep_duration.count() << " ms)" << std::endl;
-            std::this_thread::sleep_for(sleep_duration);
-            std::vector<char> output;
-            output.push_back(static_cast<char>(input % 256));
-            SimpleBuffer<char> buffer(output.data(), output.size());
-            return std::move(buffer);
+            const char output = static_cast<char>(input % 256);
+            return SimpleBuffer<char>(&output, 1);
         }
     };
 
-    /*class simpleReducer : public Reducer<int>
+    void run()
     {
-        int counter = 0;
-    public:
-        void reduce(const int& input) override
+        auto mapper = std::make_unique<simpleMapper>();
+        auto reducer = std::make_unique<FileCollector>("output.bin");
+
+        DispatcherOptions options;
+        options.input_buffer_size = 10;
+        options.mapper_affinity = AffinityPolicy::compact;
+        Dispatcher<simpleMapper, FileCollector> dispatcher(std::move(mapper), std::move(reducer), options);
+
+        for(int i = 0; i < 1000; ++i) {
+            dispatcher.add_input(i);
+        }
+        dispatcher.close();
+
+        const std::vector<char> written = read_file("output.bin");
+        CHECK(written.size() == 1000);
+        for(int i = 0; i < 1000; ++i) {
+            CHECK(written[i] == static_cast<char>(i % 256));
+        }
+        std::remove("output.bin");
+        std::cout << "Dispatcher OK" << std::endl;
+    }
+};
+
+// A resume that keeps fewer blocks than were checkpointed (as TdfCollector
+// does when analysis.tdf has fewer rows) must leave a checkpoint that can
+// be resumed from again if the process dies before its next commit.
+class checkpointResumeTest
+{
+public:
+    void run()
+    {
+        const std::string filename = "resume.bin";
+        CheckpointOptions checkpoint;
+        checkpoint.interval = 2;
+        {
+            FileCollector collector(filename, {}, checkpoint);
+            for(int i = 0; i < 10; ++i) {
+                std::vector<char> data(100 + i, static_cast<char>(i));
+                collector.reduce(SimpleBuffer<char>(data.data(), data.size()));
+            }
+            collector.finish();
+        }
+        CHECK(FileCheckpoint::load(FileCollector::checkpoint_path(filename))->blocks() == 10);
+
+        checkpoint.resume = true;
+        checkpoint.resume_limit = 4;
         {
-            assert(input == counter++);
-            std::cout << "Reduced: " << input << std::endl;
+            FileCollector resumed(filename, {}, checkpoint);
+            CHECK(resumed.resumed_blocks() == 4);
+            // What a crash right now would leave on disk.
+            auto on_disk = FileCheckpoint::load(FileCollector::checkpoint_path(filename));
+            CHECK(on_disk && on_disk->blocks() == 4 && on_disk->bytes() == 100 + 101 + 102 + 103);
+        }
+
+        checkpoint.resume_limit = SIZE_MAX;
+        FileCollector again(filename, {}, checkpoint);
+        CHECK(again.resumed_blocks() == 4);
+        again.finish();
+        again.remove_checkpoint();
+        std::remove(filename.c_str());
+        std::cout << "Capped resume OK" << std::endl;
+    }
+};
+
+
+// Mapper failing on one input, and a reducer that can be held in its
+// first reduce() to fill the pipeline up behind it.
+class IntMapper : public Mapper<int, int>
+{
+    int failing;
+
+public:
+    explicit IntMapper(int failing_ = -1) : failing(failing_) {}
+
+    using Mapper<int, int>::map;
+
+    int map(const int& input) override
+    {
+        if(input == failing) {
+            throw std::runtime_error("Mapper failed on " + std::to_string(input));
         }
-    };*/
+        return input;
+    }
+};
+
+class IntReducer : public Reducer<int>
+{
+    Gate* gate;
+    std::promise<void>* entered;
+
+public:
+    std::vector<int> reduced;
 
+    explicit IntReducer(Gate* gate_ = nullptr, std::promise<void>* entered_ = nullptr)
+        : gate(gate_), entered(entered_) {}
+
+    void reduce(const int& input) override
+    {
+        if(reduced.empty()) {
+            if(entered) entered->set_value();
+            if(gate) gate->wait();
+        }
+        reduced.push_back(input);
+    }
+};
+
+using IntDispatcher = Dispatcher<IntMapper, IntReducer, SynchronizedBuffer, SyncReorderWindow>;
+
+static DispatcherOptions small_pipeline()
+{
+    DispatcherOptions options;
+    options.num_mapper_threads = 2;
+    options.input_buffer_size = 4;
+    options.reorder_window_size = 4;
+    return options;
+}
+
+// A mapper's exception stops the pipeline and reaches add_input and
+// close(); cancel() unblocks a producer waiting on a full pipeline.
+class errorPropagationTest
+{
+public:
     void run()
     {
-        auto mapper = std::make_unique<simpleMapper>();
-        auto reducer = std::make_unique<FileCollector>("output.bin");
+        {
+            // One IntMapper cannot be shared by several mapper threads.
+            bool rejected = false;
+            try {
+                IntDispatcher shared(std::make_unique<IntMapper>(), std::make_unique<IntReducer>(), small_pipeline());
+            } catch(const std::invalid_argument&) {
+                rejected = true;
+            }
+            CHECK(rejected);
+        }
+        {
+            IntDispatcher dispatcher([]() { return std::make_unique<IntMapper>(50); },
+                                     std::make_unique<IntReducer>(), small_pipeline());
+            bool add_threw = false;
+            try {
+                for(int i = 0; i < 100000; ++i) {
+                    dispatcher.add_input(i);
+                }
+            } catch(const std::runtime_error& e) {
+                add_threw = std::string(e.what()) == "Mapper failed on 50";
+            }
+            CHECK(add_threw);
+            for(int attempt = 0; attempt < 2; ++attempt) {
+                bool close_threw = false;
+                try {
+                    dispatcher.close();
+                } catch(const std::runtime_error& e) {
+                    close_threw = std::string(e.what()) == "Mapper failed on 50";
+                }
+                CHECK(close_threw);
+            }
+            const std::vector<int>& reduced = dispatcher.get_reducer().reduced;
+            CHECK(reduced.size() <= 50);
+            for(size_t i = 0; i < reduced.size(); ++i) {
+                CHECK(reduced[i] == static_cast<int>(i));
+            }
+        }
+        {
+            Gate gate;
+            std::promise<void> entered;
+            IntDispatcher dispatcher([]() { return std::make_unique<IntMapper>(); },
+                                     std::make_unique<IntReducer>(&gate, &entered), small_pipeline());
+            dispatcher.add_input(0);
+            entered.get_future().wait();
+            int next = 1;
+            while(dispatcher.try_add_input(next)) {
+                ++next;
+            }
+            // Mappers may still free a slot or two; the producer keeps
+            // adding until the pipeline is full and it blocks.
+            std::promise<bool> producer_threw;
+            std::thread producer([&]() {
+                try {
+                    for(int i = 0; i < 1000; ++i) {
+                        dispatcher.add_input(next);
+                        ++next;
+                    }
+                    producer_threw.set_value(false);
+                } catch(const std::runtime_error&) {
+                    producer_threw.set_value(true);
+                }
+            });
+            std::thread canceller([&]() { dispatcher.cancel(); });
+            // The reducer is still held: only cancel() can have let the
+            // producer go.
+            CHECK(producer_threw.get_future().get());
+            producer.join();
+            gate.open();
+            canceller.join();
+            CHECK(dispatcher.is_closed());
+            CHECK(dispatcher.get_reducer().reduced.size() < static_cast<size_t>(next));
+            dispatcher.close();
+            bool add_threw = false;
+            try {
+                dispatcher.add_input(0);
+            } catch(const std::runtime_error&) {
+                add_threw = true;
+            }
+            CHECK(add_threw);
+        }
+        std::cout << "Error propagation and cancel OK" << std::endl;
+    }
+};
 
-        Dispatcher<simpleMapper, FileCollector> dispatcher(std::move(mapper), std::move(reducer), 10, 100);
+// A closed ordered queue whose next index never arrived yields nothing,
+// from pop() as from pop_batch(), rather than a later item.
+class orderedQueueGapTest
+{
+    template <template <typename> class Queue_t>
+    void check_gap()
+    {
+        Queue_t<int> gap(4);
+        gap.push({1, 11});
+        gap.push({2, 12});
+        gap.close();
+        CHECK(!gap.try_pop().has_value());
+        CHECK(!gap.pop().has_value());
+        CHECK(gap.pop_batch(4).empty());
 
+        Queue_t<int> complete(4);
+        complete.push({1, 11});
+        complete.push({0, 10});
+        complete.close();
+        auto first = complete.pop();
+        CHECK(first && first->first == 0 && first->second == 10);
+        auto second = complete.pop();
+        CHECK(second && second->first == 1 && second->second == 11);
+        CHECK(!complete.pop().has_value());
+    }
 
-        for(int i = 0; i < 1000; ++i) {
-            std::cout << "Adding input: " << i << std::endl;
-            dispatcher.add_input(i);
+public:
+    void run()
+    {
+        check_gap<SyncBoundedPriorityQueue>();
+        check_gap<SyncReorderWindow>();
+        std::cout << "Ordered queue gap OK" << std::endl;
+    }
+};
+
+// Offset-ordered output, written by the mapper threads at precomputed
+// offsets, must be the same file as the one the single writer produces.
+class offsetOrderedTest
+{
+public:
+    void run()
+    {
+        const std::vector<Frame> frames = make_frames(300);
+        DispatcherOptions options;
+        options.num_mapper_threads = 4;
+
+        std::vector<BlockLocation> single_index;
+        {
+            Dispatcher<TdfFrameCompressor, FileCollector, SynchronizedBuffer, SyncReorderWindow> dispatcher(
+                []() { return std::make_unique<TdfFrameCompressor>(); },
+                std::make_unique<FileCollector>("single.bin"), options);
+            for(const Frame& frame : frames) {
+                dispatcher.add_input(frame);
+            }
+            dispatcher.close();
+            single_index = dispatcher.get_reducer().block_index();
         }
 
+        std::vector<BlockLocation> offset_index;
+        {
+            auto file = std::make_shared<ParallelFileWriter>("offset.bin");
+            Dispatcher<OffsetWritingMapper<TdfFrameCompressor>, OffsetFileCollector, SynchronizedBuffer, SyncReorderWindow>
+                dispatcher([&file]() {
+                               return std::make_unique<OffsetWritingMapper<TdfFrameCompressor>>(
+                                   std::make_unique<TdfFrameCompressor>(), file);
+                           },
+                           std::make_unique<OffsetFileCollector>(file), options);
+            for(const Frame& frame : frames) {
+                dispatcher.add_input(frame);
+            }
+            dispatcher.close();
+            offset_index = dispatcher.get_reducer().block_index();
+        }
+
+        const std::vector<char> single = read_file("single.bin");
+        const std::vector<char> offset = read_file("offset.bin");
+        CHECK(!single.empty());
+        CHECK(single == offset);
+        CHECK(single_index.size() == frames.size() && offset_index.size() == frames.size());
+        for(size_t i = 0; i < frames.size(); ++i) {
+            CHECK(single_index[i].offset == offset_index[i].offset && single_index[i].size == offset_index[i].size);
+        }
+        std::remove("single.bin");
+        std::remove("offset.bin");
+        std::cout << "Offset-ordered output OK" << std::endl;
+    }
+};
+
+
+class CopyMapper : public Mapper<SimpleBuffer<char>, SimpleBuffer<char>>
+{
+public:
+    using Mapper<SimpleBuffer<char>, SimpleBuffer<char>>::map;
+
+    SimpleBuffer<char> map(const SimpleBuffer<char>& input) override
+    {
+        return SimpleBuffer<char>(input.data(), input.size());
+    }
+};
+
+// Checks that blocks arrive in order (each is filled with its index) and
+// can be held in its first reduce() like IntReducer.
+class BlockReducer : public Reducer<SimpleBuffer<char>>
+{
+    Gate* gate;
+
+public:
+    size_t reduced = 0;
+
+    explicit BlockReducer(Gate* gate_ = nullptr) : gate(gate_) {}
+
+    void reduce(const SimpleBuffer<char>& block) override
+    {
+        if(reduced == 0 && gate) {
+            gate->wait();
+        }
+        CHECK(block.size() > 0 && block.data()[0] == static_cast<char>(reduced % 128));
+        ++reduced;
+    }
+};
+
+static SimpleBuffer<char> make_block(size_t index, size_t size)
+{
+    SimpleBuffer<char> block(size);
+    std::memset(block.data(), static_cast<int>(index % 128), size);
+    return block;
+}
+
+// Counts blocks, holding the reducer thread in its first reduce().
+class HeldReducer : public Reducer<SimpleBuffer<char>>
+{
+    Gate& gate;
+
+public:
+    size_t reduced = 0;
+
+    explicit HeldReducer(Gate& gate_) : gate(gate_) {}
+
+    void reduce(const SimpleBuffer<char>&) override
+    {
+        if(reduced++ == 0) {
+            gate.wait();
+        }
+    }
+};
+
+// A memory budget bounds what a pipeline holds however large its items
+// are, and is charged for compressed blocks by their compressed size. On
+// a worker pool, results a stream has no budget for are parked instead of
+// holding the worker, so another stream keeps going while the first one's
+// reducer is stuck.
+class memoryBudgetTest
+{
+    // Highly compressible: evenly spaced peaks of equal intensity.
+    static Frame regular_frame()
+    {
+        Frame frame;
+        frame.scan_offsets.push_back(0);
+        for(uint32_t scan = 0; scan < 200; ++scan) {
+            for(uint32_t peak = 0; peak < 100; ++peak) {
+                frame.tof_indices.push_back(1000 + 10 * peak);
+                frame.intensities.push_back(5);
+            }
+            frame.scan_offsets.push_back(static_cast<uint32_t>(frame.tof_indices.size()));
+        }
+        return frame;
+    }
+
+    void check_compressed_sizes()
+    {
+        const Frame frame = regular_frame();
+        TdfFrameCompressor compressor;
+        const size_t result_bytes = memory_footprint(std::pair<size_t, SimpleBuffer<char>>(0, compressor.map(frame)));
+        const size_t frame_bytes = memory_footprint(frame);
+        CHECK(result_bytes * 20 < frame_bytes);
+
+        // With the reducer held, the results pile up in the reorder window
+        // while the inputs go through one or two at a time.
+        const size_t frames = 50;
+        auto budget = std::make_shared<MemoryBudget>(size_t(1) << 30);
+        DispatcherOptions options;
+        options.num_mapper_threads = 1;
+        options.input_buffer_size = 1;
+        options.reorder_window_size = frames;
+        options.memory_budget = budget;
+        Gate gate;
+        Dispatcher<TdfFrameCompressor, HeldReducer, SynchronizedBuffer, SyncReorderWindow> dispatcher(
+            []() { return std::make_unique<TdfFrameCompressor>(); }, std::make_unique<HeldReducer>(gate), options);
+        for(size_t i = 0; i < frames; ++i) {
+            dispatcher.add_input(frame);
+        }
+        gate.open();
         dispatcher.close();
+        CHECK(dispatcher.get_reducer().reduced == frames);
+        CHECK(budget->used_bytes() == 0);
+        CHECK(budget->peak_bytes() <= 3 * frame_bytes + frames * result_bytes);
+    }
+
+public:
+    void run()
+    {
+        check_compressed_sizes();
+        {
+            const size_t limit = 100000;
+            auto budget = std::make_shared<MemoryBudget>(limit);
+            DispatcherOptions options = small_pipeline();
+            options.input_buffer_size = 1000;
+            options.reorder_window_size = 1000;
+            options.memory_budget = budget;
+            Dispatcher<CopyMapper, BlockReducer, SynchronizedBuffer, SyncReorderWindow> dispatcher(
+                []() { return std::make_unique<CopyMapper>(); }, std::make_unique<BlockReducer>(), options);
+            std::mt19937 rng(7);
+            size_t biggest = 0;
+            for(size_t i = 0; i < 2000; ++i) {
+                const size_t size = 1 + rng() % (i % 100 == 0 ? 60000 : 5000);
+                biggest = std::max(biggest, size);
+                dispatcher.add_input(make_block(i, size));
+            }
+            dispatcher.close();
+            CHECK(dispatcher.get_reducer().reduced == 2000);
+            CHECK(budget->used_bytes() == 0);
+            // Over the limit by at most one item for each of the two stages.
+            const size_t slack = 2 * memory_footprint(std::pair<size_t, SimpleBuffer<char>>(0, SimpleBuffer<char>(biggest)));
+            CHECK(budget->peak_bytes() <= limit + slack);
+        }
+        {
+            auto pool = std::make_shared<WorkerPool>(1);
+            auto slow_budget = std::make_shared<MemoryBudget>(5000);
+            Gate gate;
+            PooledStream<CopyMapper, BlockReducer> slow(
+                pool, []() { return std::make_unique<CopyMapper>(); }, std::make_unique<BlockReducer>(&gate),
+                100, 100, 0, slow_budget);
+            PooledStream<CopyMapper, BlockReducer> fast(
+                pool, []() { return std::make_unique<CopyMapper>(); }, std::make_unique<BlockReducer>());
+            std::thread feeder([&]() {
+                for(size_t i = 0; i < 50; ++i) {
+                    slow.add_input(make_block(i, 1000));
+                }
+            });
+            for(size_t i = 0; i < 2000; ++i) {
+                fast.add_input(make_block(i, 1000));
+            }
+            // Only completes if the pool's single worker is not stuck on
+            // the slow stream, whose reducer is still held.
+            fast.close();
+            CHECK(fast.get_reducer().reduced == 2000);
+            gate.open();
+            feeder.join();
+            slow.close();
+            CHECK(slow.get_reducer().reduced == 50);
+            CHECK(slow_budget->used_bytes() == 0);
+        }
+        std::cout << "Memory budget OK" << std::endl;
+    }
+};
+
+// try_add_input never blocks, on_space calls back once there may be room,
+// and close_async reports completion with the pipeline's error.
+class producerApiTest
+{
+public:
+    void run()
+    {
+        {
+            Gate gate;
+            std::promise<void> entered;
+            IntDispatcher dispatcher([]() { return std::make_unique<IntMapper>(); },
+                                     std::make_unique<IntReducer>(&gate, &entered), small_pipeline());
+            CHECK(dispatcher.try_add_input(0));
+            entered.get_future().wait();
+            int next = 1;
+            while(dispatcher.try_add_input(next)) {
+                ++next;
+            }
+            // Input buffer, reorder window and the mappers' hands are full.
+            CHECK(next > 1 && next < 100);
+
+            // Registered while full, called once the reducer lets go.
+            std::promise<void> space;
+            dispatcher.on_space([&space]() { space.set_value(); });
+            gate.open();
+            space.get_future().wait();
+            for(;;) {
+                // Outlives this iteration if try_add_input gets in.
+                auto again = std::make_shared<std::promise<void>>();
+                dispatcher.on_space([again]() { again->set_value(); });
+                if(dispatcher.try_add_input(next)) {
+                    break;
+                }
+                again->get_future().wait();
+            }
+            ++next;
+
+            std::promise<std::exception_ptr> done;
+            dispatcher.close_async([&done](std::exception_ptr error) { done.set_value(error); });
+            CHECK(done.get_future().get() == nullptr);
+            dispatcher.close();
+            CHECK(dispatcher.get_reducer().reduced.size() == static_cast<size_t>(next));
+            bool try_threw = false;
+            try {
+                dispatcher.try_add_input(0);
+            } catch(const std::runtime_error&) {
+                try_threw = true;
+            }
+            CHECK(try_threw);
+
+            // Once finished, completion callbacks run right away.
+            bool late = false;
+            dispatcher.close_async([&late](std::exception_ptr error) { late = error == nullptr; });
+            CHECK(late);
+        }
+        {
+            IntDispatcher dispatcher([]() { return std::make_unique<IntMapper>(3); },
+                                     std::make_unique<IntReducer>(), small_pipeline());
+            try {
+                for(int i = 0; i < 10; ++i) {
+                    dispatcher.add_input(i);
+                }
+            } catch(const std::runtime_error&) {}
+            std::promise<std::exception_ptr> done;
+            dispatcher.close_async([&done](std::exception_ptr error) { done.set_value(error); });
+            std::exception_ptr error = done.get_future().get();
+            bool reported = false;
+            try {
+                if(error) std::rethrow_exception(error);
+            } catch(const std::runtime_error& e) {
+                reported = std::string(e.what()) == "Mapper failed on 3";
+            }
+            CHECK(reported);
+        }
+        std::cout << "Producer API OK" << std::endl;
     }
 };
 
 int main()
 {
+    checkpointResumeTest resume_test;
+    resume_test.run();
     simpleTestDispatcher test;
     test.run();
+    errorPropagationTest error_test;
+    error_test.run();
+    orderedQueueGapTest gap_test;
+    gap_test.run();
+    offsetOrderedTest offset_test;
+    offset_test.run();
+    memoryBudgetTest budget_test;
+    budget_test.run();
+    producerApiTest producer_test;
+    producer_test.run();
     return 0;
-}
\ No newline at end of file
+}
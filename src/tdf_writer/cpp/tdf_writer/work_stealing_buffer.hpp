@@ -0,0 +1,260 @@
+#ifndef TDF_WRITER_WORK_STEALING_BUFFER_HPP
+#define TDF_WRITER_WORK_STEALING_BUFFER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+// WorkStealingBuffer: bounded input buffer with one deque per worker, for
+// Dispatcher's mapper threads.
+//
+// Producers deal the items out round-robin in chunks of chunk_size
+// consecutive items per deque. Worker w takes from the front of deque w
+// and only when that is empty steals from the front of another one, so
+// workers are only contended by producers dealing to their own deque and
+// by thieves, instead of all meeting on one FIFO.
+//
+// Job order: items reach each deque in push order, and taking only from
+// the front preserves it per deque. A worker that is blocked pushing a
+// later result into a Dispatcher's reorder queue therefore never has the
+// next expected index waiting in its own deque (it would have taken that
+// one first, or its deque was empty when it stole and later items have
+// higher indices), so the reorder queue keeps its guarantee that the next
+// index is always being worked on or can be taken.
+//
+// capacity bounds the total number of items over all deques; push blocks
+// while it is reached.
+template <typename T>
+class WorkStealingBuffer
+{
+    struct alignas(64) WorkerQueue
+    {
+        std::mutex mtx;
+        std::deque<T> items;
+    };
+
+    std::unique_ptr<WorkerQueue[]> queues;
+    size_t num_queues;
+    size_t max_size;
+    size_t chunk_size;
+
+    // Reserved or stored items (for the capacity) and stored items (for
+    // the workers), the latter only changed under a queue lock.
+    std::atomic<size_t> occupied = 0;
+    std::atomic<size_t> available = 0;
+    std::atomic<size_t> dealt = 0;
+    std::atomic<bool> closed = false;
+
+    std::mutex space_mtx;
+    std::condition_variable space_cv;
+    std::atomic<size_t> space_waiters = 0;
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+    std::atomic<size_t> idle_workers = 0;
+
+    // Sleepers register (seq_cst) before re-checking the counters, and
+    // wakers change the counters (seq_cst) before checking for sleepers,
+    // so one of the two always sees the other.
+    void wake(std::mutex& mtx, std::condition_variable& cv, std::atomic<size_t>& waiters, bool all)
+    {
+        if(waiters.load(std::memory_order_seq_cst) != 0) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if(all) {
+                cv.notify_all();
+            } else {
+                cv.notify_one();
+            }
+        }
+    }
+
+    // Takes a slot if one is free, without waiting.
+    bool try_reserve_slot()
+    {
+        size_t count = occupied.load(std::memory_order_seq_cst);
+        while(true) {
+            if(closed.load(std::memory_order_seq_cst)) {
+                throw std::runtime_error("Push to a closed container");
+            }
+            if(count >= max_size) {
+                return false;
+            }
+            if(occupied.compare_exchange_weak(count, count + 1, std::memory_order_seq_cst)) return true;
+        }
+    }
+
+    void reserve_slot()
+    {
+        while(!try_reserve_slot()) {
+            std::unique_lock<std::mutex> lock(space_mtx);
+            space_waiters.fetch_add(1, std::memory_order_seq_cst);
+            space_cv.wait(lock, [this]() {
+                return occupied.load(std::memory_order_seq_cst) < max_size || closed.load(std::memory_order_seq_cst);
+            });
+            space_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Stores item, for which a slot is reserved, in the next deque.
+    void deal(T&& item)
+    {
+        const size_t queue = (dealt.fetch_add(1, std::memory_order_relaxed) / chunk_size) % num_queues;
+        try {
+            WorkerQueue& q = queues[queue];
+            std::lock_guard<std::mutex> lock(q.mtx);
+            q.items.push_back(std::move(item));
+            available.fetch_add(1, std::memory_order_seq_cst);
+        } catch(...) {
+            release_slots(1);
+            throw;
+        }
+        wake(idle_mtx, idle_cv, idle_workers, false);
+    }
+
+    void release_slots(size_t count)
+    {
+        if(count == 0) return;
+        const size_t before = occupied.fetch_sub(count, std::memory_order_seq_cst);
+        wake(space_mtx, space_cv, space_waiters, count > 1);
+        if(before == count && closed.load(std::memory_order_seq_cst)) {
+            // Workers waiting for the last in-flight item can now finish.
+            wake(idle_mtx, idle_cv, idle_workers, true);
+        }
+    }
+
+    size_t take(size_t queue, size_t max_n, std::vector<T>& out)
+    {
+        WorkerQueue& q = queues[queue];
+        std::lock_guard<std::mutex> lock(q.mtx);
+        size_t n = 0;
+        while(n < max_n && !q.items.empty()) {
+            out.push_back(std::move(q.items.front()));
+            q.items.pop_front();
+            ++n;
+        }
+        available.fetch_sub(n, std::memory_order_seq_cst);
+        return n;
+    }
+
+    bool finished() const
+    {
+        return closed.load(std::memory_order_seq_cst) && occupied.load(std::memory_order_seq_cst) == 0;
+    }
+
+public:
+    explicit WorkStealingBuffer(size_t max_size_, size_t num_workers = 1, size_t chunk_size_ = 1)
+        : num_queues(num_workers),
+          max_size(max_size_),
+          chunk_size(chunk_size_)
+    {
+        if(max_size == 0 || num_queues == 0 || chunk_size == 0) {
+            throw std::invalid_argument("Capacity, worker count and chunk size must be greater than zero");
+        }
+        queues.reset(new WorkerQueue[num_queues]);
+    }
+
+    WorkStealingBuffer(const WorkStealingBuffer&) = delete;
+    WorkStealingBuffer& operator=(const WorkStealingBuffer&) = delete;
+
+    // Blocks while the buffer is full; throws if it is or gets closed. A
+    // push racing close() either throws or is delivered.
+    void push(T&& item)
+    {
+        reserve_slot();
+        deal(std::move(item));
+    }
+
+    // Never blocks: returns false, leaving item untouched, if the buffer
+    // is full; throws if it is closed.
+    bool try_push(T&& item)
+    {
+        if(!try_reserve_slot()) {
+            return false;
+        }
+        deal(std::move(item));
+        return true;
+    }
+
+    template <typename... Args>
+    void emplace(Args&&... args)
+    {
+        push(T(std::forward<Args>(args)...));
+    }
+
+    template <typename Range>
+    void push_batch(Range&& items)
+    {
+        for(auto&& item : items) {
+            push(std::move(item));
+        }
+    }
+
+    // Takes up to max_n items for worker: from its own deque if it has
+    // any, otherwise from the first other deque that does. Blocks while
+    // all are empty; returns an empty vector once closed and drained.
+    std::vector<T> pop_batch(size_t worker, size_t max_n)
+    {
+        if(max_n == 0) {
+            throw std::invalid_argument("Batch size must be greater than zero");
+        }
+        if(worker >= num_queues) {
+            throw std::invalid_argument("Worker index out of range");
+        }
+        std::vector<T> items;
+        while(true) {
+            for(size_t k = 0; k < num_queues && items.empty(); ++k) {
+                take((worker + k) % num_queues, max_n, items);
+            }
+            if(!items.empty()) break;
+            std::unique_lock<std::mutex> lock(idle_mtx);
+            idle_workers.fetch_add(1, std::memory_order_seq_cst);
+            idle_cv.wait(lock, [this]() { return available.load(std::memory_order_seq_cst) > 0 || finished(); });
+            idle_workers.fetch_sub(1, std::memory_order_relaxed);
+            if(available.load(std::memory_order_seq_cst) == 0 && finished()) break;
+        }
+        release_slots(items.size());
+        return items;
+    }
+
+    std::optional<T> pop(size_t worker)
+    {
+        auto items = pop_batch(worker, 1);
+        if(items.empty()) return std::nullopt;
+        return std::move(items.front());
+    }
+
+    // Without a worker index the caller acts as worker 0.
+    std::vector<T> pop_batch(size_t max_n) { return pop_batch(0, max_n); }
+    std::optional<T> pop() { return pop(0); }
+
+    void close()
+    {
+        closed.store(true, std::memory_order_seq_cst);
+        {
+            std::lock_guard<std::mutex> lock(idle_mtx);
+            idle_cv.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(space_mtx);
+        space_cv.notify_all();
+    }
+
+    bool is_closed() const
+    {
+        return closed.load(std::memory_order_seq_cst);
+    }
+
+    inline size_t workers() const { return num_queues; }
+    inline size_t capacity() const { return max_size; }
+    // Items stored or being pushed, for monitoring (see
+    // SyncBoundedContainer::size()).
+    inline size_t size() const { return occupied.load(std::memory_order_relaxed); }
+};
+
+#endif // TDF_WRITER_WORK_STEALING_BUFFER_HPP
@@ -0,0 +1,776 @@
+#ifndef TDF_WRITER_WORKER_POOL_HPP
+#define TDF_WRITER_WORKER_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "affinity.hpp"
+#include "dispatcher.hpp"
+#include "memory_budget.hpp"
+#include "ordered_queue.hpp"
+#include "stats.hpp"
+
+
+// WorkerPool: mapper threads shared by several PooledStreams, for writing
+// many outputs at once without each one spinning up its own threads.
+//
+// Streams are served round-robin, one job at a time: a worker takes the
+// next job of the first stream after the one it served last that has a
+// job waiting and room for its result, so a stream with a deep backlog
+// cannot starve the others.
+//
+// A stream only hands out a job while fewer than its reorder window of
+// jobs are between being taken and being consumed by its reducer, so
+// results always fit in the reorder queue by count. A result that does
+// not fit the stream's memory budget is parked instead of waited for
+// (see PooledStream), so a slow or over-budget stream does not hold a
+// worker and with it the streams behind it. What does hold one is a
+// mapper that waits inside map() itself, such as OffsetWritingMapper for
+// the offset of the job before its own; that job is already on another
+// worker, so a pool needs at least two threads for it.
+//
+// Create the pool with std::make_shared; every stream keeps it alive.
+class WorkerPool
+{
+public:
+    class StreamBase
+    {
+        friend class WorkerPool;
+
+    protected:
+        std::shared_ptr<WorkerPool> pool;
+        // Guarded by pool->mtx.
+        size_t queued = 0;
+        size_t in_flight = 0;
+        size_t mapping = 0;
+        size_t max_in_flight;
+        // Results waiting for budget, and whether the budget may have room
+        // for them since the last try.
+        size_t parked = 0;
+        bool retry_parked = false;
+
+        // reorder_window_size = 0 picks the Dispatcher default for the pool size.
+        StreamBase(std::shared_ptr<WorkerPool> pool_, size_t reorder_window_size)
+            : pool(not_null(std::move(pool_))),
+              max_in_flight(reorder_window_size != 0 ? reorder_window_size
+                                                     : DispatcherOptions::default_reorder_factor * pool->size())
+        {
+        }
+        virtual ~StreamBase() = default;
+
+        static std::shared_ptr<WorkerPool> not_null(std::shared_ptr<WorkerPool> pool)
+        {
+            if(!pool) {
+                throw std::invalid_argument("Worker pool cannot be null");
+            }
+            return pool;
+        }
+
+        // A stream with parked results takes no new jobs until they are in.
+        bool ready() const { return parked > 0 ? retry_parked : queued > 0 && in_flight < max_in_flight; }
+
+        // Called with lock (on pool->mtx) held and ready(); claims the next
+        // job (or retries the parked results), updates the counters, and
+        // runs it with the lock released.
+        virtual void run_job(size_t worker, std::unique_lock<std::mutex>& lock) = 0;
+
+        std::mutex& pool_mutex() const { return pool->mtx; }
+        void notify_pool(size_t jobs) { pool->notify(jobs); }
+        void attach() { pool->attach(this); }
+        void detach() { pool->detach(this); }
+    };
+
+    // num_threads = 0 uses every hardware thread. Workers are pinned here,
+    // before there is any work for them; throws if one cannot be.
+    explicit WorkerPool(size_t num_threads = 0, AffinityPolicy affinity = AffinityPolicy::none)
+    {
+        if(num_threads == 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        const std::vector<int> cpus = ordered_cpus(affinity);
+        for(size_t i = 0; i < num_threads; ++i) {
+            std::vector<int> cpu;
+            if(!cpus.empty()) {
+                cpu.push_back(cpus[i % cpus.size()]);
+            }
+            workers.emplace_back([this, i]() { run_worker(i); });
+            try {
+                pin_thread(workers.back().native_handle(), cpu);
+            } catch(...) {
+                stop_workers();
+                throw;
+            }
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool()
+    {
+        stop_workers();
+    }
+
+    inline size_t size() const { return workers.size(); }
+
+private:
+    std::mutex mtx;
+    std::condition_variable work_cv;
+    std::vector<StreamBase*> streams;
+    size_t cursor = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void stop_workers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for(auto& t : workers) {
+            t.join();
+        }
+    }
+
+    void attach(StreamBase* stream)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        streams.push_back(stream);
+    }
+
+    void detach(StreamBase* stream)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        streams.erase(std::remove(streams.begin(), streams.end(), stream), streams.end());
+    }
+
+    void notify(size_t jobs)
+    {
+        if(jobs == 1) {
+            work_cv.notify_one();
+        } else if(jobs > 1) {
+            work_cv.notify_all();
+        }
+    }
+
+    // Caller holds mtx.
+    StreamBase* next_ready()
+    {
+        for(size_t k = 0; k < streams.size(); ++k) {
+            const size_t i = (cursor + k) % streams.size();
+            if(streams[i]->ready()) {
+                cursor = i + 1;
+                return streams[i];
+            }
+        }
+        return nullptr;
+    }
+
+    void run_worker(size_t worker)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        while(true) {
+            StreamBase* stream = next_ready();
+            if(stream) {
+                stream->run_job(worker, lock);
+            } else if(stopping) {
+                return;
+            } else {
+                work_cv.wait(lock);
+            }
+        }
+    }
+};
+
+
+// One ordered output of a WorkerPool: the counterpart of a Dispatcher
+// whose mapper threads are the pool's. Jobs are numbered per stream and
+// reduced in that order on the stream's own reducer thread.
+//
+// The interface follows Dispatcher: add_input / emplace_input block while
+// input_buffer_size jobs are waiting, close() waits for everything to be
+// reduced, and the reducer may be inspected once is_closed(). Failures
+// and cancel() stop the stream as in Dispatcher; the pool and its other
+// streams carry on. try_add_input, on_space and close_async let an event
+// loop feed streams without blocking, as in Dispatcher.
+template <typename Mapper_t, typename Reducer_t,
+          template <typename> class ReorderQueue_t = SyncReorderWindow>
+class PooledStream : public WorkerPool::StreamBase
+{
+public:
+    using InputType = typename Mapper_t::InputType;
+    using IntermediateType = typename Mapper_t::OutputType;
+    static_assert(std::is_same<IntermediateType, typename Reducer_t::InputType>::value,
+                  "Mapper output type must match Reducer input type");
+
+    static constexpr size_t max_reduce_batch = 256;
+
+    // mapper_factory is called once per pool thread, so every worker has
+    // its own mapper for this stream. 0 sizes pick the Dispatcher
+    // defaults for the pool size; first_job_index, memory_budget and
+    // collect_timings are as in DispatcherOptions.
+    PooledStream(std::shared_ptr<WorkerPool> pool_,
+                 std::function<std::unique_ptr<Mapper_t>()> mapper_factory,
+                 std::unique_ptr<Reducer_t> reducer_,
+                 size_t input_buffer_size = 0,
+                 size_t reorder_window_size = 0,
+                 size_t first_job_index = 0,
+                 std::shared_ptr<MemoryBudget> memory_budget_ = nullptr,
+                 bool collect_timings_ = true)
+        : StreamBase(std::move(pool_), reorder_window_size),
+          next_job_index(first_job_index),
+          intermediate_queue(max_in_flight, first_job_index),
+          reducer(std::move(reducer_)),
+          max_queued(input_buffer_size != 0 ? input_buffer_size : pool->size() + 1),
+          memory_budget(std::move(memory_budget_)),
+          collect_timings(collect_timings_)
+    {
+        if(!mapper_factory) {
+            throw std::invalid_argument("Mapper factory cannot be empty");
+        }
+        if(!reducer) {
+            throw std::invalid_argument("Reducer cannot be null");
+        }
+        for(size_t i = 0; i < pool->size(); ++i) {
+            mappers.push_back(mapper_factory());
+            if(!mappers.back()) {
+                throw std::invalid_argument("Mapper factory returned null");
+            }
+        }
+        if(memory_budget) {
+            intermediate_queue.set_memory_budget(memory_budget);
+        }
+        reducer_thread = std::thread([this]() { run_reducer(); });
+        attach();
+        // Last, so that a constructor that throws never leaves the budget
+        // with a listener into this stream. Until now there is no input,
+        // hence nothing parked or waiting to be woken.
+        if(memory_budget) {
+            memory_budget->subscribe(this, [this]() {
+                std::lock_guard<std::mutex> lock(pool_mutex());
+                space_cv.notify_all();
+                if(parked > 0 && !retry_parked) {
+                    retry_parked = true;
+                    notify_pool(1);
+                }
+            });
+        }
+    }
+
+    PooledStream(const PooledStream&) = delete;
+    PooledStream& operator=(const PooledStream&) = delete;
+
+    ~PooledStream()
+    {
+        try {
+            close();
+        } catch(...) {}
+        if(memory_budget) {
+            memory_budget->unsubscribe(this);
+        }
+    }
+
+    void add_input(const InputType& input)
+    {
+        emplace_input(input);
+    }
+
+    void add_input(InputType&& input)
+    {
+        emplace_input(std::move(input));
+    }
+
+    // With a memory budget the input is built first, to be weighed, and
+    // the call also blocks while the budget cannot take it.
+    template <typename... Args>
+    void emplace_input(Args&&... args)
+    {
+        if(memory_budget) {
+            InputType input(std::forward<Args>(args)...);
+            const size_t bytes = memory_footprint(input);
+            queue_input(bytes, std::move(input));
+        } else {
+            queue_input(0, std::forward<Args>(args)...);
+        }
+    }
+
+    // As in Dispatcher: returns false, leaving input untouched, while
+    // add_input would block.
+    bool try_add_input(const InputType& input)
+    {
+        return offer_input(input);
+    }
+
+    bool try_add_input(InputType&& input)
+    {
+        return offer_input(std::move(input));
+    }
+
+    // As Dispatcher::on_space(); callbacks are run by the pool threads
+    // taking this stream's jobs.
+    void on_space(std::function<void()> callback)
+    {
+        space.add(std::move(callback));
+    }
+
+    // Blocks until every job added so far has been reduced; idempotent.
+    // Rethrows the first failure, as Dispatcher::close().
+    void close()
+    {
+        std::lock_guard<std::mutex> close_lock(close_mtx);
+        if(!closed) {
+            finish_close();
+        }
+        errors.rethrow();
+    }
+
+    // As Dispatcher::close_async(); done is called from the stream's
+    // reducer thread.
+    void close_async(std::function<void(std::exception_ptr)> done)
+    {
+        completion.add(std::move(done));
+        close_input();
+    }
+
+    // As Dispatcher::cancel().
+    void cancel()
+    {
+        if(!closed && errors.stop()) {
+            abort();
+        }
+        try {
+            close();
+        } catch(...) {}
+    }
+
+    inline bool is_closed() const { return closed; }
+
+    inline Reducer_t& get_reducer() { return *reducer; }
+    inline const Reducer_t& get_reducer() const { return *reducer; }
+
+    // Same fields as Dispatcher::stats(), except for the input buffer
+    // figures, which belong to the pool.
+    DispatcherStats stats() const
+    {
+        DispatcherStats result;
+        result.jobs_added = counters.jobs_added.load(std::memory_order_relaxed);
+        result.jobs_mapped = counters.jobs_mapped.load(std::memory_order_relaxed);
+        result.jobs_reduced = counters.jobs_reduced.load(std::memory_order_relaxed);
+        result.add_input_ns = counters.add_input_ns.snapshot();
+        result.map_ns = counters.map_ns.snapshot();
+        result.reorder_push_ns = counters.reorder_push_ns.snapshot();
+        result.reducer_wait_ns = counters.reducer_wait_ns.snapshot();
+        result.reduce_ns = counters.reduce_ns.snapshot();
+        result.reduce_batch_size = counters.reduce_batch_size.snapshot();
+        result.reorder_queue = intermediate_queue.stats();
+        return result;
+    }
+
+    // As in Dispatcher. Results never wait for room in the reorder queue
+    // here, so a slow reducer shows as the queue filling up to the window.
+    double input_fill() const
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex());
+        return static_cast<double>(queued) / static_cast<double>(max_queued);
+    }
+    inline double reorder_fill() const { return container_fill(intermediate_queue); }
+
+protected:
+    void run_job(size_t worker, std::unique_lock<std::mutex>& lock) override
+    {
+        if(parked > 0) {
+            push_parked(lock);
+            return;
+        }
+        std::pair<size_t, InputType> job = std::move(inputs.front());
+        inputs.pop_front();
+        const size_t bytes = memory_budget ? memory_footprint(job.second) : 0;
+        --queued;
+        ++in_flight;
+        ++mapping;
+        space_cv.notify_one();
+        lock.unlock();
+        space.run();
+
+        try {
+            Timing mapping_time(counters.map_ns, collect_timings);
+            IntermediateType result = map_job(*mappers[worker], job.first, std::move(job.second));
+            mapping_time.record();
+            counters.jobs_mapped.fetch_add(1, std::memory_order_relaxed);
+            Timing pushing(counters.reorder_push_ns, collect_timings);
+            std::pair<size_t, IntermediateType> item(job.first, std::move(result));
+            if(!memory_budget) {
+                intermediate_queue.push(std::move(item));
+            } else if(!intermediate_queue.try_push(std::move(item))) {
+                park(std::move(item));
+            }
+            pushing.record();
+        } catch(...) {
+            fail(std::current_exception());
+        }
+        if(bytes > 0) {
+            lock.lock();
+            input_bytes -= bytes;
+            if(input_bytes == 0) {
+                // Lets in an input that is over the budget, see admit_input.
+                space_cv.notify_all();
+            }
+            lock.unlock();
+            release_input(bytes);
+            space.run();
+        }
+
+        // The stream may be destroyed once mapping drops to 0 and the
+        // lock is released.
+        lock.lock();
+        --mapping;
+        if(drained()) {
+            drained_cv.notify_all();
+            intermediate_queue.close();
+        }
+    }
+
+private:
+    struct Counters
+    {
+        std::atomic<uint64_t> jobs_added = 0;
+        std::atomic<uint64_t> jobs_mapped = 0;
+        std::atomic<uint64_t> jobs_reduced = 0;
+        Histogram add_input_ns;
+        Histogram map_ns;
+        Histogram reorder_push_ns;
+        Histogram reducer_wait_ns;
+        Histogram reduce_ns;
+        Histogram reduce_batch_size;
+    };
+
+    // Queues a job once there is room for it, bytes being its charge to
+    // the memory budget (0 without one).
+    template <typename... Args>
+    void queue_input(size_t bytes, Args&&... args)
+    {
+        Timing call(counters.add_input_ns, collect_timings);
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex());
+            // input_closed is checked first: once admit_input() is true,
+            // bytes are charged.
+            auto ready = [this, bytes]() { return input_closed || (queued < max_queued && admit_input(bytes)); };
+            if(!ready()) {
+                MemoryBudget::Waiter waiter(memory_budget.get());
+                space_cv.wait(lock, ready);
+            }
+            if(input_closed) {
+                throw_closed();
+            }
+            input_bytes += bytes;
+            try {
+                inputs.emplace_back(std::piecewise_construct,
+                                    std::forward_as_tuple(next_job_index),
+                                    std::forward_as_tuple(std::forward<Args>(args)...));
+            } catch(...) {
+                input_bytes -= bytes;
+                lock.unlock();
+                release_input(bytes);
+                throw;
+            }
+            ++next_job_index;
+            ++queued;
+        }
+        notify_pool(1);
+        counters.jobs_added.fetch_add(1, std::memory_order_relaxed);
+        call.record();
+    }
+
+    template <typename Input>
+    bool offer_input(Input&& input)
+    {
+        Timing call(counters.add_input_ns, collect_timings);
+        const size_t bytes = memory_budget ? memory_footprint(input) : 0;
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex());
+            if(input_closed) {
+                throw_closed();
+            }
+            if(queued >= max_queued || !admit_input(bytes)) {
+                return false;
+            }
+            input_bytes += bytes;
+            try {
+                inputs.emplace_back(next_job_index, std::forward<Input>(input));
+            } catch(...) {
+                input_bytes -= bytes;
+                lock.unlock();
+                release_input(bytes);
+                throw;
+            }
+            ++next_job_index;
+            ++queued;
+        }
+        notify_pool(1);
+        counters.jobs_added.fetch_add(1, std::memory_order_relaxed);
+        call.record();
+        return true;
+    }
+
+    [[noreturn]] void throw_closed() const
+    {
+        errors.rethrow();
+        throw std::runtime_error(errors.stopping() ? "Stream was cancelled" : "Cannot add input to closed stream");
+    }
+
+    // Caller holds the pool mutex. As in Dispatcher, inputs are charged
+    // until they have been mapped, and the first one while none is held
+    // always gets in.
+    bool admit_input(size_t bytes)
+    {
+        if(!memory_budget) {
+            return true;
+        }
+        if(input_bytes == 0) {
+            memory_budget->force_acquire(bytes);
+            return true;
+        }
+        return memory_budget->try_acquire(bytes);
+    }
+
+    // Caller does not hold the pool mutex, see MemoryBudget.
+    void release_input(size_t bytes)
+    {
+        if(bytes > 0) {
+            memory_budget->release(bytes);
+        }
+    }
+
+    // Caller holds the pool mutex. Once the input is closed and its last
+    // job mapped, whoever saw that closes the reorder queue (under the
+    // pool mutex, so the stream cannot be closed and destroyed meanwhile).
+    bool drained() const
+    {
+        return input_closed && queued == 0 && mapping == 0 && parked == 0;
+    }
+
+    // Keeps a result the reorder queue has no budget for rather than
+    // waiting for it on a pool worker. The stream counts as waiting for
+    // the budget while anything is parked, so that releases wake it; the
+    // first try is right away, in case the release came before that.
+    // Parked results are held on top of the budget, at most one per
+    // worker, as the stream takes no new jobs meanwhile.
+    void park(std::pair<size_t, IntermediateType> item)
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex());
+        if(aborted) {
+            return;
+        }
+        if(!parked_waiter) {
+            parked_waiter.emplace(memory_budget.get());
+        }
+        parked_results.push_back(std::move(item));
+        ++parked;
+        retry_parked = true;
+        notify_pool(1);
+    }
+
+    // Caller holds lock (on the pool mutex); called instead of a job while
+    // results are parked. Offers every one of them to the reorder queue,
+    // which always takes its next index, and parks the others again.
+    void push_parked(std::unique_lock<std::mutex>& lock)
+    {
+        std::deque<std::pair<size_t, IntermediateType>> pending;
+        pending.swap(parked_results);
+        const size_t tried = pending.size();
+        retry_parked = false;
+        ++mapping;
+        lock.unlock();
+
+        std::deque<std::pair<size_t, IntermediateType>> refused;
+        try {
+            Timing pushing(counters.reorder_push_ns, collect_timings);
+            for(auto& item : pending) {
+                if(!intermediate_queue.try_push(std::move(item))) {
+                    refused.push_back(std::move(item));
+                }
+            }
+            pushing.record();
+        } catch(...) {
+            fail(std::current_exception());
+            refused.clear();
+        }
+        pending.clear();
+
+        lock.lock();
+        if(aborted) {
+            parked -= tried;
+        } else {
+            parked -= tried - refused.size();
+            for(auto& item : refused) {
+                parked_results.push_back(std::move(item));
+            }
+        }
+        if(parked == 0) {
+            parked_waiter.reset();
+        }
+        --mapping;
+        if(drained()) {
+            drained_cv.notify_all();
+            intermediate_queue.close();
+        }
+    }
+
+    // Stops accepting inputs and wakes the producers waiting for room, so
+    // that they throw.
+    void close_input()
+    {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex());
+            input_closed = true;
+            space_cv.notify_all();
+            if(drained()) {
+                intermediate_queue.close();
+            }
+        }
+        space.run();
+    }
+
+    // Caller holds close_mtx.
+    void finish_close()
+    {
+        close_input();
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex());
+            drained_cv.wait(lock, [this]() { return drained(); });
+        }
+        if(reducer_thread.joinable()) {
+            reducer_thread.join();
+        }
+        detach();
+        closed = true;
+    }
+
+    void run_reducer()
+    {
+        std::vector<IntermediateType> batch;
+        batch.reserve(max_reduce_batch);
+        try {
+            while(true) {
+                Timing waiting(counters.reducer_wait_ns, collect_timings);
+                auto items = intermediate_queue.pop_batch(max_reduce_batch);
+                waiting.record();
+                if(items.empty() || errors.stopping()) break; // Queue closed and empty, or stopped
+                {
+                    std::lock_guard<std::mutex> lock(pool_mutex());
+                    in_flight -= items.size();
+                }
+                notify_pool(items.size());
+                for(auto& item : items) {
+                    batch.push_back(std::move(item.second));
+                }
+                Timing reducing(counters.reduce_ns, collect_timings);
+                reducer->reduce_batch(batch);
+                reducing.record();
+                counters.reduce_batch_size.record(batch.size());
+                counters.jobs_reduced.fetch_add(batch.size(), std::memory_order_relaxed);
+                batch.clear();
+            }
+            if(!errors.stopping()) {
+                reducer->finish();
+            }
+        } catch(...) {
+            fail(std::current_exception());
+        }
+        {
+            // A stopped stream may still have jobs being mapped.
+            std::unique_lock<std::mutex> lock(pool_mutex());
+            drained_cv.wait(lock, [this]() { return drained(); });
+        }
+        completion.complete(errors.error());
+    }
+
+    void fail(std::exception_ptr error)
+    {
+        if(errors.capture(std::move(error))) {
+            abort();
+        }
+    }
+
+    // Drops the queued jobs and closes the input, so the pool stops
+    // handing out jobs of this stream and close() only waits for the jobs
+    // being mapped; closing the reorder queue wakes the reducer. The
+    // dropped inputs are destroyed outside the pool mutex.
+    void abort()
+    {
+        std::deque<std::pair<size_t, InputType>> dropped;
+        std::deque<std::pair<size_t, IntermediateType>> dropped_results;
+        size_t dropped_bytes = 0;
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex());
+            input_closed = true;
+            aborted = true;
+            dropped.swap(inputs);
+            queued = 0;
+            dropped_results.swap(parked_results);
+            parked -= dropped_results.size();
+            if(parked == 0) {
+                parked_waiter.reset();
+            }
+            if(memory_budget) {
+                for(const auto& job : dropped) {
+                    dropped_bytes += memory_footprint(job.second);
+                }
+                input_bytes -= dropped_bytes;
+            }
+            space_cv.notify_all();
+            if(mapping == 0) {
+                drained_cv.notify_all();
+            }
+        }
+        release_input(dropped_bytes);
+        intermediate_queue.close();
+        space.run();
+        for(auto& mapper : mappers) {
+            cancel_mapper(*mapper);
+        }
+    }
+
+    // Guarded by the pool mutex.
+    std::deque<std::pair<size_t, InputType>> inputs;
+    size_t next_job_index;
+    bool input_closed = false;
+    // Bytes charged to memory_budget for inputs not yet mapped.
+    size_t input_bytes = 0;
+    // The results counted by parked, other than those being retried.
+    // The waiter is held while parked > 0.
+    std::deque<std::pair<size_t, IntermediateType>> parked_results;
+    std::optional<MemoryBudget::Waiter> parked_waiter;
+    bool aborted = false;
+    std::condition_variable space_cv;
+    std::condition_variable drained_cv;
+
+    ReorderQueue_t<IntermediateType> intermediate_queue;
+    std::vector<std::unique_ptr<Mapper_t>> mappers;
+    std::unique_ptr<Reducer_t> reducer;
+    std::thread reducer_thread;
+    size_t max_queued;
+    std::shared_ptr<MemoryBudget> memory_budget;
+    bool collect_timings;
+    std::mutex close_mtx;
+    std::atomic<bool> closed = false;
+    PipelineError errors;
+    SpaceCallbacks space;
+    CompletionCallbacks completion;
+    Counters counters;
+};
+
+#endif // TDF_WRITER_WORKER_POOL_HPP
@@ -0,0 +1,278 @@
+#ifndef TDF_WRITER_ZSTD_DICTIONARY_HPP
+#define TDF_WRITER_ZSTD_DICTIONARY_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zdict.h>
+#include <zstd.h>
+
+#include "staged_file_writer.hpp"
+
+
+// zstd dictionary trained on the first frames of a write and shared by
+// all compressors of the pipeline (see TdfFrameCompressor).
+//
+// Small MS/MS frames compress poorly on their own: there is too little
+// data for zstd to learn the byte statistics from. A dictionary trained
+// on typical frames supplies them up front, which improves both the ratio
+// and the speed on such frames.
+//
+// Until training_frames frames have been sampled, frames are compressed
+// without a dictionary. The last sample starts a thread of its own that
+// trains the dictionary, writes it to path, syncs it, and only then makes
+// it available, so no block depending on it can reach the output before
+// the dictionary is on disk. Training takes a while; running it inside a
+// job would hold up that job's index in the reorder queue and with it
+// the whole pipeline, so instead every compressor, including the one
+// that gave the last sample, carries on without the dictionary meanwhile.
+// Every later frame is compressed with it through a ZSTD_CDict per
+// compression level, shared read-only by all compressors.
+//
+// Compatibility: such blocks are still ordinary zstd frames, but they
+// carry the dictionary's ID and can only be decompressed with the
+// dictionary file (e.g. zstd -D). Readers that know nothing about it
+// (Bruker's included) cannot read them, so dictionaries are opt-in;
+// without one the output stays in plain TDF format. The frames written
+// before training are plain in either case.
+//
+// If training or writing the dictionary fails, the write falls back to
+// plain compression for good; failure() tells why.
+struct DictionaryOptions
+{
+    // Frames sampled for training.
+    size_t training_frames = 1000;
+    // Capacity of the dictionary, in bytes (the zstd CLI default).
+    size_t dictionary_size = 112640;
+    // Frames whose payload is larger than this are not sampled: they
+    // compress well without a dictionary and would dominate training.
+    size_t max_sample_size = 128 * 1024;
+    // Where the trained dictionary is stored, in zstd's dictionary format.
+    std::string path;
+    // Load the dictionary from path if it exists instead of training one,
+    // so that a resumed write keeps using the dictionary of its earlier
+    // blocks.
+    bool resume = false;
+};
+
+class SharedZstdDictionary
+{
+public:
+    enum class State
+    {
+        collecting,
+        training,
+        ready,
+        failed,
+    };
+
+private:
+    struct CDictDeleter {
+        void operator()(ZSTD_CDict* cdict) const { ZSTD_freeCDict(cdict); }
+    };
+
+    DictionaryOptions settings;
+    std::atomic<State> current = State::collecting;
+
+    // Guarded by mtx while collecting.
+    std::mutex mtx;
+    std::vector<char> samples;
+    std::vector<size_t> sample_sizes;
+    std::string error;
+
+    // Immutable once ready.
+    std::vector<char> dictionary;
+    unsigned dictionary_id = 0;
+
+    std::mutex cdict_mtx;
+    std::map<int, std::unique_ptr<ZSTD_CDict, CDictDeleter>> cdicts;
+
+    // Started under mtx by the last sample, joined on destruction.
+    std::thread trainer;
+
+    void fail(std::string message)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            error = std::move(message);
+        }
+        current.store(State::failed, std::memory_order_release);
+    }
+
+    void publish(std::vector<char> trained)
+    {
+        dictionary = std::move(trained);
+        dictionary_id = ZSTD_getDictID_fromDict(dictionary.data(), dictionary.size());
+        current.store(State::ready, std::memory_order_release);
+    }
+
+    void store(const std::vector<char>& trained) const
+    {
+        const std::string tmp = settings.path + ".tmp";
+        const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) {
+            throw_errno("Failed to open dictionary " + tmp);
+        }
+        try {
+            pwrite_all(fd, trained.data(), trained.size(), 0);
+            if(::fdatasync(fd) != 0) {
+                throw_errno("Failed to sync dictionary " + tmp);
+            }
+        } catch(...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        if(::rename(tmp.c_str(), settings.path.c_str()) != 0) {
+            throw_errno("Failed to rename dictionary to " + settings.path);
+        }
+        sync_parent_directory(settings.path);
+    }
+
+    bool load()
+    {
+        const int fd = ::open(settings.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            if(errno == ENOENT) return false;
+            throw_errno("Failed to open dictionary " + settings.path);
+        }
+        struct stat st;
+        std::vector<char> loaded;
+        bool complete = ::fstat(fd, &st) == 0;
+        if(complete) {
+            loaded.resize(static_cast<size_t>(st.st_size));
+            size_t done = 0;
+            while(done < loaded.size()) {
+                const ssize_t n = ::pread(fd, loaded.data() + done, loaded.size() - done, static_cast<off_t>(done));
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) break;
+                done += static_cast<size_t>(n);
+            }
+            complete = done == loaded.size();
+        }
+        ::close(fd);
+        if(!complete || loaded.empty()) {
+            throw std::runtime_error("Failed to read dictionary " + settings.path);
+        }
+        publish(std::move(loaded));
+        return true;
+    }
+
+    void train(std::vector<char> sampled, std::vector<size_t> sizes)
+    {
+        std::vector<char> trained(settings.dictionary_size);
+        const size_t size = ZDICT_trainFromBuffer(trained.data(), trained.size(), sampled.data(), sizes.data(),
+                                                  static_cast<unsigned>(sizes.size()));
+        if(ZDICT_isError(size)) {
+            fail(std::string("Dictionary training failed: ") + ZDICT_getErrorName(size));
+            return;
+        }
+        trained.resize(size);
+        try {
+            store(trained);
+        } catch(const std::exception& e) {
+            fail(e.what());
+            return;
+        }
+        publish(std::move(trained));
+    }
+
+public:
+    explicit SharedZstdDictionary(const DictionaryOptions& options)
+        : settings(options)
+    {
+        if(settings.training_frames == 0 || settings.dictionary_size == 0) {
+            throw std::invalid_argument("Training frames and dictionary size must be greater than zero");
+        }
+        if(settings.path.empty()) {
+            throw std::invalid_argument("Dictionary path cannot be empty");
+        }
+        if(settings.resume) {
+            load();
+        } else if(::unlink(settings.path.c_str()) != 0 && errno != ENOENT) {
+            throw_errno("Failed to remove old dictionary " + settings.path);
+        }
+    }
+
+    SharedZstdDictionary(const SharedZstdDictionary&) = delete;
+    SharedZstdDictionary& operator=(const SharedZstdDictionary&) = delete;
+
+    // Waits for a training still running, e.g. after a short write.
+    ~SharedZstdDictionary()
+    {
+        if(trainer.joinable()) {
+            trainer.join();
+        }
+    }
+
+    inline State state() const { return current.load(std::memory_order_acquire); }
+    inline bool ready() const { return state() == State::ready; }
+
+    // Offers the (preprocessed) payload of a frame just compressed without
+    // the dictionary as a training sample; starts training in the
+    // background once enough are in. Thread-safe; a no-op once training
+    // has started.
+    void add_sample(const char* data, size_t size)
+    {
+        if(state() != State::collecting || size == 0 || size > settings.max_sample_size) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        if(current.load(std::memory_order_relaxed) != State::collecting) {
+            return;
+        }
+        samples.insert(samples.end(), data, data + size);
+        sample_sizes.push_back(size);
+        if(sample_sizes.size() < settings.training_frames) {
+            return;
+        }
+        current.store(State::training, std::memory_order_release);
+        trainer = std::thread([this, sampled = std::move(samples), sizes = std::move(sample_sizes)]() mutable {
+            train(std::move(sampled), std::move(sizes));
+        });
+    }
+
+    // The dictionary digested for level, or nullptr while it is not
+    // ready. Thread-safe; the result lives as long as this object.
+    const ZSTD_CDict* cdict(int level)
+    {
+        if(!ready()) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(cdict_mtx);
+        auto& cdict = cdicts[level];
+        if(!cdict) {
+            cdict.reset(ZSTD_createCDict(dictionary.data(), dictionary.size(), level));
+            if(!cdict) {
+                throw std::bad_alloc();
+            }
+        }
+        return cdict.get();
+    }
+
+    // Empty and 0 until ready(); the trainer thread may be filling them in.
+    inline std::span<const char> data() const { return ready() ? std::span<const char>(dictionary) : std::span<const char>(); }
+    inline unsigned id() const { return ready() ? dictionary_id : 0; }
+    inline const std::string& path() const { return settings.path; }
+
+    // Why the dictionary failed, if state() is failed.
+    std::string failure()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return error;
+    }
+};
+
+#endif // TDF_WRITER_ZSTD_DICTIONARY_HPP